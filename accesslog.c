@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+int log_verbosity;
+
+/* The calling thread's ring; only one access log is ever open. */
+static __thread accesslog_ring_t *local_ring;
+
+/* Sets *FORMAT to the format called NAME. Returns -1 if there is none. */
+int accesslog_parse_format(char *name, accesslog_format_t *format) {
+  if (strcmp(name, "common") == 0) {
+    *format = ACCESSLOG_COMMON;
+  } else if (strcmp(name, "combined") == 0) {
+    *format = ACCESSLOG_COMBINED;
+  } else if (strcmp(name, "json") == 0) {
+    *format = ACCESSLOG_JSON;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns the calling thread's ring, taking over a retired one or creating
+ * and registering a new one on first use, or NULL if it cannot be
+ * allocated. A retired ring may still hold records for the flusher; the new
+ * owner simply carries on after them. */
+static accesslog_ring_t *accesslog_local_ring(accesslog_t *log) {
+  if (local_ring != NULL) return local_ring;
+  accesslog_ring_t *ring = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE);
+  for (; ring != NULL; ring = ring->next) {
+    int retired = 1;
+    if (__atomic_load_n(&ring->retired, __ATOMIC_RELAXED)
+        && __atomic_compare_exchange_n(&ring->retired, &retired, 0, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return local_ring = ring;
+  }
+  if (posix_memalign((void **) &ring, WQ_CACHE_LINE,
+        sizeof(accesslog_ring_t)) != 0)
+    return NULL;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->dropped = 0;
+  ring->retired = 0;
+  ring->next = __atomic_load_n(&log->rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&log->rings, &ring->next, ring, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  local_ring = ring;
+  return ring;
+}
+
+/* Gives up the calling thread's ring, which it must not write to again, to
+ * whichever thread logs next. */
+void accesslog_retire_thread(void) {
+  if (local_ring == NULL) return;
+  __atomic_store_n(&local_ring->retired, 1, __ATOMIC_RELEASE);
+  local_ring = NULL;
+}
+
+/* Copies at most SIZE - 1 bytes of the LENGTH bytes at VALUE into FIELD. */
+static void accesslog_copy(char *field, size_t size, char *value,
+    size_t length) {
+  if (value == NULL) length = 0;
+  if (length >= size) length = size - 1;
+  memcpy(field, value, length);
+  field[length] = '\0';
+}
+
+/* Queues a record of REQUEST (which may be NULL if it could not be parsed)
+ * from PEER (NULL if unknown), answered with STATUS_CODE and BYTES body
+ * bytes (-1 if unknown), that started at START (CLOCK_MONOTONIC; NULL if
+ * unknown). Never
+ * blocks: the record is dropped if the thread's ring is full. */
+void accesslog_write(accesslog_t *log, struct sockaddr *peer,
+    struct http_request *request, int status_code, long long bytes,
+    struct timespec *start) {
+  accesslog_ring_t *ring = accesslog_local_ring(log);
+  if (ring == NULL) return;
+
+  unsigned int head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+      >= ACCESSLOG_RING_SIZE) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  accesslog_record_t *record =
+      &ring->records[head & (ACCESSLOG_RING_SIZE - 1)];
+
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  record->duration_us = 0;
+  if (start != NULL) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record->duration_us = (now.tv_sec - start->tv_sec) * 1000000
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+  }
+  record->status_code = status_code;
+  record->bytes = bytes;
+  record->peer.sa.sa_family = AF_UNSPEC;
+  if (peer != NULL && peer->sa_family == AF_INET) {
+    record->peer.in = *(struct sockaddr_in *) peer;
+  } else if (peer != NULL && peer->sa_family == AF_INET6) {
+    record->peer.in6 = *(struct sockaddr_in6 *) peer;
+  }
+
+  if (request != NULL) {
+    char *referer = http_request_header(request, "Referer");
+    char *user_agent = http_request_header(request, "User-Agent");
+    record->http_minor = request->http_minor;
+    accesslog_copy(record->method, sizeof(record->method), request->method,
+        request->method_length);
+    accesslog_copy(record->path, sizeof(record->path), request->path,
+        request->path_length);
+    accesslog_copy(record->referer, sizeof(record->referer), referer,
+        referer ? strlen(referer) : 0);
+    accesslog_copy(record->user_agent, sizeof(record->user_agent),
+        user_agent, user_agent ? strlen(user_agent) : 0);
+  } else {
+    record->http_minor = 1;
+    record->method[0] = '\0';
+    record->path[0] = '\0';
+    record->referer[0] = '\0';
+    record->user_agent[0] = '\0';
+  }
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns how many records have been dropped because a ring was full. */
+unsigned long accesslog_dropped(accesslog_t *log) {
+  unsigned long dropped = 0;
+  accesslog_ring_t *ring = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE);
+  for (; ring != NULL; ring = ring->next)
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  return dropped;
+}
+
+/* FLUSHER */
+
+/* Writes out LOG's buffered lines. */
+static void accesslog_flush(accesslog_t *log) {
+  size_t written = 0;
+  while (written < log->length) {
+    ssize_t n = write(log->fd, log->buffer + written, log->length - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      perror("Failed to write access log");
+      break;
+    }
+    written += n;
+  }
+  log->length = 0;
+}
+
+/* Appends VALUE to OUT, escaping it for a quoted field of the common log
+ * format (as \xHH) or, if JSON, for a JSON string. An empty VALUE is written
+ * as "-" in the common format. Returns the end of the output. */
+static char *accesslog_escape(char *out, char *value, int json) {
+  static const char hex[] = "0123456789ABCDEF";
+  if (!json && value[0] == '\0') {
+    *out++ = '-';
+    return out;
+  }
+  for (unsigned char *c = (unsigned char *) value; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      *out++ = '\\';
+      if (json) {
+        *out++ = *c;
+        continue;
+      }
+      *out++ = 'x';
+      *out++ = hex[*c >> 4];
+      *out++ = hex[*c & 15];
+    } else if (*c < 0x20 || (!json && *c >= 0x7f)) {
+      if (json) {
+        out += sprintf(out, "\\u%04x", *c);
+      } else {
+        out += sprintf(out, "\\x%c%c", hex[*c >> 4], hex[*c & 15]);
+      }
+    } else {
+      *out++ = *c;
+    }
+  }
+  return out;
+}
+
+/* Formats the peer address of RECORD into OUT (INET6_ADDRSTRLEN bytes). */
+static void accesslog_format_peer(accesslog_record_t *record, char *out) {
+  const char *result = NULL;
+  if (record->peer.sa.sa_family == AF_INET) {
+    result = inet_ntop(AF_INET, &record->peer.in.sin_addr, out,
+        INET6_ADDRSTRLEN);
+  } else if (record->peer.sa.sa_family == AF_INET6) {
+    result = inet_ntop(AF_INET6, &record->peer.in6.sin6_addr, out,
+        INET6_ADDRSTRLEN);
+  }
+  if (result == NULL) strcpy(out, "-");
+}
+
+/* Refreshes LOG's cached timestamp text if TIME is in another second. */
+static void accesslog_format_time(accesslog_t *log, struct timespec *time) {
+  if (time->tv_sec == log->cached_second) return;
+  struct tm tm;
+  localtime_r(&time->tv_sec, &tm);
+  log->cached_second = time->tv_sec;
+  if (log->format != ACCESSLOG_JSON) {
+    strftime(log->cached_time, sizeof(log->cached_time),
+        "%d/%b/%Y:%H:%M:%S %z", &tm);
+    return;
+  }
+  /* ISO 8601 wants the zone as +hh:mm. */
+  char zone[8];
+  strftime(log->cached_time, sizeof(log->cached_time), "%Y-%m-%dT%H:%M:%S",
+      &tm);
+  strftime(zone, sizeof(zone), "%z", &tm);
+  snprintf(log->cached_zone, sizeof(log->cached_zone), "%.3s:%.2s", zone,
+      zone + 3);
+}
+
+/* Appends RECORD as one line to LOG's buffer, which must have room for
+ * ACCESSLOG_MAX_LINE more bytes. */
+static void accesslog_format(accesslog_t *log, accesslog_record_t *record) {
+  char *start = log->buffer + log->length;
+  char *out = start;
+  char peer[INET6_ADDRSTRLEN];
+  char bytes[24] = "-";
+  char status[16] = "-";
+  int json = log->format == ACCESSLOG_JSON;
+
+  accesslog_format_peer(record, peer);
+  accesslog_format_time(log, &record->time);
+  if (record->bytes >= 0) snprintf(bytes, sizeof(bytes), "%lld", record->bytes);
+  if (record->status_code > 0)
+    snprintf(status, sizeof(status), "%d", record->status_code);
+
+  if (json) {
+    out += sprintf(out, "{\"time\":\"%s.%03ld%s\",\"remote_addr\":\"%s\","
+        "\"method\":\"", log->cached_time, record->time.tv_nsec / 1000000,
+        log->cached_zone, peer);
+    out = accesslog_escape(out, record->method, 1);
+    out += sprintf(out, "\",\"path\":\"");
+    out = accesslog_escape(out, record->path, 1);
+    out += sprintf(out, "\",\"protocol\":\"HTTP/1.%d\",\"status\":%s,"
+        "\"bytes\":%s,\"duration_us\":%lu,\"referer\":\"",
+        record->http_minor, record->status_code > 0 ? status : "null",
+        record->bytes >= 0 ? bytes : "null", record->duration_us);
+    out = accesslog_escape(out, record->referer, 1);
+    out += sprintf(out, "\",\"user_agent\":\"");
+    out = accesslog_escape(out, record->user_agent, 1);
+    out += sprintf(out, "\"}\n");
+  } else {
+    out += sprintf(out, "%s - - [%s] \"", peer, log->cached_time);
+    if (record->method[0] == '\0') {
+      *out++ = '-';
+    } else {
+      out = accesslog_escape(out, record->method, 0);
+      *out++ = ' ';
+      out = accesslog_escape(out, record->path, 0);
+      out += sprintf(out, " HTTP/1.%d", record->http_minor);
+    }
+    out += sprintf(out, "\" %s %s", status, bytes);
+    if (log->format == ACCESSLOG_COMBINED) {
+      out += sprintf(out, " \"");
+      out = accesslog_escape(out, record->referer, 0);
+      out += sprintf(out, "\" \"");
+      out = accesslog_escape(out, record->user_agent, 0);
+      *out++ = '"';
+    }
+    *out++ = '\n';
+  }
+  log->length += out - start;
+}
+
+/* Formats every record waiting in RING. Returns how many there were. */
+static unsigned int accesslog_drain(accesslog_t *log, accesslog_ring_t *ring) {
+  unsigned int tail = ring->tail;
+  unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  unsigned int count = head - tail;
+
+  for (; tail != head; tail++) {
+    if (ACCESSLOG_BUFFER_SIZE - log->length < ACCESSLOG_MAX_LINE)
+      accesslog_flush(log);
+    accesslog_format(log, &ring->records[tail & (ACCESSLOG_RING_SIZE - 1)]);
+    /* Hand the slot back early, so a busy ring does not overflow. */
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+  return count;
+}
+
+/* THREAD FUNCTION */
+static void *accesslog_thread_function(void *arg) {
+  accesslog_t *log = arg;
+  struct timespec interval = { 0, ACCESSLOG_FLUSH_INTERVAL_MS * 1000000L };
+
+  while (1) {
+    unsigned int count = 0;
+    accesslog_ring_t *ring = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next)
+      count += accesslog_drain(log, ring);
+    if (count > 0) continue;
+    accesslog_flush(log);
+    if (__atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE)) break;
+    nanosleep(&interval, NULL);
+  }
+  return NULL;
+}
+
+/* Opens the access log at PATH ("-" for standard output) in FORMAT and
+ * starts its flusher. Returns 0 on success. */
+int accesslog_init(accesslog_t *log, char *path, accesslog_format_t format) {
+  memset(log, 0, sizeof(accesslog_t));
+  log->format = format;
+  log->cached_second = -1;
+  if (strcmp(path, "-") == 0) {
+    log->fd = STDOUT_FILENO;
+  } else {
+    log->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd < 0) return -1;
+  }
+  log->buffer = malloc(ACCESSLOG_BUFFER_SIZE);
+  if (log->buffer == NULL) return -1;
+  pthread_create(&log->thread, NULL, &accesslog_thread_function, log);
+  return 0;
+}
+
+/* Writes out every record queued so far and stops the flusher. This waits
+ * for the flusher thread, so it must not be called from a signal handler. */
+void accesslog_stop(accesslog_t *log) {
+  __atomic_store_n(&log->stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(log->thread, NULL);
+}
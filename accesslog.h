@@ -0,0 +1,96 @@
+#ifndef __ACCESSLOG__
+#define __ACCESSLOG__
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "libhttp.h"
+#include "wq.h"
+
+/* ACCESSLOG records one line per answered request without formatting or
+ * writing anything on the thread that served it.
+ *
+ * Every thread that logs gets its own single-producer ring of fixed-size
+ * records, registered once in a lock-free list. A thread that exits retires
+ * its ring and the next new thread takes it over, so the list only grows to
+ * the most threads ever running at once. accesslog_write only copies
+ * the request's fields into the next free record and publishes it; when the
+ * ring is full the record is dropped and counted rather than making the
+ * worker wait. A flusher thread drains all rings, formats the records in
+ * common, combined or JSON format into one buffer and writes it out in
+ * large batches, sleeping for ACCESSLOG_FLUSH_INTERVAL_MS when idle.
+ *
+ * Debug messages (log_debug) go to stderr only at verbosity 1 and above, so
+ * by default nothing on the request path touches stdio. */
+
+#define ACCESSLOG_RING_SIZE 1024        // Records per thread; a power of two.
+#define ACCESSLOG_FLUSH_INTERVAL_MS 20
+#define ACCESSLOG_BUFFER_SIZE (64 * 1024)
+#define ACCESSLOG_MAX_LINE 4096         // Longest formatted record.
+
+typedef enum {
+  ACCESSLOG_COMMON,
+  ACCESSLOG_COMBINED,
+  ACCESSLOG_JSON
+} accesslog_format_t;
+
+typedef struct accesslog_record {
+  struct timespec time;       // Wall clock when the response was done.
+  unsigned long duration_us;
+  int status_code;            // 0 if unknown.
+  int http_minor;
+  long long bytes;            // Body bytes sent, or -1 if unknown.
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+  } peer;                     // sa_family is AF_UNSPEC if unknown.
+  /* Truncated, NUL-terminated copies; empty if absent. */
+  char method[16];
+  char path[256];
+  char referer[128];
+  char user_agent[128];
+} accesslog_record_t;
+
+typedef struct accesslog_ring {
+  unsigned int head __attribute__((aligned(WQ_CACHE_LINE)));  // Producer's.
+  unsigned long dropped;
+  int retired;                // Its thread exited; a new one may take it over.
+  unsigned int tail __attribute__((aligned(WQ_CACHE_LINE)));  // Flusher's.
+  struct accesslog_ring *next;
+  accesslog_record_t records[ACCESSLOG_RING_SIZE];
+} accesslog_ring_t;
+
+typedef struct accesslog {
+  int fd;
+  accesslog_format_t format;
+  accesslog_ring_t *rings;    // Every logging thread's ring.
+  int stopping;
+  char *buffer;               // Flusher's output batch.
+  size_t length;
+  time_t cached_second;       // Last formatted timestamp, reused within
+  char cached_time[40];       // the same second (JSON keeps the zone
+  char cached_zone[8];        // apart to put milliseconds before it).
+  pthread_t thread;
+} accesslog_t;
+
+int accesslog_parse_format(char *name, accesslog_format_t *format);
+int accesslog_init(accesslog_t *log, char *path, accesslog_format_t format);
+void accesslog_write(accesslog_t *log, struct sockaddr *peer,
+    struct http_request *request, int status_code, long long bytes,
+    struct timespec *start);
+unsigned long accesslog_dropped(accesslog_t *log);
+void accesslog_stop(accesslog_t *log);
+void accesslog_retire_thread(void);
+
+extern int log_verbosity;
+
+#define log_debug(...) \
+  do { \
+    if (log_verbosity > 0) fprintf(stderr, __VA_ARGS__); \
+  } while (0)
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* Standard slabs this thread has released, for reuse. */
+static __thread arena_slab_t *arena_free_slabs;
+static __thread int arena_num_free_slabs;
+
+static arena_slab_t *arena_new_slab(size_t capacity) {
+  arena_slab_t *slab;
+  if (capacity <= ARENA_SLAB_SIZE && arena_free_slabs != NULL) {
+    slab = arena_free_slabs;
+    arena_free_slabs = slab->next;
+    arena_num_free_slabs--;
+  } else {
+    if (capacity < ARENA_SLAB_SIZE) capacity = ARENA_SLAB_SIZE;
+    slab = malloc(sizeof(arena_slab_t) + capacity);
+    if (slab == NULL) return NULL;
+    slab->capacity = capacity;
+  }
+  slab->used = 0;
+  return slab;
+}
+
+static void arena_free_slab(arena_slab_t *slab) {
+  if (slab->capacity == ARENA_SLAB_SIZE
+      && arena_num_free_slabs < ARENA_MAX_FREE_SLABS) {
+    slab->next = arena_free_slabs;
+    arena_free_slabs = slab;
+    arena_num_free_slabs++;
+  } else {
+    free(slab);
+  }
+}
+
+/* Frees the calling thread's recycled slabs, before the thread exits. */
+void arena_thread_exit(void) {
+  while (arena_free_slabs != NULL) {
+    arena_slab_t *slab = arena_free_slabs;
+    arena_free_slabs = slab->next;
+    free(slab);
+  }
+  arena_num_free_slabs = 0;
+}
+
+void arena_init(arena_t *arena) {
+  arena->slab = NULL;
+}
+
+/* Returns SIZE bytes aligned to ARENA_ALIGNMENT, or NULL if out of memory.
+ * The memory stays valid until released with the arena. */
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+  arena_slab_t *slab = arena->slab;
+  if (slab == NULL || slab->capacity - slab->used < size) {
+    slab = arena_new_slab(size);
+    if (slab == NULL) return NULL;
+    slab->next = arena->slab;
+    arena->slab = slab;
+  }
+  void *memory = slab->data + slab->used;
+  slab->used += size;
+  return memory;
+}
+
+arena_mark_t arena_mark(arena_t *arena) {
+  arena_mark_t mark = { arena->slab, arena->slab ? arena->slab->used : 0 };
+  return mark;
+}
+
+/* Frees everything allocated from ARENA since MARK was taken. */
+void arena_release(arena_t *arena, arena_mark_t mark) {
+  while (arena->slab != mark.slab) {
+    arena_slab_t *slab = arena->slab;
+    arena->slab = slab->next;
+    arena_free_slab(slab);
+  }
+  if (arena->slab != NULL) arena->slab->used = mark.used;
+}
+
+/* Frees everything allocated from ARENA. */
+void arena_destroy(arena_t *arena) {
+  arena_mark_t bottom = { NULL, 0 };
+  arena_release(arena, bottom);
+}
@@ -0,0 +1,45 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+/* ARENA is a bump allocator for memory that lives exactly as long as a
+ * connection or a request: allocations are carved out of slabs one after
+ * the other and never freed individually. arena_mark remembers a position
+ * and arena_release frees everything allocated after it in one go, so a
+ * connection handler can keep its connection state at the bottom of the
+ * arena and drop each request's memory when the response has been sent.
+ *
+ * Standard slabs are recycled through a free list kept per thread, so after
+ * warming up a worker allocates without calling malloc or touching any
+ * other thread's memory. Allocations too large for a standard slab get a
+ * slab of their own, which goes straight back to malloc when released. */
+
+#define ARENA_SLAB_SIZE (32 * 1024)
+#define ARENA_MAX_FREE_SLABS 16     // Per thread; more are freed.
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_slab {
+  struct arena_slab *next;    // Older slab.
+  size_t capacity;            // Bytes of data.
+  size_t used;
+  char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+} arena_slab_t;
+
+typedef struct arena {
+  arena_slab_t *slab;         // Newest slab, allocated from.
+} arena_t;
+
+typedef struct arena_mark {
+  arena_slab_t *slab;
+  size_t used;
+} arena_mark_t;
+
+void arena_init(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+arena_mark_t arena_mark(arena_t *arena);
+void arena_release(arena_t *arena, arena_mark_t mark);
+void arena_destroy(arena_t *arena);
+void arena_thread_exit(void);
+
+#endif
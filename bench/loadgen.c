@@ -0,0 +1,310 @@
+/*
+ * Open-loop HTTP load generator. Requests are scheduled at a fixed RATE,
+ * whether or not earlier ones have been answered, and spread over CONNS
+ * persistent connections. Each request's latency is measured from the time
+ * it was scheduled to be sent, not from when a connection became free to
+ * send it, so a server that stalls is charged for every request that queued
+ * up behind the stall (the correction for coordinated omission that closed
+ * loop tools such as ab leave out).
+ *
+ * PATHs are requested round-robin. With -p, the CPU time the server process
+ * used during the run is read from /proc and reported per request.
+ *
+ * Usage: bench/loadgen [-r rate] [-d seconds] [-c conns] [-p server_pid]
+ *                      [-l label] host:port path...
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE (64 * 1024)
+#define DRAIN_TIMEOUT_NS 5000000000LL   // Wait for stragglers after the run.
+
+typedef struct conn {
+  int fd;
+  int busy;
+  long long scheduled;      // When the request in flight was due.
+  char head[BUFFER_SIZE];   // Response head read so far.
+  size_t head_length;
+  int head_done;
+  long long remaining;      // Body bytes still to come.
+  int close_after;          // Server sends Connection: close.
+  int status_code;
+} conn_t;
+
+static struct addrinfo *target;
+static char *host;
+static char **paths;
+static int num_paths;
+static int next_path;
+
+static long long *pending;    // Scheduled send times not yet sent.
+static long pending_head, pending_tail;
+static long long *latencies;  // Nanoseconds, one per answered request.
+static long num_latencies;
+static long errors, non_2xx;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Returns the CPU time PID has used, in seconds, or -1 if unknown. */
+static double process_cpu(int pid) {
+  char path[64], buffer[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return -1;
+  size_t n = fread(buffer, 1, sizeof(buffer) - 1, file);
+  fclose(file);
+  buffer[n] = '\0';
+  /* Fields after the parenthesized command name, which may hold spaces. */
+  char *fields = strrchr(buffer, ')');
+  unsigned long utime, stime;
+  if (fields == NULL || sscanf(fields + 2,
+        "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+        &utime, &stime) != 2)
+    return -1;
+  return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Opens CONN's connection and adds it to EPOLL_FD. */
+static int conn_open(int epoll_fd, conn_t *conn) {
+  conn->fd = socket(target->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0 || connect(conn->fd, target->ai_addr,
+        target->ai_addrlen) < 0) {
+    perror("connect");
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+  conn->busy = 0;
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+static void conn_reopen(int epoll_fd, conn_t *conn) {
+  if (conn->fd >= 0) close(conn->fd);
+  conn_open(epoll_fd, conn);
+}
+
+/* Sends the next request on CONN, due at SCHEDULED. If that fails the
+ * request counts as an error and CONN, reopened, stays idle. */
+static void conn_send(int epoll_fd, conn_t *conn, long long scheduled) {
+  char request[1024];
+  int length = snprintf(request, sizeof(request),
+      "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", paths[next_path], host);
+  next_path = (next_path + 1) % num_paths;
+
+  conn->busy = 1;
+  conn->scheduled = scheduled;
+  conn->head_length = 0;
+  conn->head_done = 0;
+  conn->close_after = 0;
+  /* The request is far smaller than any socket buffer. */
+  if (conn->fd < 0 || send(conn->fd, request, length, MSG_NOSIGNAL)
+      != length) {
+    errors++;
+    conn_reopen(epoll_fd, conn);
+    conn->busy = 0;
+  }
+}
+
+/* Reads the status, framing and Connection header from CONN's head. */
+static int conn_parse_head(conn_t *conn) {
+  conn->head[conn->head_length] = '\0';
+  if (sscanf(conn->head, "HTTP/1.%*d %d", &conn->status_code) != 1)
+    return -1;
+  conn->remaining = -1;
+  for (char *line = strstr(conn->head, "\r\n"); line != NULL;
+      line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+      conn->remaining = atoll(line + 17);
+    else if (strncasecmp(line + 2, "Connection: close", 17) == 0)
+      conn->close_after = 1;
+  }
+  return conn->remaining < 0 ? -1 : 0;
+}
+
+/* Reads what has arrived on CONN. Returns 1 once its response is complete,
+ * -1 on error and 0 otherwise. */
+static int conn_read(conn_t *conn) {
+  char buffer[BUFFER_SIZE];
+  while (1) {
+    char *data = buffer;
+    size_t space = sizeof(buffer);
+    if (!conn->head_done) {
+      data = conn->head + conn->head_length;
+      space = sizeof(conn->head) - 1 - conn->head_length;
+      if (space == 0) return -1;
+    }
+    ssize_t n = recv(conn->fd, data, space, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return -1;
+
+    if (!conn->head_done) {
+      conn->head_length += n;
+      conn->head[conn->head_length] = '\0';
+      char *end = strstr(conn->head, "\r\n\r\n");
+      if (end == NULL) continue;
+      size_t head_length = end + 4 - conn->head;
+      n = conn->head_length - head_length;
+      conn->head_length = head_length;
+      conn->head_done = 1;
+      if (conn_parse_head(conn) < 0) return -1;
+    }
+    conn->remaining -= n;
+    if (conn->remaining <= 0) return 1;
+  }
+}
+
+static int compare(const void *a, const void *b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(double fraction) {
+  if (num_latencies == 0) return 0;
+  long rank = (long) (fraction * num_latencies);
+  if (rank >= num_latencies) rank = num_latencies - 1;
+  return latencies[rank] / 1e6;
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-r rate] [-d seconds] [-c conns] "
+      "[-p server_pid] [-l label] host:port path...\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  double rate = 1000, duration = 5;
+  int num_conns = 16, pid = 0;
+  char *label = "run";
+  int option;
+
+  while ((option = getopt(argc, argv, "r:d:c:p:l:")) != -1) {
+    switch (option) {
+      case 'r': rate = atof(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 'c': num_conns = atoi(optarg); break;
+      case 'p': pid = atoi(optarg); break;
+      case 'l': label = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2 || rate <= 0 || duration <= 0 || num_conns < 1)
+    usage(argv[0]);
+
+  host = argv[optind];
+  char *port = strrchr(host, ':');
+  if (port == NULL) usage(argv[0]);
+  char *hostname = strndup(host, port - host);
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  int error = getaddrinfo(hostname, port + 1, &hints, &target);
+  if (error != 0) {
+    fprintf(stderr, "%s: %s\n", hostname, gai_strerror(error));
+    return 1;
+  }
+  paths = argv + optind + 1;
+  num_paths = argc - optind - 1;
+
+  long total = (long) (rate * duration);
+  pending = malloc(total * sizeof(long long));
+  latencies = malloc(total * sizeof(long long));
+  conn_t *conns = calloc(num_conns, sizeof(conn_t));
+  conn_t **idle = malloc(num_conns * sizeof(conn_t *));
+  int num_idle = 0;
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (pending == NULL || latencies == NULL || conns == NULL || idle == NULL)
+    return 1;
+  for (int i = 0; i < num_conns; i++) {
+    conns[i].fd = -1;
+    if (conn_open(epoll_fd, &conns[i]) < 0) return 1;
+    idle[num_idle++] = &conns[i];
+  }
+
+  double cpu_before = pid ? process_cpu(pid) : -1;
+  long long interval = (long long) (1e9 / rate);
+  long long start = now_ns();
+  long long next = start;
+  long scheduled = 0, in_flight = 0;
+  struct epoll_event events[256];
+
+  while (1) {
+    long long now = now_ns();
+    while (scheduled < total && next <= now) {
+      pending[pending_tail++] = next;
+      scheduled++;
+      next = start + scheduled * interval;
+    }
+    while (num_idle > 0 && pending_head < pending_tail) {
+      conn_t *conn = idle[--num_idle];
+      conn_send(epoll_fd, conn, pending[pending_head++]);
+      if (conn->busy) {
+        in_flight++;
+      } else {
+        idle[num_idle++] = conn;
+      }
+    }
+    if (scheduled == total && pending_head == pending_tail && in_flight == 0)
+      break;
+    if (scheduled == total && now > next + DRAIN_TIMEOUT_NS) break;
+
+    long long wait = scheduled < total ? (next - now) / 1000000 : 100;
+    int n = epoll_wait(epoll_fd, events, 256, wait > 0 ? wait : 0);
+    for (int i = 0; i < n; i++) {
+      conn_t *conn = events[i].data.ptr;
+      if (!conn->busy) {
+        /* The server closed an idle connection; it stays in the idle set. */
+        conn_reopen(epoll_fd, conn);
+        continue;
+      }
+      int status = conn_read(conn);
+      if (status == 0) continue;
+      if (status > 0) {
+        latencies[num_latencies++] = now_ns() - conn->scheduled;
+        if (conn->status_code < 200 || conn->status_code >= 300) non_2xx++;
+      } else {
+        errors++;
+      }
+      in_flight--;
+      if (status < 0 || conn->close_after) conn_reopen(epoll_fd, conn);
+      conn->busy = 0;
+      idle[num_idle++] = conn;
+    }
+  }
+
+  double elapsed = (now_ns() - start) / 1e9;
+  double cpu_after = pid ? process_cpu(pid) : -1;
+  long timeouts = total - num_latencies - errors;
+  qsort(latencies, num_latencies, sizeof(long long), compare);
+
+  printf("%-24s %9.0f rps  p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms  "
+      "max %8.3f ms", label, num_latencies / elapsed, percentile(0.5),
+      percentile(0.99), percentile(0.999),
+      num_latencies ? latencies[num_latencies - 1] / 1e6 : 0.0);
+  if (cpu_before >= 0 && cpu_after >= 0 && num_latencies > 0)
+    printf("  cpu %7.1f us/req", (cpu_after - cpu_before) * 1e6 / num_latencies);
+  if (errors || timeouts || non_2xx)
+    printf("  (%ld errors, %ld timeouts, %ld non-2xx)", errors, timeouts,
+        non_2xx);
+  printf("\n");
+  return errors || timeouts ? 2 : 0;
+}
@@ -0,0 +1,118 @@
+#!/bin/bash
+#
+# End-to-end benchmark suite, run by `make bench`. Generates a corpus of
+# small, medium and large files and a deep directory tree, then starts
+# httpserver in several configurations and drives each with bench/loadgen
+# at a fixed request rate, printing one line of results per scenario:
+# achieved requests per second, p50/p99/p999/max latency (corrected for
+# coordinated omission) and server CPU time per request.
+#
+# The files scenarios run on the thread pool, the epoll loops and the
+# io_uring loops (which fall back to epoll on kernels without support).
+# The proxy scenario puts httpserver --proxy in front of a second
+# httpserver --files instance serving the same corpus.
+#
+# Settings come from the environment:
+#   BENCH_RATE       requests per second for small files (default 2000)
+#   BENCH_DURATION   seconds per scenario (default 5)
+#   BENCH_CONNS      client connections (default 32); the thread pool
+#                    serves one keep-alive connection per thread, so its
+#                    scenarios use one connection per server thread
+#   BENCH_THREADS    server threads (default 4)
+#   BENCH_PORT       first port to use (default 18080)
+
+set -u
+cd "$(dirname "$0")/.."
+
+RATE=${BENCH_RATE:-2000}
+DURATION=${BENCH_DURATION:-5}
+CONNS=${BENCH_CONNS:-32}
+THREADS=${BENCH_THREADS:-4}
+PORT=${BENCH_PORT:-18080}
+UPSTREAM_PORT=$((PORT + 1))
+
+CORPUS=$(mktemp -d /tmp/httpserver-bench.XXXXXX)
+SERVERS=()
+
+cleanup() {
+  for pid in "${SERVERS[@]}"; do kill "$pid" 2>/dev/null; done
+  wait 2>/dev/null
+  rm -rf "$CORPUS"
+}
+trap cleanup EXIT
+
+make_corpus() {
+  mkdir -p "$CORPUS/small" "$CORPUS/medium" "$CORPUS/large"
+  for i in $(seq 0 99); do
+    head -c 1024 /dev/urandom | base64 > "$CORPUS/small/$i.txt"
+  done
+  for i in $(seq 0 19); do
+    head -c 102400 /dev/urandom > "$CORPUS/medium/$i.bin"
+  done
+  for i in 0 1; do
+    head -c 8388608 /dev/urandom > "$CORPUS/large/$i.bin"
+  done
+  local deep="$CORPUS/deep"
+  for level in a b c d e f g h i j; do deep="$deep/$level"; done
+  mkdir -p "$deep"
+  echo "<html><body>deep</body></html>" > "$deep/index.html"
+}
+
+# Starts httpserver with the given arguments and waits until PORT accepts.
+start_server() {
+  local port=$1
+  shift
+  ./httpserver --port "$port" --num-threads "$THREADS" "$@" \
+      < /dev/null > /dev/null 2>&1 &
+  SERVERS+=($!)
+  for _ in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$port") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "httpserver $* did not start on port $port" >&2
+  exit 1
+}
+
+stop_servers() {
+  for pid in "${SERVERS[@]}"; do kill "$pid" 2>/dev/null; done
+  wait 2>/dev/null
+  SERVERS=()
+}
+
+# run LABEL RATE PATH... against the server started last, over $conns
+# connections.
+run() {
+  local label=$1 rate=$2
+  shift 2
+  bench/loadgen -l "$label" -r "$rate" -d "$DURATION" -c "$conns" \
+      -p "${SERVERS[-1]}" "127.0.0.1:$PORT" "$@"
+}
+
+make_corpus
+small=$(for i in $(seq 0 99); do echo "/small/$i.txt"; done)
+medium=$(for i in $(seq 0 19); do echo "/medium/$i.bin"; done)
+
+echo "httpserver benchmark: ${DURATION}s per scenario, $CONNS connections" \
+    "($THREADS for the thread pool), $THREADS server threads"
+
+for mode in "" "--event-loop" "--io-uring"; do
+  start_server "$PORT" --files "$CORPUS" $mode
+  case $mode in
+    --event-loop) name=evloop ;;
+    --io-uring) name=uring ;;
+    *) name=pool ;;
+  esac
+  conns=$([ -n "$mode" ] && echo "$CONNS" || echo "$THREADS")
+  run "files/$name/small" "$RATE" $small
+  run "files/$name/medium" $((RATE / 4)) $medium
+  run "files/$name/large" $((RATE / 100 + 1)) /large/0.bin /large/1.bin
+  run "files/$name/deep" "$RATE" /deep/a/b/c/d/e/f/g/h/i/j/
+  stop_servers
+done
+
+start_server "$UPSTREAM_PORT" --files "$CORPUS"
+start_server "$PORT" --proxy "127.0.0.1:$UPSTREAM_PORT"
+conns=$THREADS
+run "proxy/small" "$RATE" $small
+run "proxy/medium" $((RATE / 4)) $medium
+stop_servers
@@ -0,0 +1,125 @@
+/*
+ * Microbenchmark for the work queue: pushes and pops ITEMS sockets through
+ * the lock-free ring in wq.c and through the mutex + linked list queue it
+ * replaced (reproduced below), with P producers and C consumers.
+ *
+ * Usage: bench/wq_bench [producers] [consumers] [items]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../utlist.h"
+#include "../wq.h"
+
+/* The original queue: one mutex, one condition variable, one calloc per
+ * push. */
+typedef struct list_item {
+  int client_socket_fd;
+  struct list_item *next;
+  struct list_item *prev;
+} list_item_t;
+
+typedef struct list_wq {
+  int size;
+  list_item_t *head;
+  pthread_cond_t work_cond;
+  pthread_mutex_t work_mut;
+} list_wq_t;
+
+static void list_wq_init(list_wq_t *wq) {
+  wq->size = 0;
+  wq->head = NULL;
+  pthread_cond_init(&wq->work_cond, NULL);
+  pthread_mutex_init(&wq->work_mut, NULL);
+}
+
+static int list_wq_pop(list_wq_t *wq) {
+  pthread_mutex_lock(&wq->work_mut);
+  while (wq->head == NULL)
+    pthread_cond_wait(&wq->work_cond, &wq->work_mut);
+  list_item_t *item = wq->head;
+  int client_socket_fd = item->client_socket_fd;
+  wq->size--;
+  DL_DELETE(wq->head, item);
+  free(item);
+  pthread_mutex_unlock(&wq->work_mut);
+  return client_socket_fd;
+}
+
+static void list_wq_push(list_wq_t *wq, int client_socket_fd) {
+  pthread_mutex_lock(&wq->work_mut);
+  list_item_t *item = calloc(1, sizeof(list_item_t));
+  item->client_socket_fd = client_socket_fd;
+  DL_APPEND(wq->head, item);
+  wq->size++;
+  pthread_cond_signal(&wq->work_cond);
+  pthread_mutex_unlock(&wq->work_mut);
+}
+
+static wq_t ring;
+static list_wq_t list;
+static int use_ring;
+static long items_per_producer, items_per_consumer;
+
+static void *producer(void *arg) {
+  for (long i = 0; i < items_per_producer; i++) {
+    if (use_ring) wq_push(&ring, (int) i);
+    else list_wq_push(&list, (int) i);
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  long sum = 0;
+  for (long i = 0; i < items_per_consumer; i++) {
+    sum += use_ring ? wq_pop(&ring) : list_wq_pop(&list);
+  }
+  return (void *) sum;
+}
+
+static double run(int ring_mode, int producers, int consumers) {
+  pthread_t threads[producers + consumers];
+  struct timespec start, end;
+
+  use_ring = ring_mode;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < consumers; i++)
+    pthread_create(&threads[producers + i], NULL, consumer, NULL);
+  for (int i = 0; i < producers; i++)
+    pthread_create(&threads[i], NULL, producer, NULL);
+  for (int i = 0; i < producers + consumers; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int producers = argc > 1 ? atoi(argv[1]) : 1;
+  int consumers = argc > 2 ? atoi(argv[2]) : 4;
+  long items = argc > 3 ? atol(argv[3]) : 2000000;
+
+  if (producers < 1 || consumers < 1 || items < 1) {
+    fprintf(stderr, "Usage: %s [producers] [consumers] [items]\n", argv[0]);
+    return 1;
+  }
+  /* Round so every item pushed is also popped. */
+  items_per_producer = items / producers;
+  items_per_consumer = items_per_producer * producers / consumers;
+  items_per_producer = items_per_consumer * consumers / producers;
+  items = items_per_producer * producers;
+
+  wq_init(&ring);
+  list_wq_init(&list);
+
+  double list_time = run(0, producers, consumers);
+  double ring_time = run(1, producers, consumers);
+  printf("%d producers, %d consumers, %ld items\n", producers, consumers, items);
+  printf("  mutex list: %8.3f s  %8.2f Mops/s\n", list_time,
+      items / list_time / 1e6);
+  printf("  mpmc ring:  %8.3f s  %8.2f Mops/s\n", ring_time,
+      items / ring_time / 1e6);
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+/* Returns 1 for content types that are text-like and usually shrink well.
+ * Images, archives and the like are already compressed. */
+int compress_is_compressible(char *content_type) {
+  return strncmp(content_type, "text/", 5) == 0
+      || strcmp(content_type, "application/javascript") == 0
+      || strcmp(content_type, "application/json") == 0
+      || strcmp(content_type, "application/xml") == 0
+      || strcmp(content_type, "image/svg+xml") == 0;
+}
+
+/* Compresses LENGTH bytes of DATA into a newly allocated gzip stream, stored
+ * in *OUT and *OUT_LENGTH. Returns 0 on success and -1 on failure. */
+int compress_gzip(char *data, size_t length, char **out, size_t *out_length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  /* 16 + MAX_WBITS asks zlib for a gzip header and trailer. */
+  if (deflateInit2(&stream, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+
+  size_t capacity = deflateBound(&stream, length);
+  char *buffer = malloc(capacity);
+  if (buffer == NULL) {
+    deflateEnd(&stream);
+    return -1;
+  }
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = length;
+  stream.next_out = (Bytef *) buffer;
+  stream.avail_out = capacity;
+  int status = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (status != Z_STREAM_END) {
+    free(buffer);
+    return -1;
+  }
+
+  *out = buffer;
+  *out_length = capacity - stream.avail_out;
+  return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __COMPRESS__
+#define __COMPRESS__
+
+#include <stddef.h>
+
+/* COMPRESS produces compressed copies of response bodies for clients that
+ * accept them. */
+
+#define COMPRESS_MIN_SIZE 256     // Smaller bodies are not worth a header.
+#define COMPRESS_GZIP_LEVEL 6
+#define COMPRESS_MIN_SAVINGS 16   // Keep a copy only if it saves 1/16 or more.
+
+int compress_is_compressible(char *content_type);
+int compress_gzip(char *data, size_t length, char **out, size_t *out_length);
+
+#endif
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dirlist.h"
+
+#define DIRLIST_HEADER "<h1>Files</h1><ul><li><a href='../'>Parent directory</a></li>"
+#define DIRLIST_FOOTER "</ul>"
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;        // Position of the next entry.
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static ssize_t dirlist_getdents(int dir_fd, char *buffer, size_t size) {
+  return syscall(SYS_getdents64, dir_fd, buffer, size);
+}
+
+/* Makes room for COUNT more bytes in BUFFER, at least doubling it. */
+static int dirlist_reserve(dirlist_buffer_t *buffer, size_t count) {
+  if (buffer->failed) return -1;
+  if (buffer->length + count <= buffer->capacity) return 0;
+  size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+  while (capacity < buffer->length + count) capacity *= 2;
+  char *data = realloc(buffer->data, capacity);
+  if (data == NULL) {
+    buffer->failed = 1;
+    return -1;
+  }
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return 0;
+}
+
+static void dirlist_append(dirlist_buffer_t *buffer, const char *data,
+    size_t length) {
+  if (dirlist_reserve(buffer, length) < 0) return;
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+static void dirlist_append_string(dirlist_buffer_t *buffer, const char *s) {
+  dirlist_append(buffer, s, strlen(s));
+}
+
+void dirlist_buffer_free(dirlist_buffer_t *buffer) {
+  free(buffer->data);
+  memset(buffer, 0, sizeof(*buffer));
+}
+
+/* Appends one list item linking to NAME (a subdirectory if IS_DIR). The
+ * link is percent-encoded and the text HTML-escaped, so any file name is
+ * safe to list. */
+static void dirlist_append_entry(dirlist_buffer_t *buffer, const char *name,
+    int is_dir) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t length = strlen(name);
+
+  /* Worst cases: 3 bytes per byte in the link, 6 in the text. */
+  if (dirlist_reserve(buffer, 9 * length + 32) < 0) return;
+  char *p = buffer->data + buffer->length;
+  p = stpcpy(p, "<li><a href='");
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = name[i];
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || strchr("-._~", c) != NULL) {
+      *p++ = c;
+    } else {
+      *p++ = '%';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 15];
+    }
+  }
+  if (is_dir) *p++ = '/';
+  p = stpcpy(p, "'>");
+  for (size_t i = 0; i < length; i++) {
+    switch (name[i]) {
+      case '&': p = stpcpy(p, "&amp;"); break;
+      case '<': p = stpcpy(p, "&lt;"); break;
+      case '>': p = stpcpy(p, "&gt;"); break;
+      case '\'': p = stpcpy(p, "&#39;"); break;
+      case '"': p = stpcpy(p, "&quot;"); break;
+      default: *p++ = name[i];
+    }
+  }
+  if (is_dir) *p++ = '/';
+  p = stpcpy(p, "</a></li>");
+  buffer->length = p - buffer->data;
+}
+
+/* Returns 1 if ENTRY should be listed (regular files and directories other
+ * than . and ..) and sets *IS_DIR. File systems that do not report types
+ * cost an fstatat. */
+static int dirlist_wanted(int dir_fd, struct linux_dirent64 *entry,
+    int *is_dir) {
+  unsigned char type = entry->d_type;
+  if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+    return 0;
+  if (type == DT_UNKNOWN) {
+    struct stat info;
+    if (fstatat(dir_fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+      return 0;
+    type = S_ISREG(info.st_mode) ? DT_REG : S_ISDIR(info.st_mode) ? DT_DIR : 0;
+  }
+  *is_dir = type == DT_DIR;
+  return type == DT_REG || type == DT_DIR;
+}
+
+static int dirlist_compare(const void *a, const void *b) {
+  /* Names are stored after their type byte. */
+  return strcoll(*(char **) a + 1, *(char **) b + 1);
+}
+
+/*
+ * Renders the listing of the directory open on DIR_FD, sorted by name, into
+ * OUT. Returns 0 on success, 1 if the directory has more than
+ * DIRLIST_MAX_SORTED entries (the caller should paginate instead), and -1 on
+ * failure.
+ */
+int dirlist_render_sorted(int dir_fd, dirlist_buffer_t *out) {
+  /* Each kept entry is stored in NAMES as a type byte and the name. */
+  dirlist_buffer_t names = { 0 };
+  char **sorted = NULL;
+  size_t *offsets = NULL;
+  int count = 0, result = -1;
+  char buffer[DIRLIST_GETDENTS_SIZE];
+
+  offsets = malloc(DIRLIST_MAX_SORTED * sizeof(size_t));
+  if (offsets == NULL) return -1;
+  while (1) {
+    ssize_t n = dirlist_getdents(dir_fd, buffer, sizeof(buffer));
+    if (n < 0) goto done;
+    if (n == 0) break;
+    for (ssize_t pos = 0; pos < n; ) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *) (buffer + pos);
+      int is_dir;
+      pos += entry->d_reclen;
+      if (!dirlist_wanted(dir_fd, entry, &is_dir)) continue;
+      if (count == DIRLIST_MAX_SORTED) {
+        result = 1;
+        goto done;
+      }
+      offsets[count++] = names.length;
+      dirlist_append(&names, is_dir ? "d" : "f", 1);
+      dirlist_append(&names, entry->d_name, strlen(entry->d_name) + 1);
+    }
+  }
+  if (names.failed || (sorted = malloc((count + 1) * sizeof(char *))) == NULL)
+    goto done;
+
+  /* NAMES may have moved while growing, so pointers are taken only now. */
+  for (int i = 0; i < count; i++) sorted[i] = names.data + offsets[i];
+  qsort(sorted, count, sizeof(char *), dirlist_compare);
+
+  dirlist_append_string(out, DIRLIST_HEADER);
+  for (int i = 0; i < count; i++)
+    dirlist_append_entry(out, sorted[i] + 1, sorted[i][0] == 'd');
+  dirlist_append_string(out, DIRLIST_FOOTER);
+  result = out->failed ? -1 : 0;
+
+done:
+  free(sorted);
+  free(offsets);
+  dirlist_buffer_free(&names);
+  return result;
+}
+
+/*
+ * Renders up to LIMIT entries of the directory open on DIR_FD, starting at
+ * directory position OFFSET (0 for the first page), into OUT, followed by a
+ * link to the next page if there is one. Only one getdents64 buffer is used,
+ * whatever the size of the directory. Returns 0 on success and -1 on failure.
+ */
+int dirlist_render_page(int dir_fd, long long offset, int limit,
+    dirlist_buffer_t *out) {
+  char buffer[DIRLIST_GETDENTS_SIZE];
+  long long next = -1;
+  int count = 0;
+
+  if (lseek(dir_fd, offset, SEEK_SET) < 0) return -1;
+  dirlist_append_string(out, DIRLIST_HEADER);
+  while (next < 0) {
+    ssize_t n = dirlist_getdents(dir_fd, buffer, sizeof(buffer));
+    if (n < 0) return -1;
+    if (n == 0) break;
+    for (ssize_t pos = 0; pos < n; ) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *) (buffer + pos);
+      int is_dir;
+      pos += entry->d_reclen;
+      if (!dirlist_wanted(dir_fd, entry, &is_dir)) continue;
+      if (count == limit) {
+        /* Resume at this entry, which did not fit on this page. */
+        next = offset;
+        break;
+      }
+      dirlist_append_entry(out, entry->d_name, is_dir);
+      count++;
+      offset = entry->d_off;
+    }
+  }
+  dirlist_append_string(out, DIRLIST_FOOTER);
+  if (next >= 0) {
+    char link[96];
+    snprintf(link, sizeof(link),
+        "<p><a href='?offset=%lld&amp;limit=%d'>Next page</a></p>", next,
+        limit);
+    dirlist_append_string(out, link);
+  }
+  return out->failed ? -1 : 0;
+}
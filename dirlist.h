@@ -0,0 +1,36 @@
+#ifndef __DIRLIST__
+#define __DIRLIST__
+
+#include <stddef.h>
+
+/* DIRLIST renders HTML listings of directories, reading entries straight
+ * from the kernel with getdents64 into a few large buffers rather than one
+ * allocation per entry. Output goes into a growable buffer, so rendering is
+ * linear in the size of the listing.
+ *
+ * dirlist_render_sorted produces the whole listing in name order, which the
+ * caller can cache until the directory changes. Directories with more than
+ * DIRLIST_MAX_SORTED entries are listed a page at a time instead, in the
+ * order the kernel returns them: dirlist_render_page seeks to a position
+ * handed out by the previous page (the kernel's own directory offset, not an
+ * entry count, so late pages cost no more than early ones) and links to the
+ * next page. */
+
+#define DIRLIST_MAX_SORTED 4096       // Larger directories are paginated.
+#define DIRLIST_PAGE_SIZE 1000        // Default entries per page.
+#define DIRLIST_MAX_PAGE_SIZE 10000
+#define DIRLIST_GETDENTS_SIZE (32 * 1024)
+
+typedef struct dirlist_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+  int failed;           // An allocation failed; DATA is incomplete.
+} dirlist_buffer_t;
+
+int dirlist_render_sorted(int dir_fd, dirlist_buffer_t *out);
+int dirlist_render_page(int dir_fd, long long offset, int limit,
+    dirlist_buffer_t *out);
+void dirlist_buffer_free(dirlist_buffer_t *buffer);
+
+#endif
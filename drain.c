@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drain.h"
+#include "utlist.h"
+
+#define DRAIN_MAX_EVENTS 64
+
+static long long drain_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Takes SOCKET out of DRAIN's set and closes it. */
+static void drain_remove(drain_t *drain, drain_socket_t *socket) {
+  pthread_mutex_lock(&drain->lock);
+  DL_DELETE(drain->sockets, socket);
+  drain->num_sockets--;
+  pthread_mutex_unlock(&drain->lock);
+  epoll_ctl(drain->epoll_fd, EPOLL_CTL_DEL, socket->fd, NULL);
+  close(socket->fd);
+  free(socket);
+}
+
+/* Discards what has arrived on SOCKET. Returns 1 once it should be closed:
+ * the peer closed, the socket failed or the byte budget is spent. */
+static int drain_read(drain_socket_t *socket) {
+  char discard[4096];
+  while (socket->drained < DRAIN_MAX_BYTES) {
+    ssize_t n = recv(socket->fd, discard, sizeof(discard), MSG_DONTWAIT);
+    if (n > 0) {
+      socket->drained += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return n == 0 || errno != EAGAIN;
+    }
+  }
+  return 1;
+}
+
+/* THREAD FUNCTION */
+static void *drain_thread_function(void *arg) {
+  drain_t *drain = arg;
+  struct epoll_event events[DRAIN_MAX_EVENTS];
+
+  while (1) {
+    /* Sleep until the oldest socket's deadline, if any. */
+    int timeout = -1;
+    pthread_mutex_lock(&drain->lock);
+    if (drain->sockets != NULL) {
+      long long wait = drain->sockets->deadline - drain_now();
+      timeout = wait > 0 ? (int) ((wait + 999999) / 1000000) : 0;
+    }
+    pthread_mutex_unlock(&drain->lock);
+
+    int n = epoll_wait(drain->epoll_fd, events, DRAIN_MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      drain_socket_t *socket = events[i].data.ptr;
+      if (drain_read(socket)) drain_remove(drain, socket);
+    }
+
+    long long now = drain_now();
+    while (1) {
+      pthread_mutex_lock(&drain->lock);
+      drain_socket_t *oldest = drain->sockets;
+      pthread_mutex_unlock(&drain->lock);
+      if (oldest == NULL || oldest->deadline > now) break;
+      drain_remove(drain, oldest);
+    }
+  }
+  return NULL;
+}
+
+/* Starts DRAIN's thread. Returns -1 if its epoll set cannot be created. */
+int drain_init(drain_t *drain) {
+  /* Even without a thread, drain_close must work: it closes at once. */
+  pthread_mutex_init(&drain->lock, NULL);
+  drain->sockets = NULL;
+  drain->num_sockets = 0;
+  drain->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (drain->epoll_fd < 0) {
+    perror("Failed to create drain epoll set");
+    return -1;
+  }
+  pthread_create(&drain->thread, NULL, &drain_thread_function, drain);
+  return 0;
+}
+
+/* Closes FD, whose sending side the caller has shut down, once the peer has
+ * closed its side or the deadline has passed. Never blocks. */
+void drain_close(drain_t *drain, int fd) {
+  drain_socket_t *socket = malloc(sizeof(drain_socket_t));
+  if (socket == NULL) {
+    close(fd);
+    return;
+  }
+  socket->fd = fd;
+  socket->deadline = drain_now() + DRAIN_TIMEOUT_MS * 1000000LL;
+  socket->drained = 0;
+
+  struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP,
+      .data.ptr = socket };
+  pthread_mutex_lock(&drain->lock);
+  if (drain->num_sockets >= DRAIN_MAX_SOCKETS
+      || epoll_ctl(drain->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    pthread_mutex_unlock(&drain->lock);
+    close(fd);
+    free(socket);
+    return;
+  }
+  DL_APPEND(drain->sockets, socket);
+  drain->num_sockets++;
+  pthread_mutex_unlock(&drain->lock);
+}
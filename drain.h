@@ -0,0 +1,42 @@
+#ifndef __DRAIN__
+#define __DRAIN__
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* DRAIN closes sockets whose last response has been written without making
+ * the caller wait for the peer. Closing a socket while the peer's data is
+ * still unread (or still on the way) makes the kernel reset the connection,
+ * and the reset can destroy a response the peer has not read yet. So the
+ * caller shuts down the sending side and hands the socket over; a background
+ * thread reads and discards whatever the peer still sends, on one epoll set,
+ * and closes the socket once the peer closes too.
+ *
+ * A socket is closed regardless after DRAIN_TIMEOUT_MS or once DRAIN_MAX_BYTES
+ * have been discarded. When DRAIN_MAX_SOCKETS are already draining, a new one
+ * is closed at once. */
+
+#define DRAIN_TIMEOUT_MS 500
+#define DRAIN_MAX_BYTES (16 * 1024)
+#define DRAIN_MAX_SOCKETS 1024
+
+typedef struct drain_socket {
+  int fd;
+  long long deadline;         // CLOCK_MONOTONIC ns.
+  size_t drained;
+  struct drain_socket *next;
+  struct drain_socket *prev;
+} drain_socket_t;
+
+typedef struct drain {
+  int epoll_fd;
+  pthread_mutex_t lock;
+  drain_socket_t *sockets;    // Oldest (first to expire) first.
+  int num_sockets;
+  pthread_t thread;
+} drain_t;
+
+int drain_init(drain_t *drain);
+void drain_close(drain_t *drain, int fd);
+
+#endif
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "stats.h"
+#include "utlist.h"
+
+static time_t loop_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+static void set_blocking(int fd, int blocking) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return;
+  flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+  fcntl(fd, F_SETFL, flags);
+}
+
+/* Records progress on CONN, moving it to the back of the idle list. */
+static void conn_touch(ev_loop_t *loop, ev_conn_t *conn) {
+  conn->last_active = loop_now();
+  DL_DELETE(loop->conns, conn);
+  DL_APPEND(loop->conns, conn);
+}
+
+/* Returns a connection from LOOP's free list, or a new one. */
+static ev_conn_t *conn_alloc(ev_loop_t *loop) {
+  ev_conn_t *conn = loop->free_conns;
+  if (conn == NULL) return malloc(sizeof(ev_conn_t));
+  loop->free_conns = conn->next;
+  loop->num_free_conns--;
+  return conn;
+}
+
+/* Releases CONN's memory and keeps it for reuse, up to a limit. */
+static void conn_free(ev_loop_t *loop, ev_conn_t *conn) {
+  arena_destroy(&conn->arena);
+  if (loop->num_free_conns >= EVLOOP_MAX_FREE_CONNS) {
+    free(conn);
+    return;
+  }
+  conn->next = loop->free_conns;
+  loop->free_conns = conn;
+  loop->num_free_conns++;
+}
+
+/* Releases the response CONN has finished with and its request's memory,
+ * handing the arena's slabs back while the connection waits. */
+static void conn_end_response(ev_conn_t *conn) {
+  http_response_release(&conn->response);
+  arena_destroy(&conn->arena);
+}
+
+static void conn_close(ev_loop_t *loop, ev_conn_t *conn) {
+  DL_DELETE(loop->conns, conn);
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->http.fd, NULL);
+  close(conn->http.fd);
+  http_response_release(&conn->response);
+  conn_free(loop, conn);
+}
+
+/* Stops watching CONN and passes its socket to the blocking handler. The
+ * request head is still in the socket buffer, so the handler reads it as if
+ * it had been handed a freshly accepted connection. */
+static void conn_handoff(ev_loop_t *loop, ev_conn_t *conn) {
+  int fd = conn->http.fd;
+  DL_DELETE(loop->conns, conn);
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  conn_free(loop, conn);
+  set_blocking(fd, 1);
+  loop->options->handoff(fd);
+}
+
+/* Builds the response to REQUEST and sets up CONN to write it. */
+static void conn_start_response(ev_loop_t *loop, ev_conn_t *conn,
+    struct http_request *request) {
+  if (loop->options->complete != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &conn->started);
+  conn->request = request;
+  loop->options->prepare(request, &conn->response, &conn->arena);
+  conn->response.keep_alive = !conn->peer_closed
+      && http_conn_keep_alive(&conn->http, request, loop->options->max_requests);
+
+  if (http_format_response_head(&conn->response, &conn->head) < 0) {
+    http_response_release(&conn->response);
+    conn->response.status_code = 500;
+    http_format_response_head(&conn->response, &conn->head);
+  }
+  conn->sent = 0;
+  conn->state = CONN_WRITING;
+}
+
+/* Reads until the socket would block or the buffer is full. Returns -1 if
+ * the connection should be dropped and 0 otherwise. */
+static int conn_fill(ev_loop_t *loop, ev_conn_t *conn) {
+  struct http_conn *http = &conn->http;
+  ssize_t n;
+
+  while (!conn->peer_closed) {
+    size_t space = http_conn_reserve(http);
+    if (space == 0) break;
+    n = recv(http->fd, http->buffer + http->length, space, 0);
+    if (n == 0) {
+      conn->peer_closed = 1;
+    } else if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    } else {
+      http->length += n;
+      conn_touch(loop, conn);
+    }
+  }
+  return 0;
+}
+
+/* Checks, without consuming anything, whether a whole request head has
+ * arrived. Returns -1 if the connection should be dropped, 1 once the head is
+ * complete and 0 otherwise. */
+static int conn_peek(ev_loop_t *loop, ev_conn_t *conn) {
+  struct http_conn *http = &conn->http;
+  ssize_t n = recv(http->fd, http->buffer, LIBHTTP_REQUEST_MAX_SIZE, MSG_PEEK);
+
+  if (n == 0) return -1;
+  if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  if ((size_t) n != http->length) conn_touch(loop, conn);
+  http->length = n;
+  /* A head that does not fit in the buffer is handed on as-is. */
+  return http_request_head_length(http->buffer, http->length) > 0
+      || http->length == LIBHTTP_REQUEST_MAX_SIZE;
+}
+
+/* Writes as much of the response as the socket accepts. Returns -1 on error,
+ * 1 when the whole response has been written and 0 if it would block. */
+static int conn_write(ev_loop_t *loop, ev_conn_t *conn) {
+  struct http_response *response = &conn->response;
+  size_t body_length = http_response_content_length(response);
+  size_t total = conn->head.length + body_length;
+  /* Only a single in-memory body can go out together with the head. */
+  int simple = response->file_fd < 0 && response->segments == NULL;
+  ssize_t n;
+
+  while (conn->sent < total) {
+    if (conn->sent >= conn->head.length && !simple) {
+      /* Head is out; the rest comes from the file or the segments. */
+      n = http_send_body(conn->http.fd, response,
+          conn->sent - conn->head.length);
+      if (n == 0) return -1;  // File shrank underneath us.
+    } else {
+      struct iovec iov[2];
+      int iovcnt = 0;
+      if (conn->sent < conn->head.length) {
+        iov[iovcnt].iov_base = conn->head.data + conn->sent;
+        iov[iovcnt].iov_len = conn->head.length - conn->sent;
+        iovcnt++;
+      }
+      if (simple && response->body_length > 0) {
+        size_t body_sent = conn->sent > conn->head.length
+            ? conn->sent - conn->head.length : 0;
+        iov[iovcnt].iov_base = response->body + body_sent;
+        iov[iovcnt].iov_len = response->body_length - body_sent;
+        iovcnt++;
+      }
+
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      n = sendmsg(conn->http.fd, &msg,
+          MSG_NOSIGNAL | (!simple && body_length > 0 ? MSG_MORE : 0));
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return -1;
+    }
+    conn->sent += n;
+    conn_touch(loop, conn);
+  }
+  return 1;
+}
+
+/* Reports the response CONN has finished (or given up on) writing. */
+static void conn_complete(ev_loop_t *loop, ev_conn_t *conn) {
+  if (loop->options->complete == NULL) return;
+  size_t body_sent = conn->sent > conn->head.length
+      ? conn->sent - conn->head.length : 0;
+  loop->options->complete((struct sockaddr *) &conn->peer, conn->request,
+      &conn->response, body_sent, &conn->started);
+}
+
+/* Advances CONN through its state machine as far as the socket allows.
+ * Pipelined requests already in the buffer are answered one after another
+ * without going back to epoll. */
+static void conn_drive(ev_loop_t *loop, ev_conn_t *conn) {
+  struct http_request *request;
+  int status;
+
+  while (1) {
+    if (conn->state == CONN_READING) {
+      if (loop->options->prepare == NULL) {
+        status = conn_peek(loop, conn);
+        if (status < 0) break;
+        if (status > 0) conn_handoff(loop, conn);
+        return;
+      }
+      if (!http_conn_take_request(&conn->http, &request)) {
+        if (conn_fill(loop, conn) < 0) break;
+        if (!http_conn_take_request(&conn->http, &request)) {
+          if (conn->peer_closed) break;
+          return;
+        }
+      }
+      conn_start_response(loop, conn, request);
+    }
+
+    if (conn->state == CONN_WRITING) {
+      status = conn_write(loop, conn);
+      if (status == 0) return;
+      conn_complete(loop, conn);
+      if (status < 0 || !conn->response.keep_alive) break;
+      conn_end_response(conn);
+      conn->state = CONN_READING;
+    }
+  }
+  conn_close(loop, conn);
+}
+
+/* Closes connections that have made no progress for idle_timeout seconds.
+ * The list is ordered by last activity, so only its head needs checking. */
+static void loop_expire(ev_loop_t *loop) {
+  time_t deadline = loop_now() - loop->options->idle_timeout;
+  while (loop->conns != NULL && loop->conns->last_active <= deadline) {
+    conn_close(loop, loop->conns);
+  }
+}
+
+static void loop_accept(ev_loop_t *loop) {
+  while (1) {
+    struct sockaddr_storage peer;
+    socklen_t peer_length = sizeof(peer);
+    int fd = accept4(loop->listen_fd, (struct sockaddr *) &peer, &peer_length,
+        SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Error accepting socket");
+      return;
+    }
+
+    ev_conn_t *conn = conn_alloc(loop);
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    memset(conn, 0, sizeof(ev_conn_t));
+    arena_init(&conn->arena);
+    conn->peer = peer;
+    http_conn_init(&conn->http, fd);
+    conn->state = CONN_READING;
+    http_response_init(&conn->response);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      perror("Failed to add connection to epoll");
+      close(fd);
+      conn_free(loop, conn);
+      continue;
+    }
+    conn->last_active = loop_now();
+    DL_APPEND(loop->conns, conn);
+
+    /* The request may already be waiting. */
+    conn_drive(loop, conn);
+  }
+}
+
+/* Pins the calling thread to CPU INDEX modulo the number of online CPUs. */
+void evloop_pin_cpu(int index) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+  if (num_cpus < 1) return;
+  CPU_ZERO(&cpus);
+  CPU_SET(index % num_cpus, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+static void *loop_thread_function(void *arg) {
+  ev_loop_t *loop = arg;
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+  struct timespec mark;
+
+  if (loop->options->pin_cpus) evloop_pin_cpu(loop->index);
+
+  stats_name_thread("loop", loop->index);
+  clock_gettime(CLOCK_MONOTONIC, &mark);
+  while (1) {
+    int n = epoll_wait(loop->epoll_fd, events, EVLOOP_MAX_EVENTS, 1000);
+    stats_idle(&mark);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        loop_accept(loop);
+      } else {
+        conn_drive(loop, events[i].data.ptr);
+      }
+    }
+    loop_expire(loop);
+    stats_busy(&mark);
+  }
+}
+
+void evloop_run(int listen_fd, ev_options_t *options) {
+  int num_loops = options->num_loops < 1 ? 1 : options->num_loops;
+  printf("Starting %d event loop threads...\n", num_loops);
+
+  ev_loop_t *loops = calloc(num_loops, sizeof(ev_loop_t));
+  for (int i = 0; i < num_loops; i++) {
+    loops[i].index = i;
+    loops[i].listen_fd = options->listen_fds ? options->listen_fds[i] : listen_fd;
+    set_blocking(loops[i].listen_fd, 0);
+    loops[i].options = options;
+    loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epoll_fd < 0) {
+      perror("Failed to create epoll instance");
+      exit(errno);
+    }
+
+    /* A shared listener wakes only one loop per connection. */
+    struct epoll_event event;
+    event.events = EPOLLIN | (options->listen_fds ? 0 : EPOLLEXCLUSIVE);
+    event.data.ptr = NULL;
+    if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].listen_fd,
+          &event) < 0) {
+      perror("Failed to add listening socket to epoll");
+      exit(errno);
+    }
+    pthread_create(&loops[i].thread, NULL, &loop_thread_function, &loops[i]);
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    pthread_join(loops[i].thread, NULL);
+  }
+  free(loops);
+}
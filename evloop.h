@@ -0,0 +1,86 @@
+#ifndef __EVLOOP__
+#define __EVLOOP__
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "arena.h"
+#include "libhttp.h"
+
+/* EVLOOP is an edge-triggered epoll reactor. Every loop thread owns its own
+ * epoll instance and shares the (non-blocking) listening socket with the
+ * others through EPOLLEXCLUSIVE, so an accepted connection stays on the thread
+ * that accepted it for its whole life. Each connection lives in its own
+ * arena, which also holds the memory of the request being served. */
+
+#define EVLOOP_MAX_EVENTS 256
+#define EVLOOP_MAX_FREE_CONNS 256   // Closed connections kept for reuse.
+
+typedef void (*ev_prepare_t)(struct http_request *, struct http_response *,
+    arena_t *);
+typedef void (*ev_handoff_t)(int);
+typedef void (*ev_complete_t)(struct sockaddr *, struct http_request *,
+    struct http_response *, size_t, struct timespec *);
+
+/* States of a connection in the event loop. */
+typedef enum {
+  CONN_READING,   // Waiting for a complete request head.
+  CONN_WRITING    // Response head and body are being written.
+} conn_state_t;
+
+typedef struct ev_conn {
+  conn_state_t state;
+  struct http_conn http;    // Socket and buffered (pipelined) requests.
+  struct sockaddr_storage peer;
+  int peer_closed;          // Client shut down its side; finish and close.
+  time_t last_active;
+
+  struct http_request *request;   // Being answered; in http's buffer.
+  struct http_response response;
+  struct http_builder head;
+  size_t sent;      // Bytes of head + body written so far.
+  struct timespec started;    // When the request was taken.
+
+  arena_t arena;            // The current request's memory; holds no slab
+                            // while the connection is idle.
+
+  struct ev_conn *next;     // Loop's connections, least recently active first.
+  struct ev_conn *prev;
+} ev_conn_t;
+
+typedef struct ev_options {
+  int num_loops;
+  int *listen_fds;    // One SO_REUSEPORT listener per loop, or NULL to share.
+  int pin_cpus;       // Pin loop i to CPU i (matches reuseport CPU steering).
+  /* If set, requests are served natively: the loop parses the request, calls
+   * PREPARE to build the response and writes it without blocking. Otherwise
+   * the loop only waits until a full request head has arrived and then
+   * passes the (blocking) socket to HANDOFF. */
+  ev_prepare_t prepare;
+  ev_handoff_t handoff;
+  int idle_timeout;   // Seconds a connection may wait for its next request.
+  int max_requests;   // Requests served on one connection before closing it.
+  /* If set, called with the peer, request, response, body bytes sent and
+   * start time of every natively served request once it is done with. */
+  ev_complete_t complete;
+} ev_options_t;
+
+typedef struct ev_loop {
+  int index;
+  int epoll_fd;
+  int listen_fd;
+  pthread_t thread;
+  ev_options_t *options;
+  ev_conn_t *conns;
+  ev_conn_t *free_conns;    // Singly linked through next.
+  int num_free_conns;
+} ev_loop_t;
+
+/* Runs the reactor threads described by OPTIONS on LISTEN_FD (or on their
+ * own listeners from OPTIONS->listen_fds) and never returns. */
+void evloop_run(int listen_fd, ev_options_t *options);
+void evloop_pin_cpu(int index);
+
+#endif
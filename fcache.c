@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fcache.h"
+#include "utlist.h"
+
+/* FNV-1a; good enough to spread paths over shards and buckets. */
+static unsigned int fcache_hash(const char *path) {
+  unsigned int hash = 2166136261u;
+  while (*path) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static fcache_shard_t *fcache_shard(fcache_t *cache, unsigned int hash) {
+  return &cache->shards[hash % FCACHE_SHARDS];
+}
+
+static int fcache_matches(fcache_entry_t *entry, struct stat *info) {
+  return entry->inode == info->st_ino
+      && entry->size == info->st_size
+      && entry->mtime.tv_sec == info->st_mtim.tv_sec
+      && entry->mtime.tv_nsec == info->st_mtim.tv_nsec;
+}
+
+void fcache_release(fcache_entry_t *entry) {
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+  }
+}
+
+/* Unlinks ENTRY from SHARD and drops the cache's reference. Caller holds the
+ * shard lock. */
+static void fcache_remove(fcache_shard_t *shard, fcache_entry_t *entry) {
+  fcache_entry_t **link = &shard->buckets[(entry->hash / FCACHE_SHARDS)
+      % FCACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+  DL_DELETE(shard->lru, entry);
+  shard->bytes -= entry->length;
+  fcache_release(entry);
+}
+
+void fcache_init(fcache_t *cache, size_t capacity) {
+  memset(cache, 0, sizeof(*cache));
+  cache->capacity = capacity;
+  cache->shard_capacity = capacity / FCACHE_SHARDS;
+  for (int i = 0; i < FCACHE_SHARDS; i++) {
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+  }
+}
+
+int fcache_enabled(fcache_t *cache) {
+  return cache->shard_capacity > 0;
+}
+
+/* Returns a referenced entry for PATH if it is cached and still matches INFO,
+ * or NULL. The caller must fcache_release the entry when done with it. */
+fcache_entry_t *fcache_lookup(fcache_t *cache, const char *path,
+    struct stat *info) {
+  if (!fcache_enabled(cache)) return NULL;
+
+  unsigned int hash = fcache_hash(path);
+  fcache_shard_t *shard = fcache_shard(cache, hash);
+  fcache_entry_t *entry;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = shard->buckets[(hash / FCACHE_SHARDS) % FCACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+    entry = entry->chain;
+
+  if (entry != NULL && !fcache_matches(entry, info)) {
+    /* The file changed on disk. */
+    fcache_remove(shard, entry);
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    /* Move to the front of the LRU list. */
+    DL_DELETE(shard->lru, entry);
+    DL_PREPEND(shard->lru, entry);
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+    shard->hits++;
+  } else {
+    shard->misses++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return entry;
+}
+
+/*
+ * Caches LENGTH bytes of DATA (allocated with malloc) under PATH, valid for
+ * as long as the file still matches INFO. DATA need not be the file's
+ * contents, e.g. it may be a compressed copy. Returns a referenced entry,
+ * which has taken DATA over, or NULL if it is too large for a shard or out of
+ * memory; DATA then still belongs to the caller.
+ */
+fcache_entry_t *fcache_insert(fcache_t *cache, const char *path,
+    struct stat *info, char *data, size_t length) {
+  if (!fcache_enabled(cache) || length > cache->shard_capacity) return NULL;
+
+  fcache_entry_t *entry = calloc(1, sizeof(fcache_entry_t));
+  if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+    free(entry);
+    return NULL;
+  }
+  entry->data = data;
+  entry->length = length;
+  entry->hash = fcache_hash(path);
+  entry->inode = info->st_ino;
+  entry->size = info->st_size;
+  entry->mtime = info->st_mtim;
+  entry->sidecars = -1;
+  entry->refcount = 2;  // One for the cache, one for the caller.
+
+  fcache_shard_t *shard = fcache_shard(cache, entry->hash);
+  fcache_entry_t **bucket = &shard->buckets[(entry->hash / FCACHE_SHARDS)
+      % FCACHE_BUCKETS];
+
+  pthread_mutex_lock(&shard->lock);
+  /* Another worker may have loaded the same path meanwhile. */
+  for (fcache_entry_t *old = *bucket; old != NULL; old = old->chain) {
+    if (old->hash == entry->hash && strcmp(old->path, path) == 0) {
+      fcache_remove(shard, old);
+      break;
+    }
+  }
+  while (shard->lru != NULL
+      && shard->bytes + entry->length > cache->shard_capacity) {
+    fcache_remove(shard, shard->lru->prev);  // Tail is least recently used.
+    shard->evictions++;
+  }
+  entry->chain = *bucket;
+  *bucket = entry;
+  DL_PREPEND(shard->lru, entry);
+  shard->bytes += entry->length;
+  pthread_mutex_unlock(&shard->lock);
+  return entry;
+}
+
+/*
+ * Reads the file open on FD (described by INFO) into the cache under PATH.
+ * Returns a referenced entry, or NULL if the file is too large for a shard or
+ * could not be read; the caller then serves it from disk.
+ */
+fcache_entry_t *fcache_load(fcache_t *cache, const char *path, int fd,
+    struct stat *info) {
+  if (!fcache_enabled(cache) || (size_t) info->st_size > cache->shard_capacity)
+    return NULL;
+
+  char *data = malloc(info->st_size > 0 ? info->st_size : 1);
+  if (data == NULL) return NULL;
+
+  off_t done = 0;
+  while (done < info->st_size) {
+    ssize_t n = pread(fd, data + done, info->st_size - done, done);
+    if (n <= 0) {
+      free(data);
+      return NULL;
+    }
+    done += n;
+  }
+  fcache_entry_t *entry = fcache_insert(cache, path, info, data,
+      info->st_size);
+  if (entry == NULL) free(data);
+  return entry;
+}
+
+/*
+ * Fills the inode, size and mtime of INFO from the trusted entry for PATH, as
+ * if the file had just been stat()ed, and returns 1; returns 0 if there is
+ * no such entry. A following fcache_lookup with INFO finds the entry unless
+ * it has been invalidated meanwhile.
+ */
+int fcache_peek(fcache_t *cache, const char *path, struct stat *info) {
+  if (!fcache_enabled(cache)) return 0;
+
+  unsigned int hash = fcache_hash(path);
+  fcache_shard_t *shard = fcache_shard(cache, hash);
+  fcache_entry_t *entry;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = shard->buckets[(hash / FCACHE_SHARDS) % FCACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+    entry = entry->chain;
+  int found = entry != NULL && entry->trusted;
+  if (found) {
+    info->st_ino = entry->inode;
+    info->st_size = entry->size;
+    info->st_mtim = entry->mtime;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return found;
+}
+
+/* Returns the sidecars recorded with PATH's trusted entry, or -1 if there is
+ * no such entry or nothing has been recorded. */
+int fcache_get_sidecars(fcache_t *cache, const char *path) {
+  if (!fcache_enabled(cache)) return -1;
+
+  unsigned int hash = fcache_hash(path);
+  fcache_shard_t *shard = fcache_shard(cache, hash);
+  fcache_entry_t *entry;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = shard->buckets[(hash / FCACHE_SHARDS) % FCACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+    entry = entry->chain;
+  int sidecars = entry != NULL && entry->trusted ? entry->sidecars : -1;
+  pthread_mutex_unlock(&shard->lock);
+  return sidecars;
+}
+
+/* Records SIDECARS with PATH's entry, if it is cached and still matches
+ * INFO. The caller must know that no change to them since it looked has gone
+ * unreported to fcache_invalidate. */
+void fcache_set_sidecars(fcache_t *cache, const char *path, struct stat *info,
+    int sidecars) {
+  if (!fcache_enabled(cache)) return;
+
+  unsigned int hash = fcache_hash(path);
+  fcache_shard_t *shard = fcache_shard(cache, hash);
+  fcache_entry_t *entry;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = shard->buckets[(hash / FCACHE_SHARDS) % FCACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+    entry = entry->chain;
+  if (entry != NULL && fcache_matches(entry, info)) entry->sidecars = sidecars;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Marks ENTRY as trusted. The caller must know that no change to the file
+ * since it was stat()ed has gone unreported to fcache_invalidate. */
+void fcache_trust(fcache_entry_t *entry) {
+  __atomic_store_n(&entry->trusted, 1, __ATOMIC_RELEASE);
+}
+
+/* Drops the entry for PATH, if any, because the file has changed. */
+void fcache_invalidate(fcache_t *cache, const char *path) {
+  if (!fcache_enabled(cache)) return;
+
+  unsigned int hash = fcache_hash(path);
+  fcache_shard_t *shard = fcache_shard(cache, hash);
+  fcache_entry_t *entry;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = shard->buckets[(hash / FCACHE_SHARDS) % FCACHE_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+    entry = entry->chain;
+  if (entry != NULL) fcache_remove(shard, entry);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Drops the entries for PREFIX and for every path below it (a directory
+ * that was moved or deleted as a whole). Walks the entire cache. */
+void fcache_invalidate_prefix(fcache_t *cache, const char *prefix) {
+  size_t length = strlen(prefix);
+  fcache_entry_t *entry, *tmp;
+
+  for (int i = 0; i < FCACHE_SHARDS; i++) {
+    fcache_shard_t *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    DL_FOREACH_SAFE(shard->lru, entry, tmp) {
+      if (strncmp(entry->path, prefix, length) == 0
+          && (entry->path[length] == '\0' || entry->path[length] == '/'))
+        fcache_remove(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/* Makes every entry need a stat() again, e.g. after change reports were
+ * lost. Entries stay cached and are still returned by fcache_lookup. */
+void fcache_distrust_all(fcache_t *cache) {
+  fcache_entry_t *entry;
+
+  for (int i = 0; i < FCACHE_SHARDS; i++) {
+    fcache_shard_t *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    DL_FOREACH(shard->lru, entry) entry->trusted = 0;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void fcache_get_stats(fcache_t *cache, fcache_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < FCACHE_SHARDS; i++) {
+    fcache_shard_t *shard = &cache->shards[i];
+    fcache_entry_t *entry;
+    pthread_mutex_lock(&shard->lock);
+    stats->bytes += shard->bytes;
+    DL_FOREACH(shard->lru, entry) stats->entries++;
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
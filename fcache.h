@@ -0,0 +1,89 @@
+#ifndef __FCACHE__
+#define __FCACHE__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* FCACHE is a size-bounded cache of file contents keyed by resolved path.
+ * Entries remember the inode, size and mtime they were read with and are
+ * only returned while the caller's stat() still matches them.
+ *
+ * The cache is split into shards by path hash, each with its own lock and
+ * LRU list, so workers looking up different files rarely contend. Entries
+ * are reference counted: an entry evicted while a response is still being
+ * written stays alive until that response releases it.
+ *
+ * When something else (a file system watcher) reports every change to the
+ * files behind the cache, entries can be marked trusted: fcache_peek then
+ * describes them without the caller having to stat() the file first, and
+ * the watcher removes them with fcache_invalidate as soon as the file
+ * changes. An entry can also record which related files (such as
+ * precompressed copies) exist, if the watcher invalidates it when one of
+ * them appears or goes away. */
+
+#define FCACHE_SHARDS 16
+#define FCACHE_BUCKETS 256
+
+typedef struct fcache_entry {
+  char *path;
+  unsigned int hash;
+  ino_t inode;
+  off_t size;
+  struct timespec mtime;
+  char *data;
+  size_t length;                // Bytes of data.
+  int trusted;                  // Valid without a stat(); see fcache_peek.
+  int sidecars;                 // Related files that exist (a bitmask the
+                                // caller defines), or -1 if not recorded.
+  int refcount;
+  struct fcache_entry *chain;   // Next entry in the same hash bucket.
+  struct fcache_entry *next;    // LRU list, most recently used first.
+  struct fcache_entry *prev;
+} fcache_entry_t;
+
+typedef struct fcache_shard {
+  pthread_mutex_t lock;
+  fcache_entry_t *buckets[FCACHE_BUCKETS];
+  fcache_entry_t *lru;
+  size_t bytes;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} fcache_shard_t;
+
+typedef struct fcache {
+  size_t capacity;        // Total bytes of file data; 0 disables the cache.
+  size_t shard_capacity;
+  fcache_shard_t shards[FCACHE_SHARDS];
+} fcache_t;
+
+typedef struct fcache_stats {
+  size_t bytes;
+  size_t entries;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} fcache_stats_t;
+
+void fcache_init(fcache_t *cache, size_t capacity);
+int fcache_enabled(fcache_t *cache);
+fcache_entry_t *fcache_lookup(fcache_t *cache, const char *path,
+    struct stat *info);
+fcache_entry_t *fcache_load(fcache_t *cache, const char *path, int fd,
+    struct stat *info);
+fcache_entry_t *fcache_insert(fcache_t *cache, const char *path,
+    struct stat *info, char *data, size_t length);
+void fcache_release(fcache_entry_t *entry);
+int fcache_peek(fcache_t *cache, const char *path, struct stat *info);
+void fcache_trust(fcache_entry_t *entry);
+int fcache_get_sidecars(fcache_t *cache, const char *path);
+void fcache_set_sidecars(fcache_t *cache, const char *path, struct stat *info,
+    int sidecars);
+void fcache_invalidate(fcache_t *cache, const char *path);
+void fcache_invalidate_prefix(fcache_t *cache, const char *prefix);
+void fcache_distrust_all(fcache_t *cache);
+void fcache_get_stats(fcache_t *cache, fcache_stats_t *stats);
+
+#endif
@@ -1,11 +1,13 @@
 #define _GNU_SOURCE
 
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -14,11 +16,25 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "arena.h"
+#include "compress.h"
+#include "dirlist.h"
+#include "drain.h"
+#include "evloop.h"
+#include "fcache.h"
 #include "libhttp.h"
-#include "wq.h"
+#include "mime.h"
+#include "pool.h"
+#include "relay.h"
+#include "stats.h"
+#include "upstream.h"
+#include "uring.h"
+#include "watch.h"
 
 /*
  * Global configuration variables.
@@ -26,120 +42,531 @@
  * handle_proxy_request. Their values are set up in main() using the
  * command line arguments (already implemented for you).
  */
-wq_t work_queue;
+pool_t thread_pool;
+int pool_running;             // Only if something will submit to it.
 int num_threads;
+int min_threads;
+int max_threads;
+int queue_delay_ms = POOL_DEFAULT_QUEUE_DELAY_MS;
+int thread_idle_timeout = POOL_DEFAULT_IDLE_TIMEOUT;
 int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+int event_loop;
+int io_uring;
+int reuseport;
+fcache_t file_cache;
+#define COMPRESSED_CACHE_DEFAULT_MB 16
+fcache_t compressed_cache;
+#define LISTING_CACHE_DEFAULT_MB 4
+fcache_t listing_cache;
+watch_t watcher;
+int watch_files = 1;
+int watching;
+int keep_alive_timeout = 5;
+int max_keep_alive_requests = 100;
+int proxy_idle_timeout = 60;
+upstream_t upstream;
+int upstream_min_idle = 0;
+int upstream_max_idle = 8;
+int dns_ttl = 30;
+accesslog_t access_log;
+char *access_log_path;
+accesslog_format_t access_log_format = ACCESSLOG_COMBINED;
+int logging_access;
+int serving_stats = 1;
+
+/* Cache-Control max-age by request path prefix, from --cache-control. */
+#define MAX_CACHE_RULES 32
+
+struct cache_rule {
+  char *prefix;
+  size_t prefix_length;
+  int max_age;
+} cache_rules[MAX_CACHE_RULES];
+int num_cache_rules;
+
+/* Admission control for the thread pool's queues (0 disables each bound),
+ * and path prefixes, from --priority-path, whose requests are not shed if
+ * their request line has arrived by the time they would be. */
+int max_queue;
+int max_queue_delay_ms;
+#define MAX_PRIORITY_PATHS 8
+char *priority_paths[MAX_PRIORITY_PATHS];
+int num_priority_paths;
+
+/* Shed connections, answered and shut down, wait here for the client to
+ * close before they are closed, off the accepting thread. */
+drain_t shed_drain;
+
+/* Sent as it is to every connection turned away by admission control. */
+static const char shed_response[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Retry-After: 1\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
-pthread_t *thread_pool = NULL;
+/* HELPER FUNCTIONS */
+/* Serves a cached copy of the file from memory. */
+static void http_use_cache_entry(fcache_entry_t *entry,
+    struct http_response *response) {
+  response->body = entry->data;
+  response->body_length = entry->length;
+  response->body_unref = (void (*)(void *)) fcache_release;
+  response->body_ref = entry;
+}
 
-struct proxy_session_info {
-  char *server_hostname;
-  int server_port;
-  int client_fd, server_fd;
-  pthread_cond_t cond;
-  pthread_mutex_t client_mut, server_mut;  
-};
+/* Describes PATH (as a file of type TYPE) from a cache entry that the
+ * watcher vouches for, sparing a stat(). Returns 0 if there is none. */
+int http_peek(fcache_t *cache, char *path, struct stat *info, mode_t type) {
+  if (!watching || !watch_healthy(&watcher) || !fcache_peek(cache, path, info))
+    return 0;
+  info->st_mode = type;
+  return 1;
+}
 
-/* HELPER FUNCTIONS */
-void http_create_dirlist(int n,
-			 struct dirent **fnames,
-			 char *buffer) {
-  printf("Creating directory list...\n");
-  char *li = NULL;
-  int len;
-  strcpy(buffer, "<h1>Files</h1>"
-  	         "<ul>"
-	         "<li><a href='../'>"
-		 "Parent directory"
-		 "</a></li>");
-  for (int i = 0; i < n; i++) {
-    if (strcmp(fnames[i]->d_name, ".") == 0
-    	|| strcmp(fnames[i]->d_name, "..") == 0
-	|| (fnames[i]->d_type != DT_REG && fnames[i]->d_type != DT_DIR)) {
-      continue;
+/* Lets the cache entry RESPONSE is served from be used without a stat() from
+ * now on, provided no change has been reported since generation SINCE (read
+ * before the file was looked at) and its path involves no symlinks, whose
+ * targets may lie outside the watched tree. */
+void http_trust_response(struct http_response *response, unsigned long since) {
+  if (response->body_unref != (void (*)(void *)) fcache_release) return;
+  fcache_entry_t *entry = response->body_ref;
+  if (__atomic_load_n(&entry->trusted, __ATOMIC_ACQUIRE)
+      || watch_generation(&watcher) != since)
+    return;
+  char real_path[PATH_MAX];
+  if (realpath(entry->path, real_path) != NULL
+      && strcmp(real_path, entry->path) == 0
+      && watch_generation(&watcher) == since)
+    fcache_trust(entry);
+}
+
+/* Writes the strong entity tag of the file described by INFO into ETAG
+ * (HTTP_ETAG_SIZE bytes). It changes whenever the file is replaced (inode),
+ * resized or written (mtime, to the nanosecond). SUFFIX tells apart
+ * representations derived from the same file, such as a compressed copy. */
+#define HTTP_ETAG_SIZE 64
+
+void http_make_etag(struct stat *info, char *suffix, char *etag) {
+  snprintf(etag, HTTP_ETAG_SIZE, "\"%llx-%llx-%llx.%lx%s\"",
+      (unsigned long long) info->st_ino, (unsigned long long) info->st_size,
+      (unsigned long long) info->st_mtim.tv_sec, info->st_mtim.tv_nsec,
+      suffix);
+}
+
+/* Returns the Cache-Control max-age configured for PATH (the longest
+ * matching --cache-control prefix), or -1 if none applies. */
+int cache_max_age(char *path) {
+  int max_age = -1;
+  size_t best = 0;
+  for (int i = 0; i < num_cache_rules; i++) {
+    if (cache_rules[i].prefix_length >= best
+        && strncmp(path, cache_rules[i].prefix, cache_rules[i].prefix_length) == 0) {
+      best = cache_rules[i].prefix_length;
+      max_age = cache_rules[i].max_age;
+    }
+  }
+  return max_age;
+}
+
+/*
+ * Adds the validators (ETAG and MTIME as Last-Modified) and caching policy of
+ * the representation about to be sent to RESPONSE, and evaluates REQUEST's
+ * If-None-Match (or, without one, If-Modified-Since) against them. Returns 1
+ * if the client's copy is current, in which case RESPONSE has become a
+ * header-only 304.
+ */
+int http_check_not_modified(struct http_request *request, char *etag,
+    time_t mtime, struct http_response *response) {
+  char last_modified[LIBHTTP_DATE_SIZE];
+  char *if_none_match = http_request_header(request, "If-None-Match");
+  char *if_modified_since = http_request_header(request, "If-Modified-Since");
+  int max_age = cache_max_age(request->path);
+
+  http_format_date(mtime, last_modified);
+  http_response_add_header(response, "ETag", "%s", etag);
+  http_response_add_header(response, "Last-Modified", "%s", last_modified);
+  if (max_age >= 0)
+    http_response_add_header(response, "Cache-Control", "max-age=%d", max_age);
+
+  int not_modified = 0;
+  if (if_none_match != NULL) {
+    not_modified = http_etag_matches(if_none_match, etag, 1);
+  } else if (if_modified_since != NULL) {
+    time_t since = http_parse_date(if_modified_since);
+    not_modified = since >= 0 && mtime <= since;
+  }
+  if (not_modified) response->status_code = 304;
+  return not_modified;
+}
+
+/*
+ * Narrows RESPONSE, whose body is a whole representation of SIZE bytes with
+ * validators ETAG and MTIME, to the byte ranges REQUEST asks for, if any. An
+ * If-Range that names neither the current entity tag nor the exact
+ * Last-Modified date means the whole body is sent instead. Unsatisfiable
+ * ranges get a 416 with no body.
+ */
+void http_apply_range(struct http_request *request, char *etag, time_t mtime,
+    off_t size, struct http_response *response) {
+  struct http_range ranges[LIBHTTP_MAX_RANGES];
+  char *range = http_request_header(request, "Range");
+  char *if_range = http_request_header(request, "If-Range");
+
+  http_response_add_header(response, "Accept-Ranges", "bytes");
+  if (range == NULL) return;
+  if (if_range != NULL) {
+    char last_modified[LIBHTTP_DATE_SIZE];
+    if (if_range[0] == '"' || strncmp(if_range, "W/", 2) == 0) {
+      if (!http_etag_matches(if_range, etag, 0)) return;
+    } else {
+      http_format_date(mtime, last_modified);
+      if (strcmp(if_range, last_modified) != 0) return;
     }
-    /* <li><a href="fnames[i]">fnames[i]</a></li> */
-    len = 24 + 2*strlen(fnames[i]->d_name);
-    li = malloc(sizeof(char) * len + 1);
-    strcpy(li, "<li><a href='");
-    strcat(li, fnames[i]->d_name);
-    strcat(li, "'>");
-    strcat(li, fnames[i]->d_name);
-    strcat(li, "</a></li>");
-    
-    strcat(buffer, li);
-    free(li);
-  }
-  strcat(buffer, "</ul>");
-}
-
-void http_send_file(int fd, char* path) {
-  printf("Sending file %s to socket %d...\n", path, fd);
-  char *buffer;
-  FILE* file;
-  long length;
-
-  file = fopen(path, "rb");
-  if (file == NULL) {
-    printf("Failed to open file %s\n", path);
+  }
+
+  int num_ranges = http_parse_range(range, size, ranges, LIBHTTP_MAX_RANGES);
+  if (num_ranges < 0) return;
+  if (num_ranges == 0) {
+    http_response_release_body(response);
+    response->status_code = 416;
+    http_response_add_header(response, "Content-Range", "bytes */%lld",
+        (long long) size);
+    return;
+  }
+  http_response_set_ranges(response, ranges, num_ranges, size);
+}
+
+/* Sets the file at PATH as the body of RESPONSE: from the file cache if it
+ * is there (or fits), else as an open file for sendfile. INFO is refreshed
+ * from the opened file. Returns -1 if the file cannot be opened. */
+int http_open_body(char *path, struct stat *info,
+    struct http_response *response) {
+  fcache_entry_t *entry = fcache_lookup(&file_cache, path, info);
+  if (entry != NULL) {
+    http_use_cache_entry(entry, response);
+    return 0;
+  }
+
+  int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0) {
+    log_debug("Failed to open file %s\n", path);
+    return -1;
+  }
+  if (fstat(file_fd, info) < 0 || !S_ISREG(info->st_mode)) {
+    close(file_fd);
+    return -1;
+  }
+
+  entry = fcache_load(&file_cache, path, file_fd, info);
+  if (entry != NULL) {
+    close(file_fd);
+    http_use_cache_entry(entry, response);
   } else {
-    fseek(file, 0, SEEK_END);
-    length = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    buffer = malloc(length + 1);
-    if (buffer) {
-      fread(buffer, 1, length, file);
-      buffer[length] = '\0';
-
-      http_start_response(fd, 200);
-      http_send_header(fd, "Content-Type", http_get_mime_type(path));
-      http_end_headers(fd);
-      http_send_string(fd, buffer);
+    response->file_fd = file_fd;
+    response->file_offset = 0;
+    response->file_length = info->st_size;
+  }
+  return 0;
+}
+
+/* Returns a gzip copy of the file at PATH (described by INFO) from the
+ * compressed cache, compressing and caching it first if needed; the file is
+ * read into ARENA meanwhile. Returns NULL if that is not possible, e.g.
+ * because the result would not fit. If compressing does not save at least
+ * 1/COMPRESS_MIN_SAVINGS of the file, an entry without data is cached
+ * instead, so the file is sent as is without being compressed again until
+ * it changes. */
+fcache_entry_t *http_load_gzip(char *path, struct stat *info, arena_t *arena) {
+  fcache_entry_t *entry = fcache_lookup(&compressed_cache, path, info);
+  if (entry != NULL) return entry;
+
+  int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0) return NULL;
+  char *data = arena_alloc(arena, info->st_size);
+  off_t done = 0;
+  while (data != NULL && done < info->st_size) {
+    ssize_t n = pread(file_fd, data + done, info->st_size - done, done);
+    if (n <= 0) break;
+    done += n;
+  }
+  close(file_fd);
+
+  char *compressed = NULL;
+  size_t compressed_length;
+  if (data != NULL && done == info->st_size
+      && compress_gzip(data, info->st_size, &compressed,
+        &compressed_length) == 0) {
+    if (compressed_length > (size_t) info->st_size
+        - info->st_size / COMPRESS_MIN_SAVINGS) {
+      free(compressed);
+      compressed = NULL;
+      compressed_length = 0;
     }
-    free(buffer);
+    entry = fcache_insert(&compressed_cache, path, info, compressed,
+        compressed_length);
+    if (entry == NULL) free(compressed);
   }
-  fclose(file);
+  return entry;
 }
 
-void http_send_directory(int fd, char* path) {
-  printf("Sending directory %s to socket %d...\n", path, fd);
-  char buffer[1000];
-  char *index_path;
-  int len = strlen(path) + 12, n;
-  struct dirent **fname_list;
-  struct stat info;
+/* Precompressed sidecars, by content coding and suffix, in order of
+ * preference. */
+static char *sidecars[][2] = { { "br", ".br" }, { "gzip", ".gz" } };
+#define NUM_SIDECARS (int) (sizeof(sidecars) / sizeof(sidecars[0]))
+
+/* Stats the sidecar at SIDECAR_PATH into *SIDECAR_INFO. Returns 1 if it is a
+ * regular file at least as new as the file described by INFO. */
+static int http_sidecar_current(char *sidecar_path, struct stat *info,
+    struct stat *sidecar_info) {
+  return stat(sidecar_path, sidecar_info) == 0
+      && S_ISREG(sidecar_info->st_mode)
+      && (sidecar_info->st_mtim.tv_sec > info->st_mtim.tv_sec
+        || (sidecar_info->st_mtim.tv_sec == info->st_mtim.tv_sec
+          && sidecar_info->st_mtim.tv_nsec >= info->st_mtim.tv_nsec));
+}
 
-  index_path = malloc(len + 1);
-  strcpy(index_path, path);
-  strcat(index_path, "/index.html");
-  index_path[len] = '\0';
+/* Returns which sidecars of the file at PATH (described by INFO) are
+ * current, as a bitmask over SIDECARS. The answer is recorded with the
+ * file's cache entries, so trusted hits need no stat() of the sidecars; the
+ * watcher drops those entries when a sidecar changes. */
+static int http_find_sidecars(char *path, struct stat *info) {
+  char sidecar_path[PATH_MAX];
+  struct stat sidecar_info;
+  int present;
+
+  if (watching && watch_healthy(&watcher)) {
+    if ((present = fcache_get_sidecars(&file_cache, path)) >= 0
+        || (present = fcache_get_sidecars(&compressed_cache, path)) >= 0)
+      return present;
+  }
+  unsigned long since = watching ? watch_generation(&watcher) : 0;
+  present = 0;
+  for (int i = 0; i < NUM_SIDECARS; i++) {
+    if (snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", path,
+          sidecars[i][1]) < (int) sizeof(sidecar_path)
+        && http_sidecar_current(sidecar_path, info, &sidecar_info))
+      present |= 1 << i;
+  }
+  if (watching && watch_generation(&watcher) == since) {
+    fcache_set_sidecars(&file_cache, path, info, present);
+    fcache_set_sidecars(&compressed_cache, path, info, present);
+  }
+  return present;
+}
+
+/*
+ * Tries to answer REQUEST for the file at PATH (described by INFO) with a
+ * compressed representation the client accepts (ACCEPT_ENCODING): first a
+ * precompressed sidecar (PATH.br or PATH.gz) at least as new as the file,
+ * sent like any other file, then a gzip copy made once and kept in the
+ * compressed cache. Returns 0 if neither is available, so the file should
+ * be sent as is.
+ */
+int http_load_encoded(struct http_request *request, char *path,
+    struct stat *info, char *accept_encoding, struct http_response *response) {
+  char etag[HTTP_ETAG_SIZE];
+  char sidecar_path[PATH_MAX];
+  struct stat sidecar_info;
+  int present = http_find_sidecars(path, info);
+
+  for (int i = 0; i < NUM_SIDECARS; i++) {
+    if (!(present & (1 << i))
+        || !http_accepts_encoding(accept_encoding, sidecars[i][0]))
+      continue;
+    snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", path, sidecars[i][1]);
+    if (!http_peek(&file_cache, sidecar_path, &sidecar_info, S_IFREG)
+        && !http_sidecar_current(sidecar_path, info, &sidecar_info))
+      continue;
+
+    http_response_add_header(response, "Content-Encoding", "%s",
+        sidecars[i][0]);
+    http_make_etag(&sidecar_info, "", etag);
+    if (http_check_not_modified(request, etag, info->st_mtime, response))
+      return 1;
+    if (http_open_body(sidecar_path, &sidecar_info, response) < 0) {
+      response->status_code = 404;
+      return 1;
+    }
+    http_apply_range(request, etag, info->st_mtime, sidecar_info.st_size,
+        response);
+    return 1;
+  }
+
+  if (!http_accepts_encoding(accept_encoding, "gzip")
+      || !fcache_enabled(&compressed_cache)
+      || info->st_size < COMPRESS_MIN_SIZE
+      || (size_t) info->st_size > compressed_cache.shard_capacity)
+    return 0;
+
+  http_make_etag(info, "-gzip", etag);
+  if (http_request_header(request, "If-None-Match") != NULL
+      && http_etag_matches(http_request_header(request, "If-None-Match"),
+        etag, 1)) {
+    /* The client's gzip copy is current; no need to look it up. */
+    http_response_add_header(response, "Content-Encoding", "gzip");
+    http_check_not_modified(request, etag, info->st_mtime, response);
+    return 1;
+  }
+  fcache_entry_t *entry = http_load_gzip(path, info, response->arena);
+  if (entry == NULL) return 0;
+  if (entry->data == NULL) {
+    /* Known not to compress. */
+    fcache_release(entry);
+    return 0;
+  }
+
+  http_response_add_header(response, "Content-Encoding", "gzip");
+  if (http_check_not_modified(request, etag, info->st_mtime, response)) {
+    fcache_release(entry);
+    return 1;
+  }
+  http_use_cache_entry(entry, response);
+  http_apply_range(request, etag, info->st_mtime, entry->length, response);
+  return 1;
+}
+
+/* Opens the file at PATH (described by INFO) as the body of RESPONSE to
+ * REQUEST. Cached files are served from memory; anything else is sent later
+ * with sendfile, so nothing is read here. Text files may instead be sent
+ * compressed, if the client accepts that. */
+void http_load_file(struct http_request *request, char *path,
+    struct stat *info, struct http_response *response) {
+  char etag[HTTP_ETAG_SIZE];
+  char *accept_encoding = http_request_header(request, "Accept-Encoding");
+
+  response->status_code = 200;
+  response->content_type = http_get_mime_type(path);
+  if (compress_is_compressible(response->content_type)) {
+    http_response_add_header(response, "Vary", "Accept-Encoding");
+    if (accept_encoding != NULL
+        && http_load_encoded(request, path, info, accept_encoding, response))
+      return;
+  }
+
+  http_make_etag(info, "", etag);
+  if (http_check_not_modified(request, etag, info->st_mtime, response)) return;
+  if (http_open_body(path, info, response) < 0) {
+    response->status_code = 404;
+    return;
+  }
+  http_apply_range(request, etag, info->st_mtime, info->st_size, response);
+}
+
+/*
+ * Loads index.html or a listing of the directory at PATH (described by INFO)
+ * into RESPONSE. Complete listings are kept in the listing cache until the
+ * directory changes. Directories too large to sort, or requests with an
+ * offset or limit in QUERY, get one page of entries in directory order.
+ */
+void http_load_directory(struct http_request *request, char *path,
+    char *query, struct stat *info, struct http_response *response) {
+  char index_path[PATH_MAX];
+  struct stat index_info;
+
+  long long offset = 0, limit = DIRLIST_PAGE_SIZE;
+  int paged = http_query_long(query, "offset", &offset);
+  paged |= http_query_long(query, "limit", &limit);
+
+  /* A cached listing means there was no index.html when it was made, and
+   * adding one since would have changed the directory. */
+  fcache_entry_t *entry;
+  if (!paged && (entry = fcache_lookup(&listing_cache, path, info)) != NULL) {
+    response->status_code = 200;
+    response->content_type = "text/html";
+    http_use_cache_entry(entry, response);
+    return;
+  }
 
   /* Directory contains an index.html file? */
-  if (stat(index_path, &info) == 0) {
-    http_send_file(fd, index_path);
+  if (snprintf(index_path, sizeof(index_path), "%s/index.html", path)
+        < (int) sizeof(index_path)
+      && (http_peek(&file_cache, index_path, &index_info, S_IFREG)
+        || stat(index_path, &index_info) == 0)) {
+    http_load_file(request, index_path, &index_info, response);
+    return;
+  }
+
+  if (offset < 0 || limit < 1 || limit > DIRLIST_MAX_PAGE_SIZE) {
+    response->status_code = 400;
+    return;
+  }
+  response->content_type = "text/html";
+
+  /* Create page with links to all files in the directory */
+  int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0 || fstat(dir_fd, info) < 0) {
+    log_debug("Error occurred while reading directory %s\n", path);
+    if (dir_fd >= 0) close(dir_fd);
+    response->status_code = 404;
+    return;
+  }
+  dirlist_buffer_t listing = { 0 };
+  int result = 1;
+  if (!paged) result = dirlist_render_sorted(dir_fd, &listing);
+  if (result == 1) {
+    dirlist_buffer_free(&listing);
+    paged = 1;
+    result = dirlist_render_page(dir_fd, offset, limit, &listing);
+  }
+  close(dir_fd);
+  if (result < 0) {
+    dirlist_buffer_free(&listing);
+    response->status_code = 500;
+    return;
+  }
+
+  response->status_code = 200;
+  if (!paged && fcache_enabled(&listing_cache)
+      && listing.length <= listing_cache.shard_capacity
+      && (entry = fcache_insert(&listing_cache, path, info, listing.data,
+          listing.length)) != NULL) {
+    http_use_cache_entry(entry, response);
   } else {
-    /* Create page with links to all files in the directory */
-    n = scandir(path, &fname_list, NULL, alphasort);
-    if (n < 0) {
-      printf("Error occurred while reading directory %s\n", path);
-    } else {
-      http_create_dirlist(n, fname_list, buffer);
-      http_start_response(fd, 200);
-      http_send_header(fd, "Content-Type", "text/html");
-      http_end_headers(fd);
-      http_send_string(fd, buffer);
-    }
+    response->body = listing.data;
+    response->body_length = listing.length;
+    response->body_owned = 1;
   }
-  free(index_path);
+}
+
+/* Answers requests for the server's own figures in the initialized
+ * RESPONSE: /__stats as JSON and /__stats/prometheus in the Prometheus text
+ * format. PATH_LENGTH is the length of PATH without its query. Returns 0
+ * for any other path. */
+static int stats_prepare_response(char *path, size_t path_length,
+    struct http_response *response) {
+  static const char stats_path[] = "/__stats";
+  static const char prometheus_path[] = "/__stats/prometheus";
+  int prometheus = path_length == sizeof(prometheus_path) - 1
+      && memcmp(path, prometheus_path, path_length) == 0;
+  if (!serving_stats || (!prometheus && (path_length != sizeof(stats_path) - 1
+        || memcmp(path, stats_path, path_length) != 0)))
+    return 0;
+
+  char *body;
+  size_t body_length;
+  FILE *out = open_memstream(&body, &body_length);
+  if (out == NULL) {
+    response->status_code = 500;
+    return 1;
+  }
+  stats_render(out, prometheus, pool_running ? &thread_pool : NULL);
+  fclose(out);
+  response->body = body;
+  response->body_length = body_length;
+  response->body_owned = 1;
+  response->status_code = 200;
+  response->content_type = prometheus
+      ? "text/plain; version=0.0.4" : "application/json";
+  http_response_add_header(response, "Cache-Control", "no-store");
+  return 1;
 }
 
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * Decides the response to REQUEST for the files handler:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -147,331 +574,694 @@ void http_send_directory(int fd, char* path) {
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
+ *
+ * Used both by handle_files_request and by the event loop.
  */
-void handle_files_request(int fd) {
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
-  printf("Handling files request from socket %d...\n", fd);
-  struct http_request *request = http_request_parse(fd);
+void files_prepare_response(struct http_request *request,
+    struct http_response *response, arena_t *arena) {
   struct stat info;
 
+  http_response_init(response);
+  response->arena = arena;
+  if (request == NULL) {
+    response->status_code = 400;
+    return;
+  }
+
   /* Get the absolute path to the requested file or directory*/
   char *abs_path;
-
-  /* Something here may cause occasional SEGFAULT */
-  int len = strlen(server_files_directory)
-  	    + strlen(request->path);
-
-  abs_path = malloc(len + 1);
+  char *query = strchr(request->path, '?');
+  int path_length = query ? query - request->path : strlen(request->path);
+  if (stats_prepare_response(request->path, path_length, response)) return;
+  int len = strlen(server_files_directory) + path_length;
+
+  abs_path = arena_alloc(arena, len + 1);
+  if (abs_path == NULL) {
+    response->status_code = 500;
+    return;
+  }
   strcpy(abs_path, server_files_directory);
-  strcat(abs_path, request->path);
+  strncat(abs_path, request->path, path_length);
   abs_path[len] = '\0';
-   
+  if (query != NULL) query++;
+
+  /* Directories are cached (and watched) under their path without a
+   * trailing slash. */
+  int dir_request = len > 1 && abs_path[len - 1] == '/';
+  while (len > 1 && abs_path[len - 1] == '/') abs_path[--len] = '\0';
+
+  unsigned long since = 0;
+  int trustable = watching && watch_healthy(&watcher);
+  if (trustable) since = watch_generation(&watcher);
+
   /* Does the file/directory exist? */
-  if (stat(abs_path, &info) == 0) {
-    /* Is it a file or a directory? */
-    if (S_ISREG(info.st_mode)) {
-      /* Handle regular file */
-      http_send_file(fd, abs_path);
-    } else if (S_ISDIR(info.st_mode)) {
-      /* Handle directory */
-      http_send_directory(fd, abs_path);
-    }
+  if (!dir_request && (http_peek(&file_cache, abs_path, &info, S_IFREG)
+        || http_peek(&compressed_cache, abs_path, &info, S_IFREG))) {
+    http_load_file(request, abs_path, &info, response);
+  } else if (dir_request && query == NULL
+      && http_peek(&listing_cache, abs_path, &info, S_IFDIR)) {
+    http_load_directory(request, abs_path, query, &info, response);
+  } else if (stat(abs_path, &info) != 0) {
+    response->status_code = 404;
+  } else if (S_ISREG(info.st_mode) && !dir_request) {
+    /* Handle regular file */
+    http_load_file(request, abs_path, &info, response);
+  } else if (S_ISDIR(info.st_mode)) {
+    /* Handle directory */
+    http_load_directory(request, abs_path, query, &info, response);
   } else {
-    /* Send a 404 response */
-    http_start_response(fd, 404);
+    response->status_code = 404;
   }
-  free(abs_path);
-  free(request);
+  if (trustable) http_trust_response(response, since);
 }
 
-/* PROXY CLIENT THREAD FUNCTION */
-void *proxy_client_thread_func(void *arg) {
-  printf("Entering proxy client thread function...\n");
-  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
-  char first_line[LIBHTTP_REQUEST_MAX_SIZE];
-  char second_line[LIBHTTP_REQUEST_MAX_SIZE];
-  char port_num[8];
-  int n_bytes;
-  struct proxy_session_info *info = arg;
+/* Counts a request to HANDLER that has been answered in the stats and, if
+ * enabled, the access log. */
+static void http_record_request(stats_handler_t handler,
+    struct sockaddr *peer, struct http_request *request, int status_code,
+    long long bytes, struct timespec *started) {
+  stats_request(handler, status_code, bytes, started);
+  if (logging_access)
+    accesslog_write(&access_log, peer, request, status_code, bytes, started);
+}
 
-  while (1) {
-    // clear the buffer
-    memset(&buffer, '\0', sizeof(buffer));
-
-    // read request from client
-    pthread_mutex_lock(&info->client_mut);
-    n_bytes = read(info->client_fd, buffer, sizeof(buffer));
-    pthread_mutex_unlock(&info->client_mut);
-    
-    if (n_bytes < 0) {
-      // client_fd must be closed, quit
-      pthread_mutex_lock(&info->server_mut);
-      close(info->server_fd);
-      pthread_mutex_unlock(&info->server_mut);
-      return NULL;
-    } else if (n_bytes == 0) {
-      // keep checking for data
-      sleep(1);
-    } else {
-      // write the request to the server
-      // TODO: re-structure the request so it has the right hostname header
-      printf("request:\n%s\n", buffer);
-
-      memset(&first_line, '\0', sizeof(first_line));
-      memset(&second_line, '\0', sizeof(second_line));
-      int i, j;
-      
-      for (i = 0; i < n_bytes && buffer[i] != '\n'; i++) {
-        
-      }
-      i++;
-      memcpy(&first_line, buffer, i); // copy first line into first_line
-      for (j = i; j < n_bytes && buffer[j] != '\n'; j++) {
+/* Called by the event loop when it is done with a files request. */
+static void files_complete(struct sockaddr *peer, struct http_request *request,
+    struct http_response *response, size_t body_sent,
+    struct timespec *started) {
+  http_record_request(STATS_FILES, peer, request, response->status_code,
+      body_sent, started);
+}
 
-      }
-      j++;
-      memcpy(&second_line, buffer + i, j - i);
-
-      printf("First line:\n%s", first_line);
-      printf("Second line:\n%s", second_line);
-
-      memset(&second_line, '\0', sizeof(second_line));
-      strcpy(second_line, "Host: ");
-      strcat(second_line, "www.");
-      strcat(second_line, info->server_hostname);
-      strcat(second_line, ":");
-      
-      sprintf(port_num, "%d", info->server_port);
-
-      strcat(second_line, port_num);
-      strcat(second_line, "\r\n");
-
-      printf("New second line:\n%s", second_line);
-
-      pthread_mutex_lock(&info->server_mut);
-      write(info->server_fd, first_line, strlen(first_line));
-      write(info->server_fd, second_line, strlen(second_line));
-      printf("New rest of request:\n%s", buffer + j);
-      n_bytes = write(info->server_fd, buffer + j, n_bytes);
-      pthread_cond_signal(&info->cond);
-      pthread_cond_wait(&info->cond, &info->server_mut);
-      pthread_mutex_unlock(&info->server_mut);
-    }
+/* Stores the address of FD's peer in PEER for the access log, or marks it
+ * unknown. */
+static void http_get_peer(int fd, struct sockaddr_storage *peer) {
+  socklen_t length = sizeof(*peer);
+  if (getpeername(fd, (struct sockaddr *) peer, &length) < 0)
+    peer->ss_family = AF_UNSPEC;
+}
+
+/*
+ * Reads HTTP requests from stream (fd) and writes the responses prepared by
+ * files_prepare_response, in order. The connection is kept open between
+ * requests as long as the client allows it, it does not sit idle for longer
+ * than keep_alive_timeout, and it has not used up max_keep_alive_requests.
+ */
+void handle_files_request(int fd) {
+  log_debug("Handling files request from socket %d...\n", fd);
+  struct http_request *request;
+  struct http_response response;
+  struct sockaddr_storage peer;
+  struct timespec started;
+  arena_t arena;
+
+  if (logging_access) http_get_peer(fd, &peer);
+
+  /* The connection sits at the bottom of the arena; each request's memory
+   * goes above it and is dropped once the response is out. */
+  arena_init(&arena);
+  struct http_conn *conn = arena_alloc(&arena, sizeof(struct http_conn));
+  if (conn == NULL) return;
+  arena_mark_t request_mark = arena_mark(&arena);
+
+  http_conn_init(conn, fd);
+  while (http_conn_read_request(conn, &request, keep_alive_timeout * 1000)) {
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    files_prepare_response(request, &response, &arena);
+    response.keep_alive = http_conn_keep_alive(conn, request,
+        max_keep_alive_requests);
+    http_send_response(fd, &response);
+    http_record_request(STATS_FILES, (struct sockaddr *) &peer, request,
+        response.status_code, http_response_content_length(&response),
+        &started);
+    http_response_release(&response);
+    arena_release(&arena, request_mark);
+    if (!response.keep_alive) break;
   }
+  arena_destroy(&arena);
 }
 
-/* PROXY SERVER THREAD FUNCTION */
-void *proxy_server_thread_func(void *arg) {
-  printf("Entering proxy server thread function...\n");
-  int chunk_size = 200;
-  int full_size = chunk_size;
-  char static_buf[chunk_size];
-  char *dyn_buf = malloc(chunk_size);
-  int n_bytes;
-  struct proxy_session_info *info = arg;
+/* Answers a proxied request that could not be forwarded, then lets the
+ * connection close. */
+static void proxy_send_error(int fd, int status_code) {
+  char body[128];
+  struct http_response response;
+  http_response_init(&response);
+  response.status_code = status_code;
+  response.content_type = "text/html";
+  response.body = body;
+  response.body_length = snprintf(body, sizeof(body),
+      "<center><h1>%d %s</h1><hr></center>", status_code,
+      http_get_response_message(status_code));
+  http_send_response(fd, &response);
+}
 
+/* Reads from FD, waiting at most proxy_idle_timeout seconds for data.
+ * Returns what read returns, or -1 on timeout. */
+static ssize_t proxy_read(int fd, char *buffer, size_t size) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
   while (1) {
-    // read from the server
-    pthread_mutex_lock(&info->server_mut);
-    printf("reading response...\n");
-    n_bytes = read(info->server_fd, static_buf, chunk_size);
-    pthread_mutex_unlock(&info->server_mut);
-
-    if (n_bytes < 0) {
-      // server socket must be closed, so quit
-      pthread_mutex_lock(&info->client_mut);
-      close(info->client_fd);
-      pthread_mutex_unlock(&info->client_mut);
-      return NULL;
-    } else if (n_bytes == 0) {
-      // keep checking for data
-      sleep(1);
-    } else {
-      memcpy(dyn_buf, static_buf, chunk_size);
-      pthread_mutex_lock(&info->server_mut);
-      memset(static_buf, '\0', chunk_size);
-      while ( (n_bytes = read(info->server_fd, static_buf, chunk_size)) > 0) {
-        pthread_mutex_unlock(&info->server_mut);
-        printf("full size: %d, n_bytes: %d\n", full_size, n_bytes);
-        full_size += n_bytes;
-        dyn_buf = realloc(dyn_buf, full_size);
-        strcat(dyn_buf, static_buf);
-        memset(static_buf, '\0', chunk_size);
-        pthread_mutex_lock(&info->server_mut);
-      }
-      pthread_mutex_unlock(&info->server_mut);
-      dyn_buf[full_size] = '\0';
-
-      // write response to the client
-      printf("response:\n%s\n", dyn_buf);
-      pthread_mutex_lock(&info->client_mut);
-      /*if (n_bytes < 0) {
-        perror("client socket closed\n");
-        pthread_mutex_lock(&info->server_mut);
-        close(info->server_fd);
-        pthread_mutex_unlock(&info->server_mut);
-        return NULL;
-      }*/
-
-      http_send_string(info->client_fd, dyn_buf);
-      free(dyn_buf);
-      //printf("wrote %d bytes to client socket\n", n_bytes);
-      pthread_cond_signal(&info->cond);
-      pthread_cond_wait(&info->cond, &info->client_mut);
-      pthread_mutex_unlock(&info->client_mut);
-    }
+    int ready = poll(&pfd, 1, proxy_idle_timeout * 1000);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready <= 0) return -1;
+    ssize_t n = read(fd, buffer, size);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+    return n;
   }
 }
 
-/*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
- *
- *   +--------+     +------------+     +--------------+
- *   | client | <-> | httpserver | <-> | proxy target |
- *   +--------+     +------------+     +--------------+
- */
-void handle_proxy_request(int fd) {
+/* Copies the upstream response head HEAD (LENGTH bytes) into BUFFER without
+ * its hop-by-hop headers and with our own Connection header. Returns the new
+ * length. BUFFER must have room for LENGTH + 32 bytes. */
+static size_t proxy_rewrite_response_head(char *head, size_t length,
+    int keep_alive, char *buffer) {
+  size_t out = 0;
+  char *end = head + length;
+  char *line = head;
+  char *line_end;
+
+  for (; line < end; line = line_end + 1) {
+    line_end = memchr(line, '\n', end - line);
+    if (line_end == NULL || line_end == line
+        || (line_end == line + 1 && line[0] == '\r'))
+      break;  // Blank line: end of the head.
+    if (line != head
+        && (strncasecmp(line, "Connection:", 11) == 0
+          || strncasecmp(line, "Keep-Alive:", 11) == 0
+          || strncasecmp(line, "Proxy-Connection:", 17) == 0))
+      continue;
+    memcpy(buffer + out, line, line_end + 1 - line);
+    out += line_end + 1 - line;
+  }
+  out += sprintf(buffer + out, "Connection: %s\r\n\r\n",
+      keep_alive ? "keep-alive" : "close");
+  return out;
+}
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+/* Outcomes of proxy_exchange. */
+enum {
+  PROXY_DONE,       /* The whole response reached the client. */
+  PROXY_RETRY,      /* The upstream failed before answering; safe to retry. */
+  PROXY_FAILED,     /* The upstream failed; the client has seen nothing. */
+  PROXY_ABORTED,    /* Part of the response was sent; drop the client. */
+};
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+/* Sends the request head REQUEST_HEAD to UPSTREAM_FD and relays the response
+ * to the client FD. Bodies of known length go through splice; chunked bodies
+ * are followed in userspace to find their end. Sets *REUSABLE if the
+ * upstream connection may carry another request and *KEEP_ALIVE to whether
+ * the client connection may. The final response head is copied into
+ * RESPONSE_HEAD, its content_length set to 0 if no body was sent. */
+static int proxy_exchange(int fd, int upstream_fd, char *request_head,
+    size_t request_head_length, int head_only, int *keep_alive,
+    int *reusable, struct http_response_head *response_head) {
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+  char client_head[LIBHTTP_REQUEST_MAX_SIZE + 32];
+  struct http_response_head head;
+  size_t length = 0;
+  ssize_t head_length, n;
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  *reusable = 0;
+  if (http_send_more(upstream_fd, request_head, request_head_length, 0) < 0)
+    return PROXY_RETRY;
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+  while (1) {
+    while ((head_length = http_parse_response_head(buffer, length, &head))
+        == 0) {
+      if (length == sizeof(buffer)) return PROXY_FAILED;
+      n = proxy_read(upstream_fd, buffer + length, sizeof(buffer) - length);
+      if (n <= 0) return length == 0 ? PROXY_RETRY : PROXY_FAILED;
+      length += n;
+    }
+    if (head_length < 0) return PROXY_FAILED;
+    /* Pass interim responses (other than a protocol switch) straight on. */
+    if (head.status_code < 100 || head.status_code >= 200
+        || head.status_code == 101)
+      break;
+    http_send_more(fd, buffer, head_length, 0);
+    length -= head_length;
+    memmove(buffer, buffer + head_length, length);
+  }
+  *response_head = head;
+
+  if (head.status_code == 101) {
+    /* The connection now speaks another protocol: relay it until closed. */
+    http_send_more(fd, buffer, length, 0);
+    relay_run(fd, upstream_fd, proxy_idle_timeout * 1000);
+    return PROXY_ABORTED;
   }
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+  int no_body = head_only || head.status_code == 204
+      || head.status_code == 304;
+  if (no_body) response_head->content_length = 0;
+  int until_close = !no_body && !head.chunked && head.content_length < 0;
+  if (until_close) *keep_alive = 0;
+
+  size_t client_head_length = proxy_rewrite_response_head(buffer, head_length,
+      *keep_alive, client_head);
+  size_t body_length = length - head_length;
+  int done = no_body;
+  struct http_chunked chunked;
+
+  if (no_body) {
+    body_length = 0;
+  } else if (head.chunked) {
+    http_chunked_init(&chunked);
+    n = http_chunked_scan(&chunked, buffer + head_length, body_length, &done);
+    if (n < 0) return PROXY_FAILED;
+    body_length = n;
+  } else if (head.content_length >= 0) {
+    if ((long long) body_length >= head.content_length) {
+      body_length = head.content_length;
+      done = 1;
+    }
+  }
+  /* Anything past the body is unexpected and leaves the stream unusable. */
+  int clean = head_length + body_length == length;
+
+  struct iovec iov[2] = {
+    { .iov_base = client_head, .iov_len = client_head_length },
+    { .iov_base = buffer + head_length, .iov_len = body_length },
+  };
+  http_writev_all(fd, iov, body_length > 0 ? 2 : 1);
+
+  if (!done && head.chunked) {
+    while (!done) {
+      n = proxy_read(upstream_fd, buffer, sizeof(buffer));
+      if (n <= 0) return PROXY_ABORTED;
+      ssize_t used = http_chunked_scan(&chunked, buffer, n, &done);
+      if (used < 0) return PROXY_ABORTED;
+      if (used < n) clean = 0;
+      if (http_send_more(fd, buffer, used, 0) < 0) return PROXY_ABORTED;
+    }
+  } else if (!done && until_close) {
+    relay_copy(upstream_fd, fd, (size_t) -1, proxy_idle_timeout * 1000);
+    return PROXY_DONE;
+  } else if (!done) {
+    size_t remaining = head.content_length - body_length;
+    if (relay_copy(upstream_fd, fd, remaining, proxy_idle_timeout * 1000)
+        != (ssize_t) remaining)
+      return PROXY_ABORTED;
   }
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+  *reusable = clean && head.keep_alive;
+  return PROXY_DONE;
+}
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/* Forwards REQUEST upstream over a pooled connection and relays the answer.
+ * A reused connection that turns out to have been closed by the upstream is
+ * retried once on a fresh one. Returns 1 if the client connection may carry
+ * another request. RESPONSE_HEAD describes the answer the client got, for
+ * the access log. */
+static int proxy_forward(int fd, struct http_request *request,
+    int keep_alive, struct http_response_head *response_head) {
+  char head[LIBHTTP_REQUEST_MAX_SIZE + 256];
+  int head_length = http_format_request_head(request, upstream.host_header,
+      "keep-alive", head, sizeof(head));
+  response_head->content_length = -1;
+  if (head_length < 0) {
+    response_head->status_code = 400;
+    proxy_send_error(fd, 400);
+    return 0;
+  }
+  int head_only = strcmp(request->method, "HEAD") == 0;
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int reused, reusable;
+    int upstream_fd = upstream_checkout(&upstream, &reused);
+    if (upstream_fd < 0) {
+      stats_upstream_error();
+      break;
+    }
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+    int status = proxy_exchange(fd, upstream_fd, head, head_length, head_only,
+        &keep_alive, &reusable, response_head);
+    upstream_checkin(&upstream, upstream_fd, reusable);
+    if (status == PROXY_DONE) return keep_alive;
+    stats_upstream_error();
+    if (status == PROXY_ABORTED) return 0;
+    if (status == PROXY_FAILED || !reused) break;
+  }
+  response_head->status_code = 502;
+  response_head->content_length = -1;
+  proxy_send_error(fd, 502);
+  return 0;
+}
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+/* Passes REQUEST and everything after it to a dedicated upstream connection
+ * and relays both directions until either side closes. Used for requests
+ * with a body and for protocol upgrades, which are not worth following
+ * through a pooled connection. */
+static void proxy_tunnel(struct http_conn *conn, struct http_request *request) {
+  char head[LIBHTTP_REQUEST_MAX_SIZE + 256];
+  char *connection = http_request_header(request, "Upgrade")
+      ? http_request_header(request, "Connection") : NULL;
+  int head_length = http_format_request_head(request, upstream.host_header,
+      connection ? connection : "close", head, sizeof(head));
+  if (head_length < 0) {
+    proxy_send_error(conn->fd, 400);
     return;
+  }
 
+  int upstream_fd = upstream_connect(&upstream);
+  if (upstream_fd < 0) {
+    stats_upstream_error();
+    proxy_send_error(conn->fd, 502);
+    return;
   }
+  struct iovec iov[2] = {
+    { .iov_base = head, .iov_len = head_length },
+    { .iov_base = conn->buffer + conn->start,
+      .iov_len = conn->length - conn->start },
+  };
+  http_writev_all(upstream_fd, iov, 2);
+  relay_run(conn->fd, upstream_fd, proxy_idle_timeout * 1000);
+  close(upstream_fd);
+}
 
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
-  struct proxy_session_info *info = malloc(sizeof(struct proxy_session_info));
-  pthread_t client_thread, server_thread;
+/*
+ * Relays requests from the client on fd to the proxy target
+ * (hostname=server_proxy_hostname and port=server_proxy_port) and the
+ * responses back. Each request is forwarded on its own over a persistent
+ * upstream connection from the pool, so the client may keep its connection
+ * open and the upstream connection is reused by later requests.
+ *
+ *   +--------+     +------------+     +--------------+
+ *   | client | <-> | httpserver | <-> | proxy target |
+ *   +--------+     +------------+     +--------------+
+ */
+void handle_proxy_request(int fd) {
+  struct http_request *request;
+  struct http_response_head head;
+  struct sockaddr_storage peer;
+  struct timespec started;
+  arena_t arena;
+
+  if (logging_access) http_get_peer(fd, &peer);
+  arena_init(&arena);
+  struct http_conn *conn = arena_alloc(&arena, sizeof(struct http_conn));
+  if (conn == NULL) return;
+  http_conn_init(conn, fd);
+  while (http_conn_read_request(conn, &request, keep_alive_timeout * 1000)) {
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (request == NULL) {
+      proxy_send_error(fd, 400);
+      http_record_request(STATS_PROXY, (struct sockaddr *) &peer, NULL, 400,
+          -1, &started);
+      break;
+    }
+    int keep_alive = http_conn_keep_alive(conn, request,
+        max_keep_alive_requests);
+    struct http_response response;
+    http_response_init(&response);
+    if (stats_prepare_response(request->path, strcspn(request->path, "?"),
+          &response)) {
+      response.keep_alive = keep_alive;
+      http_send_response(fd, &response);
+      http_record_request(STATS_PROXY, (struct sockaddr *) &peer, request,
+          response.status_code, http_response_content_length(&response),
+          &started);
+      http_response_release(&response);
+      if (!keep_alive) break;
+      continue;
+    }
+    if (request->has_body || http_request_header(request, "Upgrade")) {
+      /* The tunnel does not look at the response: its status is unknown. */
+      proxy_tunnel(conn, request);
+      http_record_request(STATS_PROXY, (struct sockaddr *) &peer, request, 0,
+          -1, &started);
+      break;
+    }
+    keep_alive = proxy_forward(fd, request, keep_alive, &head);
+    http_record_request(STATS_PROXY, (struct sockaddr *) &peer, request,
+        head.status_code, head.content_length, &started);
+    if (!keep_alive) break;
+  }
+  arena_destroy(&arena);
+}
 
-  info->server_hostname = malloc(sizeof(server_proxy_hostname));
-  memcpy(info->server_hostname, server_proxy_hostname, strlen(server_proxy_hostname));
-  info->server_hostname[strlen(server_proxy_hostname)] = '\0';
-  info->server_port = server_proxy_port;
-  info->client_fd = fd;
-  info->server_fd = client_socket_fd;
-  pthread_cond_init(&info->cond, NULL);
-  pthread_mutex_init(&info->client_mut, NULL);
-  pthread_mutex_init(&info->server_mut, NULL);
-  
-  pthread_create(&client_thread, NULL, &proxy_client_thread_func, (void*) info);
-  pthread_create(&server_thread, NULL, &proxy_server_thread_func, (void*) info);
-  pthread_join(client_thread, NULL);
-  pthread_join(server_thread, NULL);
+/* Releases what the request handlers keep per thread, when a worker retires. */
+void worker_thread_exit(void) {
+  arena_thread_exit();
+  http_thread_exit();
+  if (logging_access) accesslog_retire_thread();
+  relay_thread_exit();
+  if (server_proxy_hostname != NULL) upstream_thread_exit(&upstream);
 }
 
-/* THREAD FUNCTION */
-void *thread_function(void *arg) {
-  printf("Entering the thread function...\n");
-  int connection_socket;
-  void (*request_handler)(int) = arg;
-  while (1) {
-    connection_socket = wq_pop(&work_queue);
-    request_handler(connection_socket);
-    printf("In thread function, closing socket %d\n", connection_socket);
-    close(connection_socket);
+void init_thread_pool(void (*request_handler)(int)) {
+  if (min_threads == max_threads) {
+    printf("Initializing thread pool with %d threads...\n", min_threads);
+  } else {
+    printf("Initializing thread pool with %d to %d threads...\n", min_threads,
+        max_threads);
   }
+  pool_init(&thread_pool, min_threads, max_threads, queue_delay_ms,
+      thread_idle_timeout, request_handler, &worker_thread_exit);
+  pool_limit(&thread_pool, max_queue, max_queue_delay_ms);
+  if (max_queue > 0 || max_queue_delay_ms > 0) drain_init(&shed_drain);
 }
 
-
-void init_thread_pool(int num_threads, void (*request_handler)(int)) {
-  /*
-   * TODO: Part of your solution for Task 2 goes here!
-   */
-  printf("Initializing thread pool with %d threads...\n", num_threads);
-  wq_init(&work_queue);
-  thread_pool = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
-  for (int i = 0; i < num_threads; i++) {
-    pthread_create(&thread_pool[i], NULL, &thread_function, request_handler);
+/* Returns 1 if the request on CLIENT_SOCKET_NUMBER is for one of the
+ * priority paths. Looks only at what is already readable, with one peek that
+ * reads nothing off the socket and never waits: right after accept() the
+ * request line has often not arrived yet, and such a connection is shed like
+ * any other. Connections handed off by the event loop already have their
+ * whole head, so they are always recognized. */
+int is_priority_request(int client_socket_number) {
+  if (num_priority_paths == 0) return 0;
+  char line[256];
+  ssize_t n = recv(client_socket_number, line, sizeof(line) - 1,
+      MSG_PEEK | MSG_DONTWAIT);
+  if (n <= 0) return 0;
+  line[n] = '\0';
+  char *path = strchr(line, ' ');
+  if (path == NULL) return 0;
+  path++;
+  for (int i = 0; i < num_priority_paths; i++) {
+    if (strncmp(path, priority_paths[i], strlen(priority_paths[i])) == 0)
+      return 1;
   }
+  return 0;
 }
 
-/*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
- */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+/* Turns CLIENT_SOCKET_NUMBER away without making it wait for a worker:
+ * writes the ready-made 503, shuts down the sending side so the client sees
+ * the answer and then EOF, and leaves closing the socket to the drain thread
+ * (see drain.h), so a request still arriving cannot reset the connection
+ * and destroy the 503. Never blocks. */
+void shed_connection(int client_socket_number) {
+  send(client_socket_number, shed_response, sizeof(shed_response) - 1,
+      MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(client_socket_number, SHUT_WR);
+  drain_close(&shed_drain, client_socket_number);
+  stats_shed();
+}
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+/* Passes an accepted connection to the thread pool, or sheds it if the
+ * pool's queues are full and it is not for a priority path. */
+void queue_connection(int client_socket_number) {
+  if (pool_submit(&thread_pool, client_socket_number) == 0) return;
+  if (!is_priority_request(client_socket_number)
+      || pool_submit_priority(&thread_pool, client_socket_number) < 0)
+    shed_connection(client_socket_number);
+}
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+/*
+ * Opens a TCP stream socket on all interfaces with port number server_port
+ * and starts listening on it. With REUSEPORT set, several such sockets can be
+ * bound to the same port and the kernel spreads connections across them.
+ */
+int open_listener(int reuseport) {
+  struct sockaddr_in server_address;
+  int socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
         sizeof(socket_option)) == -1) {
     perror("Failed to set socket options");
     exit(errno);
   }
+  if (reuseport && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1) {
+    perror("Failed to set SO_REUSEPORT");
+    exit(errno);
+  }
 
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(server_port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(socket_number, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (listen(socket_number, 1024) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
+  return socket_number;
+}
+
+/*
+ * Attaches a classic BPF program to the SO_REUSEPORT group of LISTENER that
+ * picks the listener whose index equals the CPU the connection arrived on.
+ * Together with pinning listener i's thread to CPU i this keeps a connection
+ * on the CPU that handled its packets. If the CPU number is out of range the
+ * kernel falls back to hashing.
+ */
+void attach_cpu_steering(int listener) {
+  struct sock_filter code[] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog program = { .len = 2, .filter = code };
+
+  if (setsockopt(listener, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+        sizeof(program)) == -1)
+    perror("Failed to attach CPU steering program (ignoring)");
+}
+
+struct listener_thread_info {
+  int index;
+  int listener;
+  void (*request_handler)(int);
+};
+
+/* Accepts on a thread's own SO_REUSEPORT listener and serves each connection
+ * directly, with no hand-off through a run queue. */
+void *listener_thread_function(void *arg) {
+  struct listener_thread_info *info = arg;
+  int client_socket_number;
+  struct timespec mark;
+
+  evloop_pin_cpu(info->index);
+  stats_name_thread("listener", info->index);
+  clock_gettime(CLOCK_MONOTONIC, &mark);
+  while (1) {
+    client_socket_number = accept(info->listener, NULL, NULL);
+    if (client_socket_number < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        perror("Error accepting socket");
+      continue;
+    }
+    stats_idle(&mark);
+    info->request_handler(client_socket_number);
+    close(client_socket_number);
+    stats_busy(&mark);
+  }
+  return NULL;
+}
+
+/* Starts invalidating the file handler's caches as files change, so cache
+ * hits need no stat(). Cache keys must then be canonical paths, so the
+ * document root is resolved with realpath first. */
+void start_watching(void) {
+  static fcache_t *caches[] = { &file_cache, &compressed_cache, &listing_cache };
+  char *root = realpath(server_files_directory, NULL);
+  if (root == NULL) {
+    perror("Cannot resolve the files directory; not watching it");
+    return;
+  }
+  if (watch_init(&watcher, root, caches,
+        sizeof(caches) / sizeof(caches[0])) < 0) {
+    free(root);
+    return;
+  }
+  server_files_directory = root;
+  watching = 1;
+}
+
+/*
+ * Listens on port server_port. Saves the fd number of the server socket in
+ * *socket_number. For each accepted connection, calls request_handler with
+ * the accepted fd number.
+ *
+ * With --reuseport every worker (or event loop) gets its own listener instead
+ * of sharing one accept socket.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  struct sockaddr_in client_address;
+  size_t client_address_length = sizeof(client_address);
+  int client_socket_number;
+  int num_listeners = num_threads < 1 ? 1 : num_threads;
+  int *listeners = NULL;
+
+  if (reuseport) {
+    /* Bind in index order: the steering program picks listeners by it. */
+    listeners = malloc(num_listeners * sizeof(int));
+    for (int i = 0; i < num_listeners; i++) {
+      listeners[i] = open_listener(1);
+    }
+    attach_cpu_steering(listeners[0]);
+    *socket_number = listeners[0];
+  } else {
+    *socket_number = open_listener(0);
+  }
 
   printf("Listening on port %d...\n", server_port);
 
-  init_thread_pool(num_threads, request_handler);
+  if (request_handler == handle_files_request && watch_files)
+    start_watching();
+  /* Workers are needed for the shared accept loop and for connections the
+   * event loop hands off. Native event loops and per-thread listeners
+   * serve everything themselves. */
+  if (event_loop ? request_handler != handle_files_request : !reuseport) {
+    init_thread_pool(request_handler);
+    pool_running = 1;
+  }
+  if (request_handler == handle_proxy_request)
+    upstream_init(&upstream, server_proxy_hostname, server_proxy_port,
+        dns_ttl, num_listeners, upstream_min_idle, upstream_max_idle);
+
+  if (event_loop) {
+    /* The files handler runs natively in the loop; anything else is handed
+     * to the thread pool once its request has arrived. */
+    ev_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.num_loops = num_listeners;
+    options.listen_fds = listeners;
+    options.pin_cpus = reuseport;
+    if (request_handler == handle_files_request) {
+      options.prepare = files_prepare_response;
+    } else {
+      options.handoff = &queue_connection;
+    }
+    options.idle_timeout = keep_alive_timeout;
+    options.max_requests = max_keep_alive_requests;
+    if (options.prepare != NULL) options.complete = files_complete;
+    /* io_uring only serves natively; handed-off connections need epoll. */
+    if (io_uring && options.prepare != NULL && uring_supported())
+      uring_run(*socket_number, &options);
+    if (io_uring) printf("Falling back to the epoll event loop\n");
+    evloop_run(*socket_number, &options);
+  }
 
+  if (reuseport) {
+    struct listener_thread_info *infos =
+        malloc(num_listeners * sizeof(struct listener_thread_info));
+    pthread_t *threads = malloc(num_listeners * sizeof(pthread_t));
+    printf("Serving from %d SO_REUSEPORT listeners...\n", num_listeners);
+    for (int i = 0; i < num_listeners; i++) {
+      infos[i].index = i;
+      infos[i].listener = listeners[i];
+      infos[i].request_handler = request_handler;
+      pthread_create(&threads[i], NULL, &listener_thread_function, &infos[i]);
+    }
+    for (int i = 0; i < num_listeners; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  stats_name_thread("acceptor", 0);
   while (1) {
     client_socket_number = accept(*socket_number,
         (struct sockaddr *) &client_address,
@@ -481,31 +1271,43 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
+    log_debug("Accepted connection from %s on port %d\n",
         inet_ntoa(client_address.sin_addr),
         client_address.sin_port);
 
-    // TODO: Change me?
-    wq_push(&work_queue, client_socket_number); // add each new connection to the queue
-
-    /* request_handler(client_socket_number);
-    close(client_socket_number); */
-
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    queue_connection(client_socket_number);
   }
 
-  /* Deallocate thread pool */
-  free(thread_pool);
-
   shutdown(*socket_number, SHUT_RDWR);
   close(*socket_number);
 }
 
 int server_fd;
-void signal_callback_handler(int signum) {
+sigset_t shutdown_signals;
+
+/* THREAD FUNCTION */
+/* Waits for SIGINT or SIGTERM, which every thread blocks, then reports and
+ * exits. This runs in normal thread context rather than in a signal handler,
+ * so it may take the caches' locks and join the access log's flusher. */
+void *shutdown_thread_function(void *arg) {
+  int signum;
+  while (sigwait(&shutdown_signals, &signum) != 0)
+    ;
   printf("Caught signal %d: %s\n", signum, strsignal(signum));
+  fcache_t *caches[] = { &file_cache, &compressed_cache, &listing_cache };
+  char *cache_names[] = { "File cache", "Compressed cache", "Listing cache" };
+  for (int i = 0; i < 3; i++) {
+    if (!fcache_enabled(caches[i])) continue;
+    fcache_stats_t stats;
+    fcache_get_stats(caches[i], &stats);
+    printf("%s: %zu entries, %zu bytes, %lu hits, %lu misses, "
+        "%lu evictions\n", cache_names[i], stats.entries, stats.bytes,
+        stats.hits, stats.misses, stats.evictions);
+  }
+  if (logging_access) {
+    accesslog_stop(&access_log);
+    printf("Access log: %lu records dropped\n", accesslog_dropped(&access_log));
+  }
   printf("Closing socket %d\n", server_fd);
   if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
   exit(0);
@@ -513,7 +1315,67 @@ void signal_callback_handler(int signum) {
 
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "\n"
+  "Options:\n"
+  "  --num-threads N      run N worker threads (or event loops); without\n"
+  "                       this the pool grows from one thread per CPU as\n"
+  "                       needed\n"
+  "  --min-threads N      keep at least N worker threads\n"
+  "  --max-threads N      start at most N worker threads (default 8 per\n"
+  "                       minimum thread, or --num-threads if given)\n"
+  "  --queue-delay-ms MS  start another worker when a connection has waited\n"
+  "                       MS milliseconds for one (default 20)\n"
+  "  --thread-idle-timeout S\n"
+  "                       retire workers above the minimum after S idle\n"
+  "                       seconds (default 30)\n"
+  "  --max-queue N        answer new connections with 503 Service\n"
+  "                       Unavailable while N are waiting for a worker\n"
+  "  --max-queue-delay-ms MS\n"
+  "                       answer new connections with 503 while one has\n"
+  "                       waited MS milliseconds for a worker\n"
+  "  --priority-path PREFIX\n"
+  "                       serve requests for paths under PREFIX (e.g. a\n"
+  "                       health check) first and do not shed them once\n"
+  "                       their request line is in; may be repeated\n"
+  "  --event-loop         serve connections from non-blocking epoll loops\n"
+  "  --io-uring           like --event-loop, but drive socket I/O through\n"
+  "                       io_uring (Linux 5.19+, files only; falls back to\n"
+  "                       epoll otherwise)\n"
+  "  --reuseport          give every thread its own SO_REUSEPORT listener\n"
+  "  --file-cache-mb N    cache up to N megabytes of file contents in memory\n"
+  "  --compressed-cache-mb N\n"
+  "                       keep up to N megabytes of gzipped text files for\n"
+  "                       clients that accept them (default 16, 0 disables)\n"
+  "  --listing-cache-mb N\n"
+  "                       keep up to N megabytes of rendered directory\n"
+  "                       listings (default 4, 0 disables)\n"
+  "  --mime-types FILE    add the types in FILE (mime.types format) to the\n"
+  "                       built-in ones\n"
+  "  --no-watch           stat() files on every cache hit instead of watching\n"
+  "                       the files directory for changes with inotify\n"
+  "  --cache-control PREFIX=S\n"
+  "                       let clients cache files under PREFIX for S seconds\n"
+  "                       (Cache-Control: max-age); may be repeated\n"
+  "  --keep-alive-timeout S\n"
+  "                       close idle persistent connections after S seconds\n"
+  "                       (default 5)\n"
+  "  --max-keep-alive-requests N\n"
+  "                       close a connection after N requests (default 100)\n"
+  "  --upstream-min-idle N\n"
+  "                       keep at least N idle upstream connections per\n"
+  "                       thread open in proxy mode (default 0)\n"
+  "  --upstream-max-idle N\n"
+  "                       keep at most N idle upstream connections per\n"
+  "                       thread in proxy mode (default 8)\n"
+  "  --dns-ttl S          re-resolve the proxy target every S seconds\n"
+  "                       (default 30)\n"
+  "  --access-log FILE    log every request to FILE (- for standard output)\n"
+  "  --log-format F       access log format: common, combined (default) or\n"
+  "                       json, which adds the time taken in microseconds\n"
+  "  --no-stats           do not answer /__stats and /__stats/prometheus\n"
+  "                       with the server's counters\n"
+  "  -v, --verbose        print debug messages for every connection\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -521,10 +1383,21 @@ void exit_with_usage() {
 }
 
 int main(int argc, char **argv) {
-  signal(SIGINT, signal_callback_handler);
+  /* Block SIGINT and SIGTERM before any thread starts, so all of them
+   * inherit the mask and only the shutdown thread ever receives them. */
+  pthread_t shutdown_thread;
+  sigemptyset(&shutdown_signals);
+  sigaddset(&shutdown_signals, SIGINT);
+  sigaddset(&shutdown_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+  pthread_create(&shutdown_thread, NULL, &shutdown_thread_function, NULL);
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
+  stats_init();
+  fcache_init(&compressed_cache, COMPRESSED_CACHE_DEFAULT_MB << 20);
+  fcache_init(&listing_cache, LISTING_CACHE_DEFAULT_MB << 20);
   void (*request_handler)(int) = NULL;
 
   int i;
@@ -568,6 +1441,153 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--min-threads", argv[i]) == 0) {
+      char *min_threads_str = argv[++i];
+      if (!min_threads_str || (min_threads = atoi(min_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --min-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-delay-ms", argv[i]) == 0) {
+      char *delay_str = argv[++i];
+      if (!delay_str || (queue_delay_ms = atoi(delay_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --queue-delay-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--thread-idle-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (thread_idle_timeout = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --thread-idle-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-queue", argv[i]) == 0) {
+      char *max_queue_str = argv[++i];
+      if (!max_queue_str || (max_queue = atoi(max_queue_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-queue\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-queue-delay-ms", argv[i]) == 0) {
+      char *delay_str = argv[++i];
+      if (!delay_str || (max_queue_delay_ms = atoi(delay_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-queue-delay-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--priority-path", argv[i]) == 0) {
+      char *prefix = argv[++i];
+      if (!prefix || prefix[0] != '/'
+          || num_priority_paths == MAX_PRIORITY_PATHS) {
+        fprintf(stderr, "Expected a path after --priority-path\n");
+        exit_with_usage();
+      }
+      priority_paths[num_priority_paths++] = prefix;
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      event_loop = 1;
+    } else if (strcmp("--io-uring", argv[i]) == 0) {
+      event_loop = 1;
+      io_uring = 1;
+    } else if (strcmp("--reuseport", argv[i]) == 0) {
+      reuseport = 1;
+    } else if (strcmp("--file-cache-mb", argv[i]) == 0) {
+      char *file_cache_mb_str = argv[++i];
+      if (!file_cache_mb_str || atoi(file_cache_mb_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --file-cache-mb\n");
+        exit_with_usage();
+      }
+      fcache_init(&file_cache, (size_t) atoi(file_cache_mb_str) << 20);
+    } else if (strcmp("--compressed-cache-mb", argv[i]) == 0) {
+      char *compressed_cache_mb_str = argv[++i];
+      if (!compressed_cache_mb_str || atoi(compressed_cache_mb_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --compressed-cache-mb\n");
+        exit_with_usage();
+      }
+      fcache_init(&compressed_cache,
+          (size_t) atoi(compressed_cache_mb_str) << 20);
+    } else if (strcmp("--listing-cache-mb", argv[i]) == 0) {
+      char *listing_cache_mb_str = argv[++i];
+      if (!listing_cache_mb_str || atoi(listing_cache_mb_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --listing-cache-mb\n");
+        exit_with_usage();
+      }
+      fcache_init(&listing_cache, (size_t) atoi(listing_cache_mb_str) << 20);
+    } else if (strcmp("--mime-types", argv[i]) == 0) {
+      char *mime_types_path = argv[++i];
+      if (!mime_types_path) {
+        fprintf(stderr, "Expected argument after --mime-types\n");
+        exit_with_usage();
+      }
+      if (mime_load(mime_types_path) < 0) {
+        perror(mime_types_path);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp("--no-watch", argv[i]) == 0) {
+      watch_files = 0;
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_path = argv[++i];
+      if (!access_log_path) {
+        fprintf(stderr, "Expected argument after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--log-format", argv[i]) == 0) {
+      char *format_str = argv[++i];
+      if (!format_str
+          || accesslog_parse_format(format_str, &access_log_format) < 0) {
+        fprintf(stderr, "Expected common, combined or json after --log-format\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--no-stats", argv[i]) == 0) {
+      serving_stats = 0;
+    } else if (strcmp("-v", argv[i]) == 0
+        || strcmp("--verbose", argv[i]) == 0) {
+      log_verbosity++;
+    } else if (strcmp("--keep-alive-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (keep_alive_timeout = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keep-alive-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-keep-alive-requests", argv[i]) == 0) {
+      char *max_requests_str = argv[++i];
+      if (!max_requests_str
+          || (max_keep_alive_requests = atoi(max_requests_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-keep-alive-requests\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-min-idle", argv[i]) == 0) {
+      char *min_idle_str = argv[++i];
+      if (!min_idle_str || (upstream_min_idle = atoi(min_idle_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --upstream-min-idle\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-max-idle", argv[i]) == 0) {
+      char *max_idle_str = argv[++i];
+      if (!max_idle_str || (upstream_max_idle = atoi(max_idle_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --upstream-max-idle\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--dns-ttl", argv[i]) == 0) {
+      char *dns_ttl_str = argv[++i];
+      if (!dns_ttl_str || (dns_ttl = atoi(dns_ttl_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --dns-ttl\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-control", argv[i]) == 0) {
+      char *rule = argv[++i];
+      char *equals = rule ? strrchr(rule, '=') : NULL;
+      if (!equals || equals == rule || atoi(equals + 1) < 0
+          || num_cache_rules == MAX_CACHE_RULES) {
+        fprintf(stderr, "Expected PREFIX=SECONDS after --cache-control\n");
+        exit_with_usage();
+      }
+      *equals = '\0';
+      cache_rules[num_cache_rules].prefix = rule;
+      cache_rules[num_cache_rules].prefix_length = strlen(rule);
+      cache_rules[num_cache_rules].max_age = atoi(equals + 1);
+      num_cache_rules++;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -582,6 +1602,26 @@ int main(int argc, char **argv) {
     exit_with_usage();
   }
 
+  /* --num-threads alone fixes the pool size; without it the pool may grow
+   * from one thread per CPU. */
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads < 1 && num_threads > 0) max_threads = num_threads;
+  if (num_threads < 1) num_threads = num_cpus > 0 ? num_cpus : 1;
+  if (min_threads < 1) min_threads = num_threads;
+  if (max_threads < 1) max_threads = POOL_DEFAULT_GROWTH * min_threads;
+  if (max_threads < min_threads) {
+    fprintf(stderr, "--max-threads must not be below --min-threads\n");
+    exit_with_usage();
+  }
+
+  if (access_log_path != NULL) {
+    if (accesslog_init(&access_log, access_log_path, access_log_format) < 0) {
+      perror(access_log_path);
+      exit(EXIT_FAILURE);
+    }
+    logging_access = 1;
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
@@ -1,70 +1,786 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "libhttp.h"
-
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#include "mime.h"
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+/* States of struct http_parser. */
+enum {
+  PARSE_START,          /* Skipping blank lines before the request line. */
+  PARSE_METHOD,
+  PARSE_PATH,
+  PARSE_VERSION,
+  PARSE_REQUEST_LINE_LF,
+  PARSE_HEADER_START,
+  PARSE_HEADER_NAME,
+  PARSE_HEADER_VALUE_START,
+  PARSE_HEADER_VALUE,
+  PARSE_HEADER_LF,
+  PARSE_HEAD_END_LF
+};
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
+void http_parser_init(struct http_parser *parser) {
+  parser->state = PARSE_START;
+  parser->offset = 0;
+  parser->num_headers = 0;
+  parser->version_start = parser->version_end = 0;
+}
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+/* Records the end of the header value that ends at the current byte. */
+static void http_parser_end_header(struct http_parser *parser) {
+  int i = parser->num_headers++;
+  parser->header_offsets[i].value = parser->mark;
+  parser->header_offsets[i].value_end = parser->value_end;
+}
 
-  char *read_start, *read_end;
-  size_t read_size;
+/* Fills in REQUEST from the offsets recorded while parsing the head at BASE,
+ * terminating every field in place. */
+static void http_parser_finish(struct http_parser *parser, char *base,
+    struct http_request *request) {
+  request->method = base + parser->method_start;
+  request->method_length = parser->method_end - parser->method_start;
+  request->path = base + parser->path_start;
+  request->path_length = parser->path_end - parser->path_start;
 
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+  request->http_minor = 0;
+  if (parser->version_end - parser->version_start == 8
+      && strncmp(base + parser->version_start, "HTTP/1.", 7) == 0
+      && base[parser->version_start + 7] >= '1'
+      && base[parser->version_start + 7] <= '9')
+    request->http_minor = 1;
+
+  request->num_headers = parser->num_headers;
+  for (int i = 0; i < parser->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    header->name = base + parser->header_offsets[i].name;
+    header->name_length = parser->header_offsets[i].name_end
+        - parser->header_offsets[i].name;
+    header->value = base + parser->header_offsets[i].value;
+    header->value_length = parser->header_offsets[i].value_end
+        - parser->header_offsets[i].value;
+  }
+
+  /* Every delimiter below has already been parsed, so overwrite them. */
+  request->method[request->method_length] = '\0';
+  request->path[request->path_length] = '\0';
+  for (int i = 0; i < request->num_headers; i++) {
+    request->headers[i].name[request->headers[i].name_length] = '\0';
+    request->headers[i].value[request->headers[i].value_length] = '\0';
+  }
+
+  request->keep_alive = request->http_minor >= 1;
+  request->has_body = 0;
+  for (int i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    if (strcasecmp(header->name, "Connection") == 0) {
+      if (strcasestr(header->value, "close") != NULL)
+        request->keep_alive = 0;
+      else if (strcasestr(header->value, "keep-alive") != NULL)
+        request->keep_alive = 1;
+    } else if (strcasecmp(header->name, "Content-Length") == 0) {
+      if (atol(header->value) != 0) request->has_body = 1;
+    } else if (strcasecmp(header->name, "Transfer-Encoding") == 0) {
+      request->has_body = 1;
+    }
+  }
+  /* Request bodies are not read, so they cannot be skipped over to find the
+   * next request. */
+  if (request->has_body) request->keep_alive = 0;
+  request->storage = NULL;
+}
+
+/*
+ * Continues parsing the request head that starts at BUFFER, of which LENGTH
+ * bytes have arrived so far. Returns the length of the head once it is
+ * complete (and fills in REQUEST), 0 if more bytes are needed, or -1 if the
+ * head is malformed.
+ */
+ssize_t http_parser_execute(struct http_parser *parser, char *buffer,
+    size_t length, struct http_request *request) {
+  size_t i;
+
+  for (i = parser->offset; i < length; i++) {
+    char c = buffer[i];
+
+    switch (parser->state) {
+      case PARSE_START:
+        if (c == '\r' || c == '\n') break;
+        parser->method_start = i;
+        parser->state = PARSE_METHOD;
+        /* Fall through. */
+      case PARSE_METHOD:
+        if (c >= 'A' && c <= 'Z') break;
+        if (c != ' ' || i == parser->method_start) return -1;
+        parser->method_end = i;
+        parser->path_start = i + 1;
+        parser->state = PARSE_PATH;
+        break;
+
+      case PARSE_PATH:
+        if (c == ' ' || c == '\r' || c == '\n') {
+          if (i == parser->path_start) return -1;
+          parser->path_end = i;
+          parser->version_start = parser->version_end = i;
+          if (c == ' ') {
+            parser->version_start = i + 1;
+            parser->state = PARSE_VERSION;
+          } else {
+            parser->state = c == '\r' ? PARSE_REQUEST_LINE_LF
+                : PARSE_HEADER_START;
+          }
+        } else if ((unsigned char) c < ' ') {
+          return -1;
+        }
+        break;
+
+      case PARSE_VERSION:
+        if (c == '\r' || c == '\n') {
+          parser->version_end = i;
+          parser->state = c == '\r' ? PARSE_REQUEST_LINE_LF
+              : PARSE_HEADER_START;
+        }
+        break;
+
+      case PARSE_REQUEST_LINE_LF:
+      case PARSE_HEADER_LF:
+        if (c != '\n') return -1;
+        parser->state = PARSE_HEADER_START;
+        break;
+
+      case PARSE_HEADER_START:
+        if (c == '\r') {
+          parser->state = PARSE_HEAD_END_LF;
+          break;
+        }
+        if (c == '\n') goto done;
+        if (c == ':' || c == ' ' || c == '\t') return -1;
+        if (parser->num_headers == LIBHTTP_MAX_HEADERS) return -1;
+        parser->header_offsets[parser->num_headers].name = i;
+        parser->state = PARSE_HEADER_NAME;
+        break;
+
+      case PARSE_HEADER_NAME:
+        if (c == ':') {
+          parser->header_offsets[parser->num_headers].name_end = i;
+          parser->state = PARSE_HEADER_VALUE_START;
+        } else if (c == '\r' || c == '\n') {
+          return -1;
+        }
+        break;
+
+      case PARSE_HEADER_VALUE_START:
+        if (c == ' ' || c == '\t') break;
+        parser->mark = parser->value_end = i;
+        parser->state = PARSE_HEADER_VALUE;
+        /* Fall through. */
+      case PARSE_HEADER_VALUE:
+        if (c == '\r' || c == '\n') {
+          http_parser_end_header(parser);
+          parser->state = c == '\r' ? PARSE_HEADER_LF : PARSE_HEADER_START;
+        } else if (c != ' ' && c != '\t') {
+          parser->value_end = i + 1;
+        }
+        break;
+
+      case PARSE_HEAD_END_LF:
+        if (c != '\n') return -1;
+        goto done;
+    }
+  }
+  parser->offset = i;
+  return 0;
+
+done:
+  http_parser_finish(parser, buffer, request);
+  return i + 1;
+}
+
+/*
+ * Reads one request from FD. The returned request owns the buffer it was
+ * parsed from; release both with http_request_free. Returns NULL if the
+ * connection closed or the request is malformed.
+ */
+struct http_request *http_request_parse(int fd) {
+  struct http_conn *conn = malloc(sizeof(struct http_conn));
+  if (!conn) http_fatal_error("Malloc failed");
+  struct http_request *request;
+
+  http_conn_init(conn, fd);
+  if (!http_conn_read_request(conn, &request, -1) || request == NULL) {
+    free(conn);
+    return NULL;
+  }
+  request->storage = conn;
+  return request;
+}
+
+void http_request_free(struct http_request *request) {
+  if (request == NULL) return;
+  free(request->storage);
+}
+
+/* Returns the value of the first header called NAME (case-insensitive), or
+ * NULL if the request does not have one. */
+char *http_request_header(struct http_request *request, char *name) {
+  for (int i = 0; i < request->num_headers; i++) {
+    if (strcasecmp(request->headers[i].name, name) == 0)
+      return request->headers[i].value;
+  }
   return NULL;
+}
+
+void http_conn_init(struct http_conn *conn, int fd) {
+  conn->fd = fd;
+  conn->start = 0;
+  conn->length = 0;
+  conn->requests = 0;
+  http_parser_init(&conn->parser);
+}
+
+/*
+ * Makes room for more input by moving the unparsed bytes to the front of the
+ * buffer. Invalidates the last request taken from CONN. Returns the number of
+ * bytes that can be read into conn->buffer + conn->length.
+ */
+size_t http_conn_reserve(struct http_conn *conn) {
+  if (conn->start > 0) {
+    conn->length -= conn->start;
+    memmove(conn->buffer, conn->buffer + conn->start, conn->length);
+    conn->start = 0;
+  }
+  return LIBHTTP_REQUEST_MAX_SIZE - conn->length;
+}
+
+/*
+ * Feeds the bytes buffered on CONN to its parser. Once a complete request
+ * head has been parsed, points *REQUEST at it (NULL if it is malformed) and
+ * returns 1. Bytes after the head stay buffered, which is how pipelined
+ * requests are read. Returns 0 if more bytes are needed. A head that does not
+ * fit in the buffer is returned as malformed.
+ */
+int http_conn_take_request(struct http_conn *conn,
+    struct http_request **request) {
+  ssize_t head_length = http_parser_execute(&conn->parser,
+      conn->buffer + conn->start, conn->length - conn->start, &conn->request);
+
+  if (head_length == 0) {
+    if (conn->length - conn->start < LIBHTTP_REQUEST_MAX_SIZE) return 0;
+    head_length = -1;
+  }
+  if (head_length < 0) {
+    *request = NULL;
+    conn->start = conn->length;
+  } else {
+    *request = &conn->request;
+    conn->start += head_length;
+  }
+  http_parser_init(&conn->parser);
+  conn->requests++;
+  return 1;
+}
+
+/*
+ * Reads the next request on CONN, waiting at most TIMEOUT_MS for more bytes
+ * whenever nothing complete is buffered (forever if TIMEOUT_MS is negative).
+ * Returns 1 with *REQUEST set (NULL if the request is malformed), or 0 if the
+ * peer closed the connection, went idle or an error occurred.
+ */
+int http_conn_read_request(struct http_conn *conn,
+    struct http_request **request, int timeout_ms) {
+  while (!http_conn_take_request(conn, request)) {
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready <= 0) return 0;
+
+    size_t space = http_conn_reserve(conn);
+    ssize_t n = read(conn->fd, conn->buffer + conn->length, space);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    conn->length += n;
+  }
+  return 1;
+}
+
+/* Decides whether CONN may stay open after answering REQUEST. */
+int http_conn_keep_alive(struct http_conn *conn, struct http_request *request,
+    int max_requests) {
+  return request != NULL && request->keep_alive
+      && conn->requests < max_requests;
+}
 
+/* Returns the number of bytes in the request head (request line + headers,
+ * including the blank line) if BUFFER holds a complete head, otherwise 0. */
+size_t http_request_head_length(char *buffer, size_t size) {
+  for (size_t i = 0; i + 1 < size; i++) {
+    if (buffer[i] != '\n') continue;
+    if (buffer[i + 1] == '\n') return i + 2;
+    if (buffer[i + 1] == '\r' && i + 2 < size && buffer[i + 2] == '\n')
+      return i + 3;
+  }
+  return 0;
+}
+
+static int http_is_hop_by_hop(char *name) {
+  return strcasecmp(name, "Connection") == 0
+      || strcasecmp(name, "Keep-Alive") == 0
+      || strcasecmp(name, "Proxy-Connection") == 0;
+}
+
+/* Writes REQUEST into BUFFER as a head to send to HOST with the given
+ * CONNECTION header. Returns the length of the head, or -1 if it does not
+ * fit. */
+int http_format_request_head(struct http_request *request, char *host,
+    char *connection, char *buffer, size_t size) {
+  size_t length = 0;
+  int n = snprintf(buffer, size, "%s %s HTTP/1.1\r\nHost: %s\r\n",
+      request->method, request->path, host);
+  if (n < 0 || (size_t) n >= size) return -1;
+  length = n;
+
+  for (int i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    if (strcasecmp(header->name, "Host") == 0
+        || http_is_hop_by_hop(header->name))
+      continue;
+    n = snprintf(buffer + length, size - length, "%s: %s\r\n", header->name,
+        header->value);
+    if (n < 0 || (size_t) n >= size - length) return -1;
+    length += n;
+  }
+
+  n = snprintf(buffer + length, size - length, "Connection: %s\r\n\r\n",
+      connection);
+  if (n < 0 || (size_t) n >= size - length) return -1;
+  return length + n;
+}
+
+/* Returns 1 if the comma-separated header value VALUE (LENGTH bytes)
+ * contains TOKEN. */
+static int http_value_has_token(char *value, size_t length, char *token) {
+  size_t token_length = strlen(token);
+  size_t i = 0;
+  while (i < length) {
+    while (i < length && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+      i++;
+    size_t start = i;
+    while (i < length && value[i] != ',') i++;
+    size_t end = i;
+    while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+      end--;
+    if (end - start == token_length
+        && strncasecmp(value + start, token, token_length) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Parses the status line and framing headers of the response head at the
+ * start of BUFFER into HEAD. Returns the length of the head, 0 if it is not
+ * complete yet, or -1 if it is malformed. BUFFER is not modified. */
+ssize_t http_parse_response_head(char *buffer, size_t length,
+    struct http_response_head *head) {
+  size_t head_length = http_request_head_length(buffer, length);
+  if (head_length == 0) return 0;
+
+  char *end = buffer + head_length;
+  char *line_end = memchr(buffer, '\n', head_length);
+  if (line_end - buffer < 12 || strncmp(buffer, "HTTP/1.", 7) != 0
+      || buffer[8] != ' ')
+    return -1;
+  head->http_minor = buffer[7] - '0';
+  head->status_code = 0;
+  for (int i = 9; i < 12; i++) {
+    if (buffer[i] < '0' || buffer[i] > '9') return -1;
+    head->status_code = head->status_code * 10 + buffer[i] - '0';
+  }
+  head->keep_alive = head->http_minor >= 1;
+  head->chunked = 0;
+  head->content_length = -1;
+
+  for (char *line = line_end + 1; line < end; line = line_end + 1) {
+    line_end = memchr(line, '\n', end - line);
+    char *colon = memchr(line, ':', line_end - line);
+    if (colon == NULL) continue;
+
+    size_t name_length = colon - line;
+    char *value = colon + 1;
+    while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+    size_t value_length = line_end - value;
+    if (value_length > 0 && value[value_length - 1] == '\r') value_length--;
+
+    if (name_length == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+      char *digits_end;
+      head->content_length = strtoll(value, &digits_end, 10);
+      if (digits_end == value || head->content_length < 0) return -1;
+    } else if (name_length == 17
+        && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+      head->chunked = http_value_has_token(value, value_length, "chunked");
+    } else if (name_length == 10 && strncasecmp(line, "Connection", 10) == 0) {
+      if (http_value_has_token(value, value_length, "close"))
+        head->keep_alive = 0;
+      else if (http_value_has_token(value, value_length, "keep-alive"))
+        head->keep_alive = 1;
+    }
+  }
+  return head_length;
+}
+
+enum {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER_START,
+  CHUNK_TRAILER_LINE,
+  CHUNK_TRAILER_END_LF,
+  CHUNK_DONE,
+};
+
+void http_chunked_init(struct http_chunked *chunked) {
+  chunked->state = CHUNK_SIZE;
+  chunked->remaining = 0;
+}
+
+/* Advances CHUNKED over the LENGTH bytes of body in BUFFER. Returns how many
+ * of them belong to the body (all of them, unless it ends inside BUFFER), or
+ * -1 if the framing is malformed. Sets *DONE once the body has ended. */
+ssize_t http_chunked_scan(struct http_chunked *chunked, char *buffer,
+    size_t length, int *done) {
+  size_t i = 0;
+
+  while (i < length && chunked->state != CHUNK_DONE) {
+    char c = buffer[i];
+
+    switch (chunked->state) {
+      case CHUNK_SIZE:
+        if (c == ';' || c == ' ' || c == '\t') {
+          chunked->state = CHUNK_EXTENSION;
+        } else if (c == '\r') {
+          chunked->state = CHUNK_SIZE_LF;
+        } else if (c == '\n') {
+          chunked->state = chunked->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+        } else {
+          int digit;
+          if (c >= '0' && c <= '9') digit = c - '0';
+          else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+          else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+          else return -1;
+          if (chunked->remaining >> 60) return -1;
+          chunked->remaining = chunked->remaining * 16 + digit;
+        }
+        i++;
+        break;
+
+      case CHUNK_EXTENSION:
+        if (c == '\r') chunked->state = CHUNK_SIZE_LF;
+        else if (c == '\n')
+          chunked->state = chunked->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+        i++;
+        break;
+
+      case CHUNK_SIZE_LF:
+        if (c != '\n') return -1;
+        chunked->state = chunked->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+        i++;
+        break;
+
+      case CHUNK_DATA: {
+        size_t n = length - i;
+        if (n > chunked->remaining) n = chunked->remaining;
+        chunked->remaining -= n;
+        i += n;
+        if (chunked->remaining == 0) chunked->state = CHUNK_DATA_CR;
+        break;
+      }
+
+      case CHUNK_DATA_CR:
+        if (c == '\r') chunked->state = CHUNK_DATA_LF;
+        else if (c == '\n') chunked->state = CHUNK_SIZE;
+        else return -1;
+        i++;
+        break;
+
+      case CHUNK_DATA_LF:
+        if (c != '\n') return -1;
+        chunked->state = CHUNK_SIZE;
+        i++;
+        break;
+
+      case CHUNK_TRAILER_START:
+        if (c == '\r') chunked->state = CHUNK_TRAILER_END_LF;
+        else if (c == '\n') chunked->state = CHUNK_DONE;
+        else chunked->state = CHUNK_TRAILER_LINE;
+        i++;
+        break;
+
+      case CHUNK_TRAILER_LINE:
+        if (c == '\n') chunked->state = CHUNK_TRAILER_START;
+        i++;
+        break;
+
+      case CHUNK_TRAILER_END_LF:
+        if (c != '\n') return -1;
+        chunked->state = CHUNK_DONE;
+        i++;
+        break;
+    }
+  }
+  *done = chunked->state == CHUNK_DONE;
+  return i;
+}
+
+/* Parses one "first-last", "first-" or "-suffix" spec of a Range header
+ * into RANGE. Returns 1 if it is satisfiable for SIZE bytes, 0 if not, and
+ * -1 if it is malformed. */
+static int http_parse_range_spec(char *spec, char *end, off_t size,
+    struct http_range *range) {
+  char *p = spec;
+  long long first = -1, last = -1;
+
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (first < 0) first = 0;
+    if (first > (LLONG_MAX - 9) / 10) return -1;
+    first = first * 10 + (*p++ - '0');
+  }
+  if (p == end || *p++ != '-') return -1;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (last < 0) last = 0;
+    if (last > (LLONG_MAX - 9) / 10) return -1;
+    last = last * 10 + (*p++ - '0');
+  }
+  if (p != end) return -1;
+
+  if (first < 0) {
+    /* Suffix range: the last LAST bytes. */
+    if (last < 0) return -1;
+    if (last == 0 || size == 0) return 0;
+    range->first = last >= size ? 0 : size - last;
+    range->last = size - 1;
+    return 1;
+  }
+  if (last >= 0 && last < first) return -1;
+  if (first >= size) return 0;
+  range->first = first;
+  range->last = last < 0 || last >= size ? size - 1 : last;
+  return 1;
+}
+
+/* Parses the Range header VALUE for a representation of SIZE bytes into at
+ * most MAX_RANGES RANGES. Returns the number of satisfiable ranges, 0 if none
+ * is satisfiable (answer 416), or -1 if the header should be ignored because
+ * it is malformed, not in bytes, or asks for too many ranges. */
+int http_parse_range(char *value, off_t size, struct http_range *ranges,
+    int max_ranges) {
+  int num_ranges = 0;
+
+  while (*value == ' ' || *value == '\t') value++;
+  if (strncasecmp(value, "bytes=", 6) != 0) return -1;
+  value += 6;
+
+  while (*value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    if (*value == '\0') break;
+    char *end = value;
+    while (*end != '\0' && *end != ',' && *end != ' ' && *end != '\t') end++;
+
+    if (num_ranges == max_ranges) return -1;
+    int status = http_parse_range_spec(value, end, size, &ranges[num_ranges]);
+    if (status < 0) return -1;
+    num_ranges += status;
+    value = end;
+  }
+  return num_ranges;
+}
+
+/* Narrows the complete body of RESPONSE, SIZE bytes long, to RANGES. A
+ * single range becomes a 206 with a Content-Range header; several become a
+ * multipart/byteranges body whose parts point into the original body, so no
+ * file data is read here. Returns -1 if memory runs out (RESPONSE is left
+ * unchanged). */
+int http_response_set_ranges(struct http_response *response,
+    struct http_range *ranges, int num_ranges, off_t size) {
+  if (num_ranges == 1) {
+    size_t length = ranges[0].last - ranges[0].first + 1;
+    if (response->file_fd >= 0) {
+      response->file_offset += ranges[0].first;
+      response->file_length = length;
+    } else {
+      response->body += ranges[0].first;
+      response->body_length = length;
+    }
+    response->status_code = 206;
+    http_response_add_header(response, "Content-Range", "bytes %lld-%lld/%lld",
+        (long long) ranges[0].first, (long long) ranges[0].last,
+        (long long) size);
+    return 0;
+  }
+
+  /* Part headers are stored after the segment array, in the same block. */
+  size_t part_head_size = 160 + strlen(response->content_type);
+  int num_segments = 2 * num_ranges + 1;
+  size_t segments_size = num_segments * sizeof(struct http_segment)
+      + num_ranges * part_head_size + sizeof(LIBHTTP_BYTERANGES_BOUNDARY) + 8;
+  struct http_segment *segments = response->arena
+      ? arena_alloc(response->arena, segments_size) : malloc(segments_size);
+  if (segments == NULL) return -1;
+  char *text = (char *) (segments + num_segments);
+
+  for (int i = 0; i < num_ranges; i++) {
+    struct http_segment *part_head = &segments[2 * i];
+    struct http_segment *part = &segments[2 * i + 1];
+    part_head->data = text;
+    part_head->length = snprintf(text, part_head_size,
+        "\r\n--" LIBHTTP_BYTERANGES_BOUNDARY "\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        response->content_type, (long long) ranges[i].first,
+        (long long) ranges[i].last, (long long) size);
+    text += part_head->length;
+
+    part->length = ranges[i].last - ranges[i].first + 1;
+    if (response->file_fd >= 0) {
+      part->data = NULL;
+      part->offset = response->file_offset + ranges[i].first;
+    } else {
+      part->data = response->body + ranges[i].first;
+    }
+  }
+  segments[num_segments - 1].data = text;
+  segments[num_segments - 1].length = sprintf(text,
+      "\r\n--" LIBHTTP_BYTERANGES_BOUNDARY "--\r\n");
+
+  response->segments = segments;
+  response->num_segments = num_segments;
+  response->status_code = 206;
+  response->content_type = "multipart/byteranges; boundary="
+      LIBHTTP_BYTERANGES_BOUNDARY;
+  return 0;
+}
+
+/* Writes TIME into BUFFER (LIBHTTP_DATE_SIZE bytes) as an HTTP date. The
+ * server never calls setlocale, so day and month names are in English. */
+void http_format_date(time_t time, char *buffer) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(buffer, LIBHTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Parses VALUE, in any of the three date formats HTTP/1.1 allows. */
+time_t http_parse_date(char *value) {
+  static const char *formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",    /* IMF-fixdate */
+    "%A, %d-%b-%y %H:%M:%S GMT",    /* RFC 850 */
+    "%a %b %e %H:%M:%S %Y",         /* asctime */
+  };
+  struct tm tm;
+
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(value, formats[i], &tm);
+    if (end != NULL && *end == '\0') return timegm(&tm);
+  }
+  return -1;
+}
+
+/* Returns 1 if the comma-separated entity tag LIST contains ETAG or is "*".
+ * With WEAK set, tags compare equal regardless of a W/ prefix; otherwise
+ * weak tags never match. */
+int http_etag_matches(char *list, char *etag, int weak) {
+  size_t etag_length = strlen(etag);
+
+  while (*list != '\0') {
+    while (*list == ' ' || *list == '\t' || *list == ',') list++;
+    if (*list == '\0') break;
+    if (*list == '*') return 1;
+
+    int is_weak = strncmp(list, "W/", 2) == 0;
+    if (is_weak) list += 2;
+    char *end = list;
+    if (*end == '"') {
+      end = strchr(end + 1, '"');
+      if (end == NULL) return 0;
+      end++;
+    } else {
+      while (*end != '\0' && *end != ',') end++;
+    }
+    if ((weak || !is_weak) && (size_t) (end - list) == etag_length
+        && strncmp(list, etag, etag_length) == 0)
+      return 1;
+    list = end;
+  }
+  return 0;
+}
+
+/* Returns 1 if the Accept-Encoding list VALUE gives CODING (or, if CODING is
+ * not listed, "*") a non-zero quality. */
+int http_accepts_encoding(char *value, char *coding) {
+  size_t coding_length = strlen(coding);
+  int star = 0;
+
+  while (*value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    if (*value == '\0') break;
+    char *name = value;
+    while (*value != '\0' && *value != ',' && *value != ';' && *value != ' '
+        && *value != '\t')
+      value++;
+    size_t name_length = value - name;
+
+    double quality = 1;
+    while (*value != '\0' && *value != ',') {
+      if (*value == ';') {
+        char *parameter = value + 1;
+        while (*parameter == ' ' || *parameter == '\t') parameter++;
+        if (strncasecmp(parameter, "q=", 2) == 0)
+          quality = strtod(parameter + 2, NULL);
+      }
+      value++;
+    }
+
+    if (name_length == coding_length
+        && strncasecmp(name, coding, coding_length) == 0)
+      return quality > 0;
+    if (name_length == 1 && name[0] == '*') star = quality > 0;
+  }
+  return star;
+}
+
+int http_query_long(char *query, char *name, long long *value) {
+  size_t name_length = strlen(name);
+  while (query != NULL && *query != '\0') {
+    if (strncmp(query, name, name_length) == 0 && query[name_length] == '=') {
+      char *end;
+      char *digits = query + name_length + 1;
+      long long parsed = strtoll(digits, &end, 10);
+      if (end == digits || (*end != '\0' && *end != '&')) return 0;
+      *value = parsed;
+      return 1;
+    }
+    query = strchr(query, '&');
+    if (query != NULL) query++;
+  }
+  return 0;
 }
 
 char* http_get_response_message(int status_code) {
@@ -73,6 +789,8 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,22 +807,315 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
     default:
       return "Internal Server Error";
   }
 }
 
+/*
+ * The streaming functions below collect the status line and headers in the
+ * calling thread's builder and write them with a single send once the
+ * headers end, instead of one syscall (and possibly one packet) per line.
+ */
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  struct http_builder *builder = http_builder_local();
+  http_builder_reset(builder);
+  http_builder_status(builder, status_code);
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  http_builder_header(http_builder_local(), key, value);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  struct http_builder *builder = http_builder_local();
+  http_builder_end(builder);
+  /* The body usually follows right away; let it share the packet. */
+  http_send_more(fd, builder->data, builder->length, 1);
+  http_builder_reset(builder);
+}
+
+void http_response_init(struct http_response *response) {
+  memset(response, 0, sizeof(*response));
+  response->file_fd = -1;
+  response->pipe[0] = response->pipe[1] = -1;
+}
+
+size_t http_response_content_length(struct http_response *response) {
+  if (response->segments != NULL) {
+    size_t length = 0;
+    for (int i = 0; i < response->num_segments; i++)
+      length += response->segments[i].length;
+    return length;
+  }
+  if (response->file_fd >= 0) return response->file_length;
+  return response->body_length;
+}
+
+/* Adds a "KEY: VALUE" line (VALUE formatted printf-style) to the headers
+ * sent with RESPONSE, beyond the ones every response gets. Headers that do
+ * not fit are dropped. */
+void http_response_add_header(struct http_response *response, char *key,
+    char *format, ...) {
+  size_t space = sizeof(response->headers) - response->headers_length;
+  int len = snprintf(response->headers + response->headers_length, space,
+      "%s: ", key);
+  if (len < 0 || (size_t) len >= space) goto overflow;
+
+  va_list args;
+  va_start(args, format);
+  int value_len = vsnprintf(response->headers + response->headers_length + len,
+      space - len, format, args);
+  va_end(args);
+  if (value_len < 0 || (size_t) (len + value_len + 2) >= space) goto overflow;
+
+  len += value_len;
+  memcpy(response->headers + response->headers_length + len, "\r\n", 3);
+  response->headers_length += len + 2;
+  return;
+
+overflow:
+  response->headers[response->headers_length] = '\0';
+}
+
+/* Formats the status line and headers of RESPONSE into BUILDER. Returns the
+ * length of the head, or -1 if it does not fit. */
+int http_format_response_head(struct http_response *response,
+    struct http_builder *builder) {
+  http_builder_reset(builder);
+  http_builder_status(builder, response->status_code);
+  http_builder_header(builder, "Content-Type",
+      response->content_type ? response->content_type : "text/plain");
+  /* A 304 has no body, and a Content-Length would describe the full
+   * representation the client already holds, so it is left out. */
+  if (response->status_code != 304)
+    http_builder_headerf(builder, "Content-Length", "%zu",
+        http_response_content_length(response));
+  http_builder_header(builder, "Connection",
+      response->keep_alive ? "keep-alive" : "close");
+  http_builder_append(builder, response->headers, response->headers_length);
+  http_builder_end(builder);
+  return builder->overflow ? -1 : (int) builder->length;
+}
+
+static ssize_t http_flush_pipe(int fd, struct http_response *response);
+
+/* Sends the body of RESPONSE from byte POSITION on, as much as FD accepts
+ * in one go; bytes left in RESPONSE's pipe by an earlier call go first.
+ * Returns the number of bytes sent or -1 (with errno set), like send; 0
+ * means the file behind the body has shrunk. */
+ssize_t http_send_body(int fd, struct http_response *response,
+    size_t position) {
+  struct http_segment whole, *segment = &whole;
+  int more = 0;
+
+  if (response->piped > 0) return http_flush_pipe(fd, response);
+  if (response->segments != NULL) {
+    int i = 0;
+    while (i < response->num_segments
+        && position >= response->segments[i].length) {
+      position -= response->segments[i].length;
+      i++;
+    }
+    if (i == response->num_segments) return 0;
+    segment = &response->segments[i];
+    more = i + 1 < response->num_segments;
+  } else if (response->file_fd >= 0) {
+    whole.data = NULL;
+    whole.offset = response->file_offset;
+    whole.length = response->file_length;
+  } else {
+    whole.data = response->body;
+    whole.length = response->body_length;
+  }
+
+  if (segment->data == NULL) {
+    off_t offset = segment->offset + position;
+    ssize_t n = http_send_file_data(fd, response, &offset,
+        segment->length - position);
+    return n;
+  }
+  ssize_t n;
+  do {
+    n = send(fd, segment->data + position, segment->length - position,
+        MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+/* Writes RESPONSE to the (blocking) socket FD. A body held in memory as one
+ * piece goes out in the same writev as the head; anything else follows a
+ * head sent with MSG_MORE (a one-shot TCP_CORK), so the head shares a packet
+ * with the start of the body, and file data is sent with sendfile. */
+void http_send_response(int fd, struct http_response *response) {
+  struct http_builder *builder = http_builder_local();
+  int len = http_format_response_head(response, builder);
+  size_t length = http_response_content_length(response);
+  if (len < 0) return;
+
+  if (response->file_fd < 0 && response->segments == NULL) {
+    struct iovec iov[2] = {
+      { .iov_base = builder->data, .iov_len = len },
+      { .iov_base = response->body, .iov_len = response->body_length },
+    };
+    http_writev_all(fd, iov, response->body_length > 0 ? 2 : 1);
+    return;
+  }
+
+  if (http_send_more(fd, builder->data, len, length > 0) < 0) return;
+  size_t position = 0;
+  while (position < length) {
+    ssize_t n = http_send_body(fd, response, position);
+    if (n <= 0) return;
+    position += n;
+  }
+}
+
+/* Releases the body of RESPONSE if the response owns it and forgets its extra
+ * headers, so RESPONSE can be reused for the next request. */
+void http_response_release(struct http_response *response) {
+  http_response_release_body(response);
+  response->headers_length = 0;
+}
+
+/* Drops RESPONSE's body, keeping its status and headers. */
+void http_response_release_body(struct http_response *response) {
+  if (response->body_owned) free(response->body);
+  if (response->body_unref) response->body_unref(response->body_ref);
+  if (response->file_fd >= 0) close(response->file_fd);
+  response->body = NULL;
+  response->body_length = 0;
+  response->body_owned = 0;
+  response->body_unref = NULL;
+  response->body_ref = NULL;
+  response->file_fd = -1;
+  response->file_length = 0;
+  if (response->arena == NULL) free(response->segments);
+  response->segments = NULL;
+  response->num_segments = 0;
+  if (response->pipe[0] >= 0) {
+    close(response->pipe[0]);
+    close(response->pipe[1]);
+  }
+  response->pipe[0] = response->pipe[1] = -1;
+  response->piped = 0;
+}
+
+/*
+ * Response head builder. Lines are appended into a fixed buffer; if the head
+ * outgrows it the builder is marked as overflowed and further lines are
+ * ignored.
+ */
+void http_builder_reset(struct http_builder *builder) {
+  builder->length = 0;
+  builder->overflow = 0;
+  builder->data[0] = '\0';
+}
+
+void http_builder_append(struct http_builder *builder, char *data,
+    size_t size) {
+  if (builder->overflow || builder->length + size >= sizeof(builder->data)) {
+    builder->overflow = 1;
+    return;
+  }
+  memcpy(builder->data + builder->length, data, size);
+  builder->length += size;
+  builder->data[builder->length] = '\0';
+}
+
+static void http_builder_vprintf(struct http_builder *builder, char *format,
+    va_list args) {
+  if (builder->overflow) return;
+  size_t space = sizeof(builder->data) - builder->length;
+  int len = vsnprintf(builder->data + builder->length, space, format, args);
+  if (len < 0 || (size_t) len >= space) {
+    builder->overflow = 1;
+    builder->data[builder->length] = '\0';
+    return;
+  }
+  builder->length += len;
+}
+
+static void http_builder_printf(struct http_builder *builder, char *format,
+    ...) {
+  va_list args;
+  va_start(args, format);
+  http_builder_vprintf(builder, format, args);
+  va_end(args);
+}
+
+void http_builder_status(struct http_builder *builder, int status_code) {
+  http_builder_printf(builder, "HTTP/1.1 %d %s\r\n", status_code,
+      http_get_response_message(status_code));
+}
+
+void http_builder_header(struct http_builder *builder, char *key,
+    char *value) {
+  http_builder_printf(builder, "%s: %s\r\n", key, value);
+}
+
+void http_builder_headerf(struct http_builder *builder, char *key,
+    char *format, ...) {
+  va_list args;
+  http_builder_printf(builder, "%s: ", key);
+  va_start(args, format);
+  http_builder_vprintf(builder, format, args);
+  va_end(args);
+  http_builder_append(builder, "\r\n", 2);
+}
+
+void http_builder_end(struct http_builder *builder) {
+  http_builder_append(builder, "\r\n", 2);
+}
+
+/* Returns the calling thread's builder, reused for every response the thread
+ * writes with the blocking functions. */
+struct http_builder *http_builder_local(void) {
+  static __thread struct http_builder builder;
+  return &builder;
+}
+
+/* Writes all of IOV to FD, resuming after short writes. */
+void http_writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/* Sends DATA to FD, telling the kernel more data follows when MORE is set so
+ * it holds back a partial packet. Falls back to write for non-sockets.
+ * Returns -1 on error. */
+int http_send_more(int fd, char *data, size_t size, int more) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (n < 0 && errno == ENOTSOCK) n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    size -= n;
+    data += n;
+  }
+  return 0;
 }
 
 void http_send_string(int fd, char *data) {
@@ -122,25 +1133,103 @@ void http_send_data(int fd, char *data, size_t size) {
   }
 }
 
-char *http_get_mime_type(char *file_name) {
-  char *file_extension = strrchr(file_name, '.');
-  if (file_extension == NULL) {
-    return "text/plain";
-  }
-
-  if (strcmp(file_extension, ".html") == 0 || strcmp(file_extension, ".htm") == 0) {
-    return "text/html";
-  } else if (strcmp(file_extension, ".jpg") == 0 || strcmp(file_extension, ".jpeg") == 0) {
-    return "image/jpeg";
-  } else if (strcmp(file_extension, ".png") == 0) {
-    return "image/png";
-  } else if (strcmp(file_extension, ".css") == 0) {
-    return "text/css";
-  } else if (strcmp(file_extension, ".js") == 0) {
-    return "application/javascript";
-  } else if (strcmp(file_extension, ".pdf") == 0) {
-    return "application/pdf";
+/* The calling thread's pipe for http_splice_file_data. */
+static __thread int splice_pipe[2] = {-1, -1};
+
+/* Closes the calling thread's splice pipe, before the thread exits. */
+void http_thread_exit(void) {
+  if (splice_pipe[0] < 0) return;
+  close(splice_pipe[0]);
+  close(splice_pipe[1]);
+  splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+/* Sends what RESPONSE's pipe still holds to FD. Once the pipe is empty it
+ * goes back to the calling thread, or is closed if the thread has one. */
+static ssize_t http_flush_pipe(int fd, struct http_response *response) {
+  ssize_t n;
+  do {
+    n = splice(response->pipe[0], NULL, fd, NULL, response->piped,
+        SPLICE_F_MOVE | SPLICE_F_MORE);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) return n;
+
+  response->piped -= n;
+  if (response->piped == 0) {
+    if (splice_pipe[0] < 0) {
+      splice_pipe[0] = response->pipe[0];
+      splice_pipe[1] = response->pipe[1];
+    } else {
+      close(response->pipe[0]);
+      close(response->pipe[1]);
+    }
+    response->pipe[0] = response->pipe[1] = -1;
+  }
+  return n;
+}
+
+/*
+ * Splices up to COUNT bytes of RESPONSE's file at *OFFSET to FD through a
+ * pipe. This is the fallback for files sendfile refuses (e.g. on filesystems
+ * without page cache support); the data never enters userspace. Each thread
+ * keeps a pipe, empty between calls. If a non-blocking FD fills up, the pipe
+ * stays with RESPONSE, still holding what did not fit, and http_send_body
+ * sends that first when FD is writable again. Returns the bytes sent like
+ * sendfile does (-1 with EAGAIN if none fit).
+ */
+static ssize_t http_splice_file_data(int fd, struct http_response *response,
+    off_t *offset, size_t count) {
+  if (splice_pipe[0] < 0 && pipe2(splice_pipe, O_CLOEXEC) < 0) return -1;
+
+  ssize_t in = splice(response->file_fd, offset, splice_pipe[1], NULL, count,
+      SPLICE_F_MOVE);
+  if (in <= 0) return in;
+
+  ssize_t left = in;
+  while (left > 0) {
+    ssize_t out = splice(splice_pipe[0], NULL, fd, NULL, left,
+        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (out < 0 && errno == EINTR) continue;
+    if (out < 0) break;
+    left -= out;
+  }
+  if (left == 0) return in;
+
+  int error = errno;
+  if (error == EAGAIN) {
+    response->pipe[0] = splice_pipe[0];
+    response->pipe[1] = splice_pipe[1];
+    response->piped = left;
   } else {
-    return "text/plain";
+    /* The connection is lost, and with it what the pipe holds. */
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+  }
+  splice_pipe[0] = splice_pipe[1] = -1;
+  if (left == in) {
+    errno = error;
+    return -1;
   }
+  return in - left;
+}
+
+/*
+ * Sends up to COUNT bytes of RESPONSE's file starting at *OFFSET to the
+ * socket FD without copying them through userspace, and advances *OFFSET.
+ * Returns the number of bytes sent, 0 at end of file, or -1 with errno set
+ * (EAGAIN if a non-blocking FD is full).
+ */
+ssize_t http_send_file_data(int fd, struct http_response *response,
+    off_t *offset, size_t count) {
+  ssize_t n;
+  do {
+    n = sendfile(fd, response->file_fd, offset, count);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+    return http_splice_file_data(fd, response, offset, count);
+  return n;
+}
+
+char *http_get_mime_type(char *file_name) {
+  return (char *) mime_type_for(file_name);
 }
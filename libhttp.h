@@ -20,15 +20,148 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <sys/types.h>
+#include <time.h>
+
 /*
  * Functions for parsing an HTTP request.
+ *
+ * Parsed requests do not own any memory of their own: method, path and the
+ * header names and values point into the buffer the head was read into
+ * (their delimiters are overwritten with '\0', so they can also be used as
+ * C strings). They stay valid until the next request is read from the same
+ * connection.
  */
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_MAX_HEADERS 64
+
+struct http_header {
+  char *name;
+  size_t name_length;
+  char *value;
+  size_t value_length;
+};
+
 struct http_request {
   char *method;
+  size_t method_length;
   char *path;
+  size_t path_length;
+  int http_minor;     /* 1 for HTTP/1.1, 0 for HTTP/1.0 and older. */
+  int keep_alive;     /* Does the client allow the connection to be reused? */
+  int has_body;
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
+  int num_headers;
+  void *storage;      /* Freed by http_request_free, if set. */
+};
+
+/*
+ * An incremental request parser. It can be fed a head in as many pieces as it
+ * arrives in and only looks at each byte once; everything it records is an
+ * offset from the start of the head, so the caller may move the head around
+ * in memory between calls. Blank lines before the request line are skipped.
+ */
+struct http_parser {
+  int state;
+  size_t offset;      /* Next byte to look at. */
+  size_t mark;        /* Start of the token being read. */
+  size_t method_start, method_end;
+  size_t path_start, path_end;
+  size_t version_start, version_end;
+  size_t value_end;   /* End of the header value, less trailing spaces. */
+  int num_headers;
+  struct {
+    size_t name, name_end, value, value_end;
+  } header_offsets[LIBHTTP_MAX_HEADERS];
+};
+
+/*
+ * A connection that may carry several (possibly pipelined) requests. Bytes
+ * read past the end of one request head stay in the buffer for the next.
+ */
+struct http_conn {
+  int fd;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE + 1];
+  size_t start;       /* Start of the head being parsed. */
+  size_t length;
+  int requests;       /* Requests taken from this connection so far. */
+  struct http_parser parser;
+  struct http_request request;
 };
 
 struct http_request *http_request_parse(int fd);
+void http_request_free(struct http_request *request);
+char *http_request_header(struct http_request *request, char *name);
+size_t http_request_head_length(char *buffer, size_t size);
+
+void http_parser_init(struct http_parser *parser);
+ssize_t http_parser_execute(struct http_parser *parser, char *buffer,
+    size_t length, struct http_request *request);
+
+void http_conn_init(struct http_conn *conn, int fd);
+size_t http_conn_reserve(struct http_conn *conn);
+int http_conn_take_request(struct http_conn *conn,
+    struct http_request **request);
+int http_conn_read_request(struct http_conn *conn,
+    struct http_request **request, int timeout_ms);
+int http_conn_keep_alive(struct http_conn *conn, struct http_request *request,
+    int max_requests);
+
+/*
+ * Functions for relaying requests to an upstream server.
+ *
+ * http_format_request_head rewrites a parsed request for an upstream
+ * connection: the Host header names the upstream and the client's hop-by-hop
+ * headers are replaced by a Connection header with the given value.
+ *
+ * http_parse_response_head reads the framing of an upstream response head:
+ * where the head ends and how the end of the body will be recognized.
+ *
+ * http_chunked_scan follows a chunked body through the bytes it is fed,
+ * without changing them, and reports where the body ends.
+ */
+struct http_response_head {
+  int status_code;
+  int http_minor;
+  int keep_alive;     /* May the upstream connection be reused? */
+  int chunked;
+  long long content_length;   /* -1 if the response has none. */
+};
+
+struct http_chunked {
+  int state;
+  unsigned long long remaining;   /* Bytes left in the current chunk. */
+};
+
+int http_format_request_head(struct http_request *request, char *host,
+    char *connection, char *buffer, size_t size);
+ssize_t http_parse_response_head(char *buffer, size_t length,
+    struct http_response_head *head);
+void http_chunked_init(struct http_chunked *chunked);
+ssize_t http_chunked_scan(struct http_chunked *chunked, char *buffer,
+    size_t length, int *done);
+
+/*
+ * Builds a response head (status line and headers) in memory so it can be
+ * written with one syscall.
+ */
+#define LIBHTTP_RESPONSE_HEAD_MAX_SIZE 1024
+
+struct http_builder {
+  char data[LIBHTTP_RESPONSE_HEAD_MAX_SIZE];
+  size_t length;
+  int overflow;       /* Did the head outgrow data? */
+};
+
+void http_builder_reset(struct http_builder *builder);
+void http_builder_append(struct http_builder *builder, char *data,
+    size_t size);
+void http_builder_status(struct http_builder *builder, int status_code);
+void http_builder_header(struct http_builder *builder, char *key, char *value);
+void http_builder_headerf(struct http_builder *builder, char *key,
+    char *format, ...) __attribute__((format(printf, 3, 4)));
+void http_builder_end(struct http_builder *builder);
+struct http_builder *http_builder_local(void);
 
 /*
  * Functions for sending an HTTP response.
@@ -39,6 +172,114 @@ void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
 
+struct http_response;
+ssize_t http_send_file_data(int fd, struct http_response *response,
+    off_t *offset, size_t count);
+int http_send_more(int fd, char *data, size_t size, int more);
+struct iovec;
+void http_writev_all(int fd, struct iovec *iov, int iovcnt);
+void http_thread_exit(void);
+
+/*
+ * A response that has been prepared but not yet written to a socket. This
+ * lets the blocking handlers and the event loop share the code that decides
+ * what to send.
+ *
+ * The body is either held in memory (body) or sent straight from an open
+ * file (file_fd) with sendfile, so file contents never pass through the heap.
+ * A body made of several pieces (a multipart/byteranges response) lists them
+ * in segments; each is either in memory or a range of file_fd.
+ */
+#define LIBHTTP_RESPONSE_HEADERS_MAX_SIZE 512
+#define LIBHTTP_MAX_RANGES 16
+#define LIBHTTP_BYTERANGES_BOUNDARY "LIBHTTP_BYTERANGES_4f9a2c71e8d3b605"
+
+struct http_segment {
+  char *data;         /* NULL to send from the response's file_fd. */
+  off_t offset;       /* Where the bytes start in file_fd, if data is NULL. */
+  size_t length;
+};
+
+struct http_range {
+  off_t first;
+  off_t last;         /* Inclusive. */
+};
+
+struct http_response {
+  int status_code;
+  int keep_alive;     /* Leave the connection open after this response? */
+  char *content_type;
+  char *body;
+  size_t body_length;
+  int body_owned;     /* Free body in http_response_release? */
+  void (*body_unref)(void *);   /* Called on body_ref when released. */
+  void *body_ref;
+  int file_fd;        /* -1 if the body is not a file. */
+  off_t file_offset;
+  size_t file_length;
+  struct http_segment *segments;    /* Freed on release; NULL if unused. */
+  int num_segments;
+  int pipe[2];        /* Body bytes spliced but not yet sent; or -1. */
+  size_t piped;       /* How many; they go out before the rest of the body. */
+  struct arena *arena;    /* Request-scoped memory, or NULL to use malloc. */
+  /* Extra header lines, added with http_response_add_header. */
+  char headers[LIBHTTP_RESPONSE_HEADERS_MAX_SIZE];
+  size_t headers_length;
+};
+
+void http_response_init(struct http_response *response);
+size_t http_response_content_length(struct http_response *response);
+void http_response_add_header(struct http_response *response, char *key,
+    char *format, ...) __attribute__((format(printf, 3, 4)));
+int http_format_response_head(struct http_response *response,
+    struct http_builder *builder);
+ssize_t http_send_body(int fd, struct http_response *response,
+    size_t position);
+void http_send_response(int fd, struct http_response *response);
+void http_response_release(struct http_response *response);
+void http_response_release_body(struct http_response *response);
+
+/*
+ * Byte ranges. http_parse_range reads a Range header for a representation of
+ * SIZE bytes; http_response_set_ranges turns a complete 200 response into the
+ * matching 206 (one range) or multipart/byteranges (several).
+ */
+int http_parse_range(char *value, off_t size, struct http_range *ranges,
+    int max_ranges);
+int http_response_set_ranges(struct http_response *response,
+    struct http_range *ranges, int num_ranges, off_t size);
+
+/*
+ * Conditional requests. http_etag_matches checks an If-None-Match or If-Match
+ * style list (or "*") against ETAG; with WEAK set, W/ prefixes are ignored.
+ */
+int http_etag_matches(char *list, char *etag, int weak);
+
+/*
+ * Content negotiation: does the Accept-Encoding header VALUE allow CODING?
+ */
+int http_accepts_encoding(char *value, char *coding);
+
+/*
+ * Query strings: finds parameter NAME in QUERY (the part of a path after
+ * '?') and reads its value as an integer. Returns 0 if it is absent or not a
+ * number.
+ */
+int http_query_long(char *query, char *name, long long *value);
+
+/*
+ * Helper functions: format TIME as an HTTP date (IMF-fixdate) and parse one
+ * back (-1 if it is not a valid date).
+ */
+#define LIBHTTP_DATE_SIZE 30
+void http_format_date(time_t time, char *buffer);
+time_t http_parse_date(char *value);
+
+/*
+ * Helper function: gets the reason phrase for a status code.
+ */
+char *http_get_response_message(int status_code);
+
 /*
  * Helper function: gets the Content-Type based on a file name.
  */
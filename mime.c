@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+
+#ifndef MIME_GEN
+#include "mime_table.h"
+
+/* The table in use: the generated one, or the one mime_load built. */
+static const mime_table_t *mime_active = &mime_builtin;
+#endif
+
+static inline char mime_lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* Lower-cases the ASCII letters among the eight bytes of WORD at once. */
+static inline uint64_t mime_lower_word(uint64_t word) {
+  uint64_t low = word & 0x7f7f7f7f7f7f7f7full;
+  uint64_t above_z = low + 0x2525252525252525ull;   // 0x80 - 'Z' - 1
+  uint64_t from_a = low + 0x3f3f3f3f3f3f3f3full;    // 0x80 - 'A'
+  uint64_t upper = (from_a ^ above_z) & ~word & 0x8080808080808080ull;
+  return word | (upper >> 2);
+}
+
+/* Where byte I of a word goes, so keys compare equal to their bytes in
+ * memory (the table's extension arrays). */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MIME_BYTE_SHIFT(i) ((7 - (i)) * 8)
+#else
+#define MIME_BYTE_SHIFT(i) ((i) * 8)
+#endif
+
+/* Loads the LENGTH-byte EXTENSION (at most MIME_MAX_EXTENSION) into KEY,
+ * lower-cased and zero padded. */
+static inline void mime_key(const char *extension, size_t length,
+    uint64_t key[2]) {
+  /* Assembled in registers: a memcpy to the stack read back as words would
+   * stall on store forwarding. */
+  uint64_t low = 0, high = 0;
+  size_t i;
+  for (i = 0; i < length && i < 8; i++)
+    low |= (uint64_t) (unsigned char) extension[i] << MIME_BYTE_SHIFT(i);
+  for (; i < length; i++)
+    high |= (uint64_t) (unsigned char) extension[i] << MIME_BYTE_SHIFT(i - 8);
+  key[0] = mime_lower_word(low);
+  key[1] = mime_lower_word(high);
+}
+
+/* Hashes a key; the top bits pick the bucket and the rest the slot. */
+static inline uint64_t mime_hash(const uint64_t key[2]) {
+  uint64_t hash = key[0] * 0x9e3779b97f4a7c15ull
+      ^ key[1] * 0xc2b2ae3d27d4eb4full;
+  hash ^= hash >> 29;
+  return hash * 0xbf58476d1ce4e5b9ull;
+}
+
+static inline unsigned int mime_bucket(uint64_t hash, unsigned int mask) {
+  return (unsigned int) (hash >> 40) & mask;
+}
+
+/* Returns the slot of a key with hash HASH in a bucket with displacement
+ * DISPLACEMENT. */
+static inline unsigned int mime_slot(uint64_t hash, unsigned int displacement,
+    unsigned int slot_mask) {
+  uint32_t mixed = (uint32_t) hash + displacement * ((uint32_t) (hash >> 32) | 1);
+  return (mixed ^ (mixed >> 15)) & slot_mask;
+}
+
+/* Returns the type for the LENGTH-byte EXTENSION (without the dot) in
+ * TABLE, or NULL if it is not there. */
+const char *mime_lookup_table(const mime_table_t *table, const char *extension,
+    size_t length) {
+  uint64_t key[2];
+  if (length == 0 || length > MIME_MAX_EXTENSION) return NULL;
+  mime_key(extension, length, key);
+  uint64_t hash = mime_hash(key);
+  unsigned int displacement =
+      table->displacements[mime_bucket(hash, table->bucket_mask)];
+  const mime_entry_t *entry =
+      &table->slots[mime_slot(hash, displacement, table->slot_mask)];
+  if (memcmp(entry->extension, key, MIME_MAX_EXTENSION) != 0) return NULL;
+  return entry->type;
+}
+
+static unsigned int mime_power_of_two(unsigned int n) {
+  unsigned int power = 1;
+  while (power < n) power *= 2;
+  return power;
+}
+
+/* Orders buckets by size, largest first; see mime_build. */
+static int *mime_bucket_sizes;
+static int mime_compare_buckets(const void *a, const void *b) {
+  return mime_bucket_sizes[*(int *) b] - mime_bucket_sizes[*(int *) a];
+}
+
+/* Tries to place ENTRIES into TABLE, whose masks are set. Returns 0 on
+ * success and -1 if some bucket has no usable displacement. */
+static int mime_place(mime_entry_t *entries, int num_entries,
+    mime_table_t *table, uint16_t *displacements, mime_entry_t *slots) {
+  int num_buckets = table->bucket_mask + 1;
+  int *sizes = calloc(num_buckets, sizeof(int));
+  int *order = malloc(num_buckets * sizeof(int));
+  int *members = malloc(num_entries * sizeof(int));
+  unsigned int *placed = malloc(num_entries * sizeof(unsigned int));
+  uint64_t *hashes = malloc(num_entries * sizeof(uint64_t));
+  int result = -1;
+
+  if (!sizes || !order || !members || !placed || !hashes) goto done;
+  for (int i = 0; i < num_entries; i++) {
+    uint64_t key[2];
+    memcpy(key, entries[i].extension, MIME_MAX_EXTENSION);
+    hashes[i] = mime_hash(key);
+    sizes[mime_bucket(hashes[i], table->bucket_mask)]++;
+  }
+  for (int b = 0; b < num_buckets; b++) order[b] = b;
+  mime_bucket_sizes = sizes;
+  qsort(order, num_buckets, sizeof(int), mime_compare_buckets);
+
+  /* Big buckets are placed first, while the table is still empty. */
+  for (int o = 0; o < num_buckets && sizes[order[o]] > 0; o++) {
+    int bucket = order[o], count = 0;
+    for (int i = 0; i < num_entries; i++)
+      if ((int) mime_bucket(hashes[i], table->bucket_mask) == bucket)
+        members[count++] = i;
+
+    unsigned int displacement;
+    for (displacement = 0; displacement <= UINT16_MAX; displacement++) {
+      int ok = 1;
+      for (int m = 0; m < count && ok; m++) {
+        placed[m] = mime_slot(hashes[members[m]], displacement,
+            table->slot_mask);
+        if (slots[placed[m]].extension[0] != '\0') ok = 0;
+        for (int k = 0; k < m && ok; k++)
+          if (placed[k] == placed[m]) ok = 0;
+      }
+      if (ok) break;
+    }
+    if (displacement > UINT16_MAX) goto done;
+    displacements[bucket] = displacement;
+    for (int m = 0; m < count; m++) slots[placed[m]] = entries[members[m]];
+  }
+  result = 0;
+
+done:
+  free(sizes);
+  free(order);
+  free(members);
+  free(placed);
+  free(hashes);
+  return result;
+}
+
+/*
+ * Builds a perfect hash table over ENTRIES (whose extensions must be lower
+ * case and unique) into TABLE, allocating its arrays. The types are
+ * referenced, not copied. Returns 0 on success.
+ */
+int mime_build(mime_entry_t *entries, int num_entries, mime_table_t *table) {
+  /* About two slots per key makes displacements quick to find; growing the
+   * table if the search fails anyway keeps this from ever being stuck. */
+  for (unsigned int slots = mime_power_of_two(2 * num_entries + 1);
+      slots <= (1u << 24); slots *= 2) {
+    table->bucket_mask = mime_power_of_two(num_entries / 4 + 1) - 1;
+    table->slot_mask = slots - 1;
+    uint16_t *displacements = calloc(table->bucket_mask + 1, sizeof(uint16_t));
+    mime_entry_t *slot_array = calloc(slots, sizeof(mime_entry_t));
+    if (displacements == NULL || slot_array == NULL) {
+      free(displacements);
+      free(slot_array);
+      return -1;
+    }
+    if (mime_place(entries, num_entries, table, displacements,
+          slot_array) == 0) {
+      table->displacements = displacements;
+      table->slots = slot_array;
+      return 0;
+    }
+    free(displacements);
+    free(slot_array);
+  }
+  return -1;
+}
+
+/* Adds EXTENSION -> TYPE to *ENTRIES, replacing an earlier mapping of the
+ * same extension. */
+static int mime_add(mime_entry_t **entries, int *num_entries, int *capacity,
+    const char *extension, const char *type) {
+  char padded[MIME_MAX_EXTENSION] = { 0 };
+  memcpy(padded, extension, strlen(extension));
+  for (int i = 0; i < *num_entries; i++) {
+    if (memcmp((*entries)[i].extension, padded, MIME_MAX_EXTENSION) == 0) {
+      (*entries)[i].type = type;
+      return 0;
+    }
+  }
+  if (*num_entries == *capacity) {
+    int grown = *capacity ? *capacity * 2 : 256;
+    mime_entry_t *resized = realloc(*entries, grown * sizeof(mime_entry_t));
+    if (resized == NULL) return -1;
+    *entries = resized;
+    *capacity = grown;
+  }
+  memcpy((*entries)[*num_entries].extension, padded, MIME_MAX_EXTENSION);
+  (*entries)[(*num_entries)++].type = type;
+  return 0;
+}
+
+/*
+ * Reads the mime.types file at PATH ("type ext1 ext2 ..." per line, # for
+ * comments) and appends its mappings to *ENTRIES (a malloc'ed array of
+ * *NUM_ENTRIES, or NULL and 0), later mappings of an extension replacing
+ * earlier ones. The types are allocated and never freed. Returns 0 on
+ * success and -1 if the file cannot be read.
+ */
+int mime_parse(const char *path, mime_entry_t **entries, int *num_entries) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return -1;
+
+  int capacity = *num_entries;
+  char line[1024];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+    char *save, *word = strtok_r(line, " \t\r\n", &save);
+    if (word == NULL) continue;
+    char *type = strdup(word);
+    if (type == NULL) break;
+    while ((word = strtok_r(NULL, " \t\r\n;", &save)) != NULL) {
+      size_t length = strlen(word);
+      if (length == 0 || length > MIME_MAX_EXTENSION) continue;
+      for (size_t i = 0; i < length; i++)
+        word[i] = mime_lower(word[i]);
+      if (mime_add(entries, num_entries, &capacity, word, type) < 0) {
+        fclose(file);
+        return -1;
+      }
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+#ifndef MIME_GEN
+/* Returns the content type for the LENGTH-byte EXTENSION, or NULL. */
+const char *mime_lookup(const char *extension, size_t length) {
+  return mime_lookup_table(mime_active, extension, length);
+}
+
+/* Returns the content type for FILE_NAME by its extension, or
+ * MIME_DEFAULT_TYPE. */
+const char *mime_type_for(const char *file_name) {
+  const char *end = file_name + strlen(file_name);
+  /* Only the last MIME_MAX_EXTENSION + 1 bytes can hold a known extension. */
+  const char *stop = end - file_name > MIME_MAX_EXTENSION + 1
+      ? end - (MIME_MAX_EXTENSION + 1) : file_name;
+  for (const char *dot = end - 1; dot >= stop && *dot != '/'; dot--) {
+    if (*dot == '.') {
+      const char *type = mime_lookup(dot + 1, end - dot - 1);
+      return type ? type : MIME_DEFAULT_TYPE;
+    }
+  }
+  return MIME_DEFAULT_TYPE;
+}
+
+/*
+ * Adds the mappings in the mime.types file at PATH to the built-in ones,
+ * overriding them where they disagree, and switches lookups to a table over
+ * both. Must be called before any lookups from other threads. Returns 0 on
+ * success.
+ */
+int mime_load(const char *path) {
+  int capacity = mime_active->slot_mask + 1, num_entries = 0;
+  mime_entry_t *entries = malloc(capacity * sizeof(mime_entry_t));
+  if (entries == NULL) return -1;
+  for (int i = 0; i < capacity; i++) {
+    if (mime_active->slots[i].extension[0] != '\0')
+      entries[num_entries++] = mime_active->slots[i];
+  }
+
+  mime_table_t *table = malloc(sizeof(mime_table_t));
+  if (table == NULL || mime_parse(path, &entries, &num_entries) < 0
+      || mime_build(entries, num_entries, table) < 0) {
+    free(table);
+    free(entries);
+    return -1;
+  }
+  free(entries);
+  mime_active = table;
+  return 0;
+}
+#endif
@@ -0,0 +1,45 @@
+#ifndef __MIME__
+#define __MIME__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* MIME maps file extensions to content types with a perfect hash table, so a
+ * lookup is one hash of the extension, one probe and one comparison however
+ * many types are known. Extensions are matched case-insensitively.
+ *
+ * The built-in table is generated at build time from mime.types by mime_gen
+ * (see the Makefile) using the same builder as mime_load, which can extend
+ * it at startup from another file in the mime.types format. The extended
+ * table replaces the built-in one, so lookups cost the same either way.
+ *
+ * The table uses hash-and-displace: each key's hash picks a bucket, and each
+ * bucket has a displacement chosen when the table is built so that all of
+ * its keys land in distinct empty slots. Keys are handled as two 64-bit
+ * words, lower-cased, hashed and compared a word at a time. */
+
+#define MIME_MAX_EXTENSION 16       // Longer extensions are never known.
+#define MIME_DEFAULT_TYPE "text/plain"
+
+typedef struct mime_entry {
+  char extension[MIME_MAX_EXTENSION];   // Lower case, zero padded; empty
+  const char *type;                     // slots have no extension.
+} mime_entry_t;
+
+typedef struct mime_table {
+  unsigned int bucket_mask;       // Number of buckets - 1 (a power of two).
+  unsigned int slot_mask;         // Number of slots - 1 (a power of two).
+  const uint16_t *displacements;  // By bucket.
+  const mime_entry_t *slots;
+} mime_table_t;
+
+const char *mime_lookup_table(const mime_table_t *table, const char *extension,
+    size_t length);
+int mime_parse(const char *path, mime_entry_t **entries, int *num_entries);
+int mime_build(mime_entry_t *entries, int num_entries, mime_table_t *table);
+
+const char *mime_lookup(const char *extension, size_t length);
+const char *mime_type_for(const char *file_name);
+int mime_load(const char *path);
+
+#endif
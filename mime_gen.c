@@ -0,0 +1,50 @@
+/*
+ * Generates mime_table.h, the built-in MIME table, from a mime.types file:
+ * builds the perfect hash table with mime_build and prints it as C.
+ *
+ * Usage: ./mime_gen mime.types > mime_table.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mime.h"
+
+int main(int argc, char **argv) {
+  mime_entry_t *entries = NULL;
+  int num_entries = 0;
+  mime_table_t table;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s mime.types\n", argv[0]);
+    return 1;
+  }
+  if (mime_parse(argv[1], &entries, &num_entries) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (mime_build(entries, num_entries, &table) < 0) {
+    fprintf(stderr, "Cannot build a table for %d types\n", num_entries);
+    return 1;
+  }
+
+  printf("/* Generated by mime_gen from %s; do not edit. */\n\n", argv[1]);
+  printf("static const uint16_t mime_builtin_displacements[%u] = {",
+      table.bucket_mask + 1);
+  for (unsigned int i = 0; i <= table.bucket_mask; i++)
+    printf("%s%u,", i % 16 ? " " : "\n  ", table.displacements[i]);
+  printf("\n};\n\n");
+
+  printf("static const mime_entry_t mime_builtin_slots[%u] = {\n",
+      table.slot_mask + 1);
+  for (unsigned int i = 0; i <= table.slot_mask; i++) {
+    if (table.slots[i].extension[0] != '\0')
+      printf("  [%u] = { \"%.*s\", \"%s\" },\n", i, MIME_MAX_EXTENSION,
+          table.slots[i].extension, table.slots[i].type);
+  }
+  printf("};\n\n");
+
+  printf("static const mime_table_t mime_builtin = {\n"
+      "  %u, %u, mime_builtin_displacements, mime_builtin_slots\n};\n",
+      table.bucket_mask, table.slot_mask);
+  return 0;
+}
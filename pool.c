@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "stats.h"
+
+static long long pool_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int pool_active(pool_t *pool) {
+  return __atomic_load_n(&pool->num_workers, __ATOMIC_ACQUIRE);
+}
+
+/* Takes a socket from some other worker's queue. Returns -1 if they are all
+ * empty. */
+static int pool_steal(pool_t *pool, pool_worker_t *self) {
+  int num_workers = pool_active(pool);
+  for (int i = 1; i < num_workers; i++) {
+    pool_worker_t *victim = &pool->workers[(self->index + i) % num_workers];
+    if (__atomic_load_n(&victim->queue->size, __ATOMIC_RELAXED) <= 0) continue;
+    int client_socket_fd = wq_try_pop(victim->queue);
+    if (client_socket_fd >= 0) return client_socket_fd;
+  }
+  return -1;
+}
+
+/* Waits for the next socket for SELF: from the priority lane first, then
+ * its own queue, then its peers'.
+ * Sleeping on the own queue is bounded so work stuck behind a busy peer is
+ * picked up even if nothing new arrives here. Returns -1 once SELF is told
+ * to retire. */
+static int pool_next(pool_t *pool, pool_worker_t *self) {
+  int client_socket_fd;
+
+  while (__atomic_load_n(&self->state, __ATOMIC_SEQ_CST)
+      == POOL_WORKER_RUNNING) {
+    if ((client_socket_fd = wq_try_pop(&pool->priority)) >= 0)
+      return client_socket_fd;
+    if ((client_socket_fd = wq_try_pop(self->queue)) >= 0)
+      return client_socket_fd;
+    if ((client_socket_fd = pool_steal(pool, self)) >= 0)
+      return client_socket_fd;
+    client_socket_fd = wq_pop_timeout(self->queue, POOL_STEAL_INTERVAL_MS);
+    if (client_socket_fd >= 0) return client_socket_fd;
+  }
+  return -1;
+}
+
+static void pool_place(pool_t *pool, pool_worker_t *target,
+    int client_socket_fd);
+
+/* Passes whatever is left in retired WORKER's queue to the active workers. */
+static void pool_reclaim(pool_t *pool, pool_worker_t *worker) {
+  int client_socket_fd;
+  while ((client_socket_fd = wq_try_pop(worker->queue)) >= 0)
+    pool_place(pool, NULL, client_socket_fd);
+}
+
+/* THREAD FUNCTION */
+static void *pool_thread_function(void *arg) {
+  pool_worker_t *self = arg;
+  pool_t *pool = self->pool;
+  int connection_socket;
+  struct timespec mark;
+
+  stats_name_thread("worker", self->index);
+  clock_gettime(CLOCK_MONOTONIC, &mark);
+  while (1) {
+    __atomic_store_n(&self->idle_since, pool_now(), __ATOMIC_RELAXED);
+    if ((connection_socket = pool_next(pool, self)) < 0) break;
+    stats_idle(&mark);
+    __atomic_store_n(&self->busy, 1, __ATOMIC_RELAXED);
+    pool->request_handler(connection_socket);
+    close(connection_socket);
+    __atomic_store_n(&self->busy, 0, __ATOMIC_RELAXED);
+    stats_busy(&mark);
+  }
+  stats_idle(&mark);
+  if (pool->thread_exit != NULL) pool->thread_exit();
+  stats_retire_thread();
+  pool_reclaim(pool, self);
+  __atomic_store_n(&self->state, POOL_WORKER_STOPPED, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* Starts a thread for the first inactive slot and makes it active. Returns
+ * 0 if that slot's previous thread has not finished retiring yet. */
+static int pool_start_worker(pool_t *pool) {
+  int index = pool_active(pool);
+  pool_worker_t *worker = &pool->workers[index];
+  if (__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) != POOL_WORKER_STOPPED)
+    return 0;
+
+  /* The run queue is allocated when the slot first starts and kept for its
+   * next thread, so slots that never start cost no queue memory. */
+  if (worker->queue == NULL) {
+    wq_t *queue;
+    if (posix_memalign((void **) &queue, WQ_CACHE_LINE, sizeof(wq_t)) != 0)
+      return 0;
+    wq_init(queue);
+    worker->queue = queue;
+  }
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  worker->state = POOL_WORKER_RUNNING;
+  worker->busy = 0;
+  worker->idle_since = pool_now();
+  if (pthread_create(&worker->thread, &attributes, &pool_thread_function,
+        worker) != 0) {
+    worker->state = POOL_WORKER_STOPPED;
+    pthread_attr_destroy(&attributes);
+    return 0;
+  }
+  pthread_attr_destroy(&attributes);
+  __atomic_store_n(&pool->num_workers, index + 1, __ATOMIC_RELEASE);
+  if (index + 1 > pool->peak_workers)
+    __atomic_store_n(&pool->peak_workers, index + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Takes the last active worker out of the active range, so nothing new is
+ * placed on it, and tells it to exit. */
+static void pool_retire_worker(pool_t *pool) {
+  int index = pool_active(pool) - 1;
+  pool_worker_t *worker = &pool->workers[index];
+  __atomic_store_n(&pool->num_workers, index, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&worker->state, POOL_WORKER_RETIRING, __ATOMIC_SEQ_CST);
+  wq_wake(worker->queue);
+  __atomic_store_n(&pool->retired, pool->retired + 1, __ATOMIC_RELAXED);
+}
+
+/* Grows the pool while sockets wait too long for a worker and shrinks it
+ * when workers sit idle. The only thread that changes NUM_WORKERS. */
+static void *pool_control_function(void *arg) {
+  pool_t *pool = arg;
+  struct timespec interval = { 0, POOL_CONTROL_INTERVAL_MS * 1000000L };
+
+  while (1) {
+    nanosleep(&interval, NULL);
+    long long now = pool_now();
+    int num_workers = pool_active(pool);
+    long long oldest = wq_oldest(&pool->priority);
+    int waiting = __atomic_load_n(&pool->priority.size, __ATOMIC_RELAXED);
+    for (int i = 0; i < num_workers; i++) {
+      long long enqueued = wq_oldest(pool->workers[i].queue);
+      if (enqueued != 0 && (oldest == 0 || enqueued < oldest))
+        oldest = enqueued;
+      waiting += __atomic_load_n(&pool->workers[i].queue->size,
+          __ATOMIC_RELAXED);
+    }
+    long long wait = oldest != 0 && now > oldest ? now - oldest : 0;
+    __atomic_store_n(&pool->oldest_wait_ns, wait, __ATOMIC_RELAXED);
+
+    if (wait > pool->queue_delay_ns) {
+      /* Every worker is busy: give each waiting socket one of its own. */
+      int wanted = waiting < 1 ? 1 : waiting;
+      while (wanted-- > 0 && pool_active(pool) < pool->max_workers
+          && pool_start_worker(pool))
+        __atomic_store_n(&pool->started, pool->started + 1, __ATOMIC_RELAXED);
+    } else if (num_workers > pool->min_workers) {
+      pool_worker_t *last = &pool->workers[num_workers - 1];
+      long long idle_since = __atomic_load_n(&last->idle_since,
+          __ATOMIC_RELAXED);
+      if (!__atomic_load_n(&last->busy, __ATOMIC_RELAXED)
+          && __atomic_load_n(&last->queue->size, __ATOMIC_RELAXED) == 0
+          && now - idle_since >= pool->idle_timeout_ns)
+        pool_retire_worker(pool);
+    }
+  }
+  return NULL;
+}
+
+void pool_init(pool_t *pool, int min_workers, int max_workers,
+    int queue_delay_ms, int idle_timeout, void (*request_handler)(int),
+    void (*thread_exit)(void)) {
+  if (min_workers < 1) min_workers = 1;
+  if (max_workers < min_workers) max_workers = min_workers;
+  pool->num_workers = 0;
+  pool->min_workers = min_workers;
+  pool->max_workers = max_workers;
+  pool->queue_delay_ns = queue_delay_ms * 1000000LL;
+  pool->idle_timeout_ns = idle_timeout * 1000000000LL;
+  pool->request_handler = request_handler;
+  pool->thread_exit = thread_exit;
+  pool->next = 0;
+  pool->started = 0;
+  pool->retired = 0;
+  pool->peak_workers = 0;
+  pool->oldest_wait_ns = 0;
+  pool->max_queued = 0;
+  pool->max_queue_delay_ns = 0;
+  wq_init(&pool->priority);
+  if (posix_memalign((void **) &pool->workers, WQ_CACHE_LINE,
+        max_workers * sizeof(pool_worker_t)) != 0) {
+    perror("Failed to allocate thread pool");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < max_workers; i++) {
+    pool_worker_t *worker = &pool->workers[i];
+    worker->queue = NULL;
+    worker->pool = pool;
+    worker->index = i;
+    worker->state = POOL_WORKER_STOPPED;
+    worker->busy = 0;
+    worker->idle_since = 0;
+  }
+  for (int i = 0; i < min_workers; i++) {
+    if (!pool_start_worker(pool)) {
+      perror("Failed to start worker thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (max_workers > min_workers)
+    pthread_create(&pool->control_thread, NULL, &pool_control_function, pool);
+}
+
+static int pool_load(pool_worker_t *worker) {
+  return __atomic_load_n(&worker->queue->size, __ATOMIC_RELAXED)
+      + __atomic_load_n(&worker->busy, __ATOMIC_RELAXED);
+}
+
+/* Bounds the run queues: see pool_submit. */
+void pool_limit(pool_t *pool, int max_queued, int max_queue_delay_ms) {
+  pool->max_queued = max_queued;
+  pool->max_queue_delay_ns = max_queue_delay_ms * 1000000LL;
+}
+
+/* Returns the less loaded of two candidate workers, one chosen round-robin
+ * and one at random. */
+static pool_worker_t *pool_choose(pool_t *pool) {
+  static __thread unsigned int seed;
+  if (seed == 0) seed = (unsigned int) time(NULL) ^ (unsigned int) pthread_self();
+
+  int num_workers = pool_active(pool);
+  unsigned int first = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)
+      % num_workers;
+  unsigned int second = rand_r(&seed) % num_workers;
+  pool_worker_t *target = &pool->workers[first];
+  if (pool_load(&pool->workers[second]) < pool_load(target))
+    target = &pool->workers[second];
+  return target;
+}
+
+/* Wakes one idle worker, if there is one, so it looks for work now rather
+ * than at its next steal interval. */
+static void pool_wake_idle(pool_t *pool) {
+  int num_workers = pool_active(pool);
+  for (int i = 0; i < num_workers; i++) {
+    if (pool_load(&pool->workers[i]) == 0) {
+      wq_wake(pool->workers[i].queue);
+      break;
+    }
+  }
+}
+
+/* Queues CLIENT_SOCKET_FD on TARGET, or on a worker of its own choosing if
+ * TARGET is NULL. */
+static void pool_place(pool_t *pool, pool_worker_t *target,
+    int client_socket_fd) {
+  if (target == NULL) target = pool_choose(pool);
+  wq_push(target->queue, client_socket_fd);
+
+  /* The target may have retired since NUM_WORKERS was read, after its last
+   * look at its queue: then move the socket on. wq_push is a full barrier,
+   * and the worker marks itself retiring before that last look, so one of
+   * the two always sees the socket. */
+  if (__atomic_load_n(&target->state, __ATOMIC_SEQ_CST) != POOL_WORKER_RUNNING) {
+    pool_reclaim(pool, target);
+    return;
+  }
+
+  /* If the socket has to wait behind other work, wake an idle worker so it
+   * steals it. */
+  if (pool_load(target) > 1) pool_wake_idle(pool);
+}
+
+/* Queues CLIENT_SOCKET_FD on the less loaded of two candidate workers.
+ * Returns -1, leaving the socket to the caller, if even that worker already
+ * has its share of the max_queued waiting sockets or has had one waiting
+ * for longer than max_queue_delay. */
+int pool_submit(pool_t *pool, int client_socket_fd) {
+  pool_worker_t *target = pool_choose(pool);
+
+  if (pool->max_queued > 0) {
+    int num_workers = pool_active(pool);
+    int share = (pool->max_queued + num_workers - 1) / num_workers;
+    if (__atomic_load_n(&target->queue->size, __ATOMIC_RELAXED) >= share)
+      return -1;
+  }
+  if (pool->max_queue_delay_ns > 0) {
+    long long enqueued = wq_oldest(target->queue);
+    if (enqueued != 0 && pool_now() - enqueued > pool->max_queue_delay_ns)
+      return -1;
+  }
+  pool_place(pool, target, client_socket_fd);
+  return 0;
+}
+
+/* Queues CLIENT_SOCKET_FD ahead of everything in the run queues. Returns -1,
+ * without blocking, if the priority lane itself is full. */
+int pool_submit_priority(pool_t *pool, int client_socket_fd) {
+  if (wq_try_push(&pool->priority, client_socket_fd) < 0) return -1;
+  pool_wake_idle(pool);
+  return 0;
+}
+
+/* Returns the number of sockets waiting in all run queues. */
+int pool_size(pool_t *pool) {
+  int size = 0;
+  int num_workers = pool_active(pool);
+  for (int i = 0; i < num_workers; i++) {
+    size += __atomic_load_n(&pool->workers[i].queue->size, __ATOMIC_RELAXED);
+  }
+  return size;
+}
@@ -0,0 +1,85 @@
+#ifndef __POOL__
+#define __POOL__
+
+#include <pthread.h>
+
+#include "wq.h"
+
+/* POOL is the worker thread pool. Every worker has its own run queue, so the
+ * threads do not all contend on one queue's cache lines. Accepted sockets are
+ * placed on the less loaded of two candidate workers (one chosen round-robin,
+ * one at random), and a worker that runs out of work steals from its peers
+ * before going to sleep.
+ *
+ * The pool runs between MIN_WORKERS and MAX_WORKERS threads. Slots for all
+ * of them are allocated up front (a slot's run queue only once it first
+ * starts) and the first NUM_WORKERS are active. If they differ, a control
+ * thread watches how long the oldest socket in any run queue has waited. While that exceeds the target delay (every worker is
+ * stuck in, say, a slow disk read or a long keep-alive connection) it starts
+ * another worker for each waiting socket, up to the maximum. The last active
+ * worker retires once it has been idle for the idle timeout, one at a time,
+ * down to the minimum. A retiring worker leaves the active range first and
+ * then hands anything still in its queue back to the others. Before it exits
+ * it calls THREAD_EXIT, which should release whatever the request handler
+ * keeps per thread (buffers, pipes and the like).
+ *
+ * Admission control bounds the queues: pool_submit refuses a socket when
+ * the worker it would go to already has its share of MAX_QUEUED waiting, or
+ * its oldest socket has waited longer than MAX_QUEUE_DELAY, so the caller
+ * can turn it away at once rather than let every queued request time out.
+ * Sockets on the priority lane are taken before anything in the run queues
+ * and are only refused once the lane itself (WQ_CAPACITY) is full. */
+
+#define POOL_STEAL_INTERVAL_MS 50   // Idle workers re-check peers this often.
+#define POOL_CONTROL_INTERVAL_MS 10 // The control thread samples this often.
+#define POOL_DEFAULT_GROWTH 8       // Default maximum, per minimum worker.
+#define POOL_DEFAULT_QUEUE_DELAY_MS 20
+#define POOL_DEFAULT_IDLE_TIMEOUT 30
+
+typedef enum {
+  POOL_WORKER_STOPPED,        // No thread; the slot can be started.
+  POOL_WORKER_RUNNING,
+  POOL_WORKER_RETIRING        // Out of the active range, about to exit.
+} pool_worker_state_t;
+
+typedef struct pool_worker {
+  wq_t *queue;                // Allocated when the slot first starts.
+  struct pool *pool;
+  int index;
+  int state;                  // A pool_worker_state_t.
+  int busy;                   // Handling a connection right now?
+  long long idle_since;       // When it last went looking for work (ns).
+  pthread_t thread;
+} pool_worker_t;
+
+typedef struct pool {
+  int num_workers;            // Active workers: the first this many slots.
+  int min_workers;
+  int max_workers;
+  long long queue_delay_ns;   // Grow when a socket waits longer than this.
+  long long idle_timeout_ns;  // Retire a worker idle for longer than this.
+  pool_worker_t *workers;     // MAX_WORKERS slots.
+  wq_t priority;              // Served before every run queue.
+  int max_queued;             // Waiting sockets allowed; 0 for no bound.
+  long long max_queue_delay_ns;   // Longest wait allowed; 0 for no bound.
+  void (*request_handler)(int);
+  void (*thread_exit)(void);  // Releases a retiring worker's state; or NULL.
+  unsigned int next;          // Round-robin cursor for placement.
+
+  /* Scaling decisions, for the stats. */
+  unsigned long started;      // Workers started beyond the minimum.
+  unsigned long retired;
+  int peak_workers;
+  long long oldest_wait_ns;   // Longest wait seen by the last sample.
+  pthread_t control_thread;
+} pool_t;
+
+void pool_init(pool_t *pool, int min_workers, int max_workers,
+    int queue_delay_ms, int idle_timeout, void (*request_handler)(int),
+    void (*thread_exit)(void));
+void pool_limit(pool_t *pool, int max_queued, int max_queue_delay_ms);
+int pool_submit(pool_t *pool, int client_socket_fd);
+int pool_submit_priority(pool_t *pool, int client_socket_fd);
+int pool_size(pool_t *pool);
+
+#endif
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "relay.h"
+
+/* Pipes and epoll set are kept per thread and reused across sessions. A pipe
+ * is only put back if it was drained; otherwise it is closed and replaced. */
+static __thread int relay_pipes[2][2] = {{-1, -1}, {-1, -1}};
+static __thread int relay_epoll_fd = -1;
+
+static int relay_open_pipe(int fds[2]) {
+  if (fds[0] >= 0) return 0;
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+  fcntl(fds[0], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+  return 0;
+}
+
+static void relay_close_pipe(int fds[2]) {
+  close(fds[0]);
+  close(fds[1]);
+  fds[0] = fds[1] = -1;
+}
+
+/* Closes the calling thread's pipes and epoll set, before the thread exits. */
+void relay_thread_exit(void) {
+  for (int i = 0; i < 2; i++)
+    if (relay_pipes[i][0] >= 0) relay_close_pipe(relay_pipes[i]);
+  if (relay_epoll_fd >= 0) {
+    close(relay_epoll_fd);
+    relay_epoll_fd = -1;
+  }
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Moves as many bytes along STREAM as both sockets allow. Returns -1 on a
+ * hard error and 0 otherwise. */
+static int relay_pump(relay_stream_t *stream) {
+  ssize_t n;
+
+  while (!stream->write_closed) {
+    /* Fill the pipe from the source. A pipe holds a limited number of
+     * segments rather than bytes, so EAGAIN only means the source is dry if
+     * the pipe was empty. */
+    int dry = 0;
+    while (!stream->read_closed) {
+      n = splice(stream->from, NULL, stream->pipe[1], NULL, RELAY_PIPE_SIZE,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        stream->buffered += n;
+      } else if (n == 0) {
+        stream->read_closed = 1;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        dry = stream->buffered == 0;
+        break;
+      } else {
+        return -1;
+      }
+    }
+
+    /* Drain it into the destination. */
+    while (stream->buffered > 0) {
+      n = splice(stream->pipe[0], NULL, stream->to, NULL, stream->buffered,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        stream->buffered -= n;
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0 && errno == EAGAIN) {
+        return 0;
+      } else {
+        return -1;
+      }
+    }
+
+    if (stream->read_closed) {
+      shutdown(stream->to, SHUT_WR);
+      stream->write_closed = 1;
+    } else if (dry) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/* Relays between CLIENT_FD and UPSTREAM_FD until both directions have seen
+ * EOF, either side fails, or nothing moves for IDLE_TIMEOUT_MS (if not
+ * negative). Returns 0 if both directions finished cleanly and -1 otherwise.
+ * The sockets are left non-blocking and open. */
+int relay_run(int client_fd, int upstream_fd, int idle_timeout_ms) {
+  if (relay_epoll_fd < 0) {
+    relay_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (relay_epoll_fd < 0) return -1;
+  }
+  if (relay_open_pipe(relay_pipes[0]) < 0 || relay_open_pipe(relay_pipes[1]) < 0)
+    return -1;
+
+  relay_stream_t streams[2] = {
+    { .from = client_fd, .to = upstream_fd,
+      .pipe = { relay_pipes[0][0], relay_pipes[0][1] } },
+    { .from = upstream_fd, .to = client_fd,
+      .pipe = { relay_pipes[1][0], relay_pipes[1][1] } },
+  };
+  set_nonblocking(client_fd);
+  set_nonblocking(upstream_fd);
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.fd = client_fd;
+  epoll_ctl(relay_epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+  event.data.fd = upstream_fd;
+  epoll_ctl(relay_epoll_fd, EPOLL_CTL_ADD, upstream_fd, &event);
+
+  int status = 0;
+  struct epoll_event events[2];
+  while (!(streams[0].write_closed && streams[1].write_closed)) {
+    if (relay_pump(&streams[0]) < 0 || relay_pump(&streams[1]) < 0) {
+      status = -1;
+      break;
+    }
+    if (streams[0].write_closed && streams[1].write_closed) break;
+
+    int n = epoll_wait(relay_epoll_fd, events, 2, idle_timeout_ms);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      status = -1;
+      break;
+    }
+  }
+
+  epoll_ctl(relay_epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+  epoll_ctl(relay_epoll_fd, EPOLL_CTL_DEL, upstream_fd, NULL);
+  for (int i = 0; i < 2; i++) {
+    if (streams[i].buffered > 0) relay_close_pipe(relay_pipes[i]);
+  }
+  return status;
+}
+
+/* Waits up to TIMEOUT_MS for FD to become ready for EVENTS. Returns 0 if it
+ * did not. */
+static int relay_wait(int fd, short events, int timeout_ms) {
+  struct pollfd pfd = { .fd = fd, .events = events };
+  int ready;
+  do {
+    ready = poll(&pfd, 1, timeout_ms);
+  } while (ready < 0 && errno == EINTR);
+  return ready > 0;
+}
+
+/* Copies up to COUNT bytes from FROM to TO through the thread's pipe,
+ * stopping early if FROM reaches EOF. Either socket may be blocking or not;
+ * waits for each to be ready for at most TIMEOUT_MS. Returns the number of
+ * bytes copied, or -1 on error or timeout. */
+ssize_t relay_copy(int from, int to, size_t count, int timeout_ms) {
+  int *fds = relay_pipes[0];
+  if (relay_open_pipe(fds) < 0) return -1;
+
+  size_t copied = 0, buffered = 0;
+  int eof = 0;
+  ssize_t n;
+
+  while (copied < count) {
+    if (buffered == 0 && eof) break;
+    if (buffered == 0) {
+      size_t want = count - copied;
+      if (want > RELAY_PIPE_SIZE) want = RELAY_PIPE_SIZE;
+      n = splice(from, NULL, fds[1], NULL, want,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == 0) {
+        eof = 1;
+        continue;
+      }
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN && relay_wait(from, POLLIN, timeout_ms)) continue;
+        return -1;
+      }
+      buffered = n;
+    }
+
+    n = splice(fds[0], NULL, to, NULL, buffered,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN && relay_wait(to, POLLOUT, timeout_ms)) continue;
+      relay_close_pipe(fds);
+      return -1;
+    }
+    buffered -= n;
+    copied += n;
+  }
+  return copied;
+}
@@ -0,0 +1,34 @@
+#ifndef __RELAY__
+#define __RELAY__
+
+#include <sys/types.h>
+
+/* RELAY copies bytes in both directions between two connected sockets until
+ * both sides are done. It runs in the calling thread on a small epoll set
+ * with both sockets non-blocking, and moves data with splice() through a
+ * pipe per direction, so payloads never enter userspace.
+ *
+ * When one side stops sending (read returns 0), everything it sent is
+ * drained to the other side and then that side's write half is shut down,
+ * so half-closed connections (e.g. a client that shuts down after its
+ * request) still get their reply.
+ *
+ * relay_copy moves a known number of bytes in one direction the same way,
+ * for bodies whose length the caller has already read from a head. */
+
+#define RELAY_PIPE_SIZE (64 * 1024)
+
+typedef struct relay_stream {
+  int from;
+  int to;
+  int pipe[2];
+  size_t buffered;      // Bytes sitting in the pipe.
+  int read_closed;      // FROM sent EOF.
+  int write_closed;     // TO's write half has been shut down.
+} relay_stream_t;
+
+int relay_run(int client_fd, int upstream_fd, int idle_timeout_ms);
+ssize_t relay_copy(int from, int to, size_t count, int timeout_ms);
+void relay_thread_exit(void);
+
+#endif
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "resolver.h"
+
+static time_t resolver_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+/* Resolves HOSTNAME:SERVICE into ADDRS with getaddrinfo, keeping both IPv4
+ * and IPv6 addresses. Returns 0 on success. */
+int resolver_getaddrinfo(char *hostname, char *service,
+    resolver_addrs_t *addrs) {
+  struct addrinfo hints, *results, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+
+  int error = getaddrinfo(hostname, service, &hints, &results);
+  if (error != 0) {
+    fprintf(stderr, "Cannot resolve %s: %s\n", hostname, gai_strerror(error));
+    return -1;
+  }
+  addrs->count = 0;
+  for (result = results; result != NULL && addrs->count < RESOLVER_MAX_ADDRS;
+      result = result->ai_next) {
+    memcpy(&addrs->addrs[addrs->count], result->ai_addr, result->ai_addrlen);
+    addrs->lengths[addrs->count] = result->ai_addrlen;
+    addrs->count++;
+  }
+  freeaddrinfo(results);
+  return addrs->count > 0 ? 0 : -1;
+}
+
+/* Resolves RESOLVER's name once and, if that worked, publishes the result.
+ * Returns 0 on success. */
+static int resolver_refresh(resolver_t *resolver) {
+  resolver_addrs_t *addrs = calloc(1, sizeof(resolver_addrs_t));
+  if (addrs == NULL) return -1;
+  if (resolver->lookup(resolver->hostname, resolver->service, addrs) != 0) {
+    free(addrs);
+    return -1;
+  }
+
+  time_t now = resolver_now();
+  addrs->expires = now + resolver->ttl;
+  resolver_addrs_t *old = __atomic_exchange_n(&resolver->current, addrs,
+      __ATOMIC_ACQ_REL);
+
+  /* Only this thread touches the retired list. */
+  if (old != NULL) {
+    old->retired = now;
+    old->next = resolver->retired;
+    resolver->retired = old;
+  }
+  resolver_addrs_t **link = &resolver->retired;
+  while (*link != NULL) {
+    if ((*link)->retired <= now - RESOLVER_GRACE_PERIOD) {
+      resolver_addrs_t *dead = *link;
+      *link = dead->next;
+      free(dead);
+    } else {
+      link = &(*link)->next;
+    }
+  }
+  return 0;
+}
+
+/* THREAD FUNCTION */
+static void *resolver_thread_function(void *arg) {
+  resolver_t *resolver = arg;
+  while (1) {
+    resolver_addrs_t *addrs = __atomic_load_n(&resolver->current,
+        __ATOMIC_ACQUIRE);
+    time_t now = resolver_now();
+    if (addrs != NULL && addrs->expires > now) {
+      sleep(addrs->expires - now);
+      continue;
+    }
+    if (resolver_refresh(resolver) != 0) sleep(RESOLVER_RETRY_INTERVAL);
+  }
+  return NULL;
+}
+
+/* Sets up RESOLVER for HOSTNAME:PORT, caching lookups for TTL seconds, and
+ * does the first lookup right away. LOOKUP may be NULL for getaddrinfo. */
+void resolver_init(resolver_t *resolver, char *hostname, int port, int ttl,
+    resolver_lookup_t lookup) {
+  resolver->hostname = hostname;
+  snprintf(resolver->service, sizeof(resolver->service), "%d", port);
+  resolver->ttl = ttl > 0 ? ttl : 1;
+  resolver->lookup = lookup ? lookup : resolver_getaddrinfo;
+  resolver->current = NULL;
+  resolver->retired = NULL;
+  resolver->next = 0;
+  resolver_refresh(resolver);
+  pthread_create(&resolver->thread, NULL, &resolver_thread_function,
+      resolver);
+}
+
+/* Copies the next address to try into ADDR and LENGTH. Returns how many
+ * addresses the current list holds (so callers know how many to try), or 0
+ * if there is no usable list. Never blocks. */
+int resolver_pick(resolver_t *resolver, struct sockaddr_storage *addr,
+    socklen_t *length) {
+  resolver_addrs_t *addrs = __atomic_load_n(&resolver->current,
+      __ATOMIC_ACQUIRE);
+  if (addrs == NULL || addrs->expires + RESOLVER_MAX_STALE < resolver_now())
+    return 0;
+
+  unsigned int index = __atomic_fetch_add(&resolver->next, 1,
+      __ATOMIC_RELAXED) % addrs->count;
+  memcpy(addr, &addrs->addrs[index], addrs->lengths[index]);
+  *length = addrs->lengths[index];
+  return addrs->count;
+}
@@ -0,0 +1,57 @@
+#ifndef __RESOLVER__
+#define __RESOLVER__
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/* RESOLVER keeps the addresses of one host:port resolved in the background,
+ * so request threads never wait on DNS.
+ *
+ * The current address list is an immutable snapshot published through a
+ * single pointer: readers load it without locking and copy one address out
+ * (picked round-robin, so connections rotate across all A/AAAA records).
+ * A refresh thread resolves the name again when the list's TTL runs out and
+ * swaps in the new list. If the refresh fails, the old list keeps being
+ * served (stale-while-revalidate) for up to RESOLVER_MAX_STALE seconds while
+ * the thread retries. Replaced lists are freed only after a grace period
+ * that no reader holds a snapshot anywhere near.
+ *
+ * Lookups go through the LOOKUP function, getaddrinfo by default, so a stub
+ * can stand in for the system resolver. */
+
+#define RESOLVER_MAX_ADDRS 16
+#define RESOLVER_RETRY_INTERVAL 1   // Seconds between failed refreshes.
+#define RESOLVER_MAX_STALE 300      // Seconds a list is served past its TTL.
+#define RESOLVER_GRACE_PERIOD 10    // Seconds before a replaced list is freed.
+
+typedef struct resolver_addrs {
+  int count;
+  struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+  socklen_t lengths[RESOLVER_MAX_ADDRS];
+  time_t expires;
+  time_t retired;             // When it was replaced.
+  struct resolver_addrs *next;  // Retired lists awaiting free.
+} resolver_addrs_t;
+
+typedef int (*resolver_lookup_t)(char *hostname, char *service,
+    resolver_addrs_t *addrs);
+
+typedef struct resolver {
+  char *hostname;
+  char service[8];
+  int ttl;
+  resolver_lookup_t lookup;
+  resolver_addrs_t *current;
+  resolver_addrs_t *retired;
+  unsigned int next;          // Round-robin cursor.
+  pthread_t thread;
+} resolver_t;
+
+int resolver_getaddrinfo(char *hostname, char *service, resolver_addrs_t *addrs);
+void resolver_init(resolver_t *resolver, char *hostname, int port, int ttl,
+    resolver_lookup_t lookup);
+int resolver_pick(resolver_t *resolver, struct sockaddr_storage *addr,
+    socklen_t *length);
+
+#endif
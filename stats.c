@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+static char *handler_names[STATS_NUM_HANDLERS] = { "files", "proxy" };
+
+static stats_thread_t *threads;       // Every recording thread's counters.
+static unsigned int num_threads;
+static struct timespec started;
+
+/* The calling thread's counters. */
+static __thread stats_thread_t *local_stats;
+
+/* Adds N to COUNTER, which only the calling thread writes. */
+#define STATS_ADD(counter, n) \
+  __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+#define STATS_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static unsigned long long stats_elapsed_ns(struct timespec *since,
+    struct timespec *now) {
+  return (now->tv_sec - since->tv_sec) * 1000000000ULL
+      + now->tv_nsec - since->tv_nsec;
+}
+
+void stats_init(void) {
+  clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+/* Returns the calling thread's counters, registering them on first use, or
+ * NULL if they cannot be allocated. */
+static stats_thread_t *stats_local(void) {
+  if (local_stats != NULL) return local_stats;
+  stats_thread_t *stats = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+  for (; stats != NULL; stats = stats->next) {
+    int retired = 1;
+    if (__atomic_load_n(&stats->retired, __ATOMIC_RELAXED)
+        && __atomic_compare_exchange_n(&stats->retired, &retired, 0, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return local_stats = stats;
+  }
+  if (posix_memalign((void **) &stats, WQ_CACHE_LINE,
+        sizeof(stats_thread_t)) != 0)
+    return NULL;
+  memset(stats, 0, sizeof(stats_thread_t));
+  snprintf(stats->name, sizeof(stats->name), "thread-%u",
+      __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED));
+  stats->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&threads, &stats->next, stats, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  local_stats = stats;
+  return stats;
+}
+
+/* Names the calling thread ROLE-INDEX in the per-thread figures. */
+void stats_name_thread(char *role, int index) {
+  stats_thread_t *stats = stats_local();
+  if (stats == NULL) return;
+  char name[sizeof(stats->name)];
+  snprintf(name, sizeof(name), "%s-%d", role, index);
+  memcpy(stats->name, name, sizeof(name));
+}
+
+/* Gives up the calling thread's counters, which it must not record into
+ * again, to whichever thread registers next. */
+void stats_retire_thread(void) {
+  if (local_stats == NULL) return;
+  __atomic_store_n(&local_stats->retired, 1, __ATOMIC_RELEASE);
+  local_stats = NULL;
+}
+
+/* Returns the histogram bucket holding VALUE microseconds. */
+static int stats_bucket(unsigned long value) {
+  if (value < STATS_SUB_BUCKETS) return value;
+  int exponent = 63 - __builtin_clzl(value);
+  if (exponent > STATS_MAX_EXPONENT) return STATS_NUM_BUCKETS - 1;
+  int sub = (value >> (exponent - STATS_SUB_BUCKET_BITS))
+      & (STATS_SUB_BUCKETS - 1);
+  return (exponent - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/* Returns the largest value that falls into BUCKET. */
+static unsigned long stats_bucket_limit(int bucket) {
+  if (bucket < STATS_SUB_BUCKETS) return bucket;
+  int shift = bucket / STATS_SUB_BUCKETS - 1;
+  unsigned long sub = bucket % STATS_SUB_BUCKETS;
+  return ((STATS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/* Counts a request to HANDLER that was answered with STATUS_CODE and BYTES
+ * body bytes (-1 if unknown) and started at START. */
+void stats_request(stats_handler_t handler, int status_code, long long bytes,
+    struct timespec *start) {
+  stats_thread_t *stats = stats_local();
+  if (stats == NULL) return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long us = stats_elapsed_ns(start, &now) / 1000;
+  stats_histogram_t *latency = &stats->latency[handler];
+  STATS_ADD(latency->counts[stats_bucket(us)], 1);
+  STATS_ADD(latency->total, 1);
+  STATS_ADD(latency->sum_us, us);
+  if (us > latency->max_us) __atomic_store_n(&latency->max_us, us,
+      __ATOMIC_RELAXED);
+
+  if (status_code >= 0 && status_code < STATS_MAX_STATUS)
+    STATS_ADD(stats->responses[status_code], 1);
+  if (bytes > 0) STATS_ADD(stats->bytes_sent, bytes);
+}
+
+/* Counts a failed exchange with the proxy target. */
+void stats_upstream_error(void) {
+  stats_thread_t *stats = stats_local();
+  if (stats != NULL) STATS_ADD(stats->upstream_errors, 1);
+}
+
+/* Counts a connection turned away by admission control. */
+void stats_shed(void) {
+  stats_thread_t *stats = stats_local();
+  if (stats != NULL) STATS_ADD(stats->shed, 1);
+}
+
+/* Counts the time since *SINCE as busy and moves *SINCE to now. */
+void stats_busy(struct timespec *since) {
+  stats_thread_t *stats = stats_local();
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (stats != NULL) STATS_ADD(stats->busy_ns, stats_elapsed_ns(since, &now));
+  *since = now;
+}
+
+/* Counts the time since *SINCE as idle and moves *SINCE to now. */
+void stats_idle(struct timespec *since) {
+  stats_thread_t *stats = stats_local();
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (stats != NULL) STATS_ADD(stats->idle_ns, stats_elapsed_ns(since, &now));
+  *since = now;
+}
+
+/* READING */
+
+/* Returns the value below which FRACTION of the HISTOGRAM's samples lie. */
+static unsigned long stats_percentile(stats_histogram_t *histogram,
+    double fraction) {
+  if (histogram->total == 0) return 0;
+  unsigned long rank = (unsigned long) (fraction * histogram->total);
+  if (rank >= histogram->total) rank = histogram->total - 1;
+  unsigned long seen = 0;
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen > rank) {
+      unsigned long limit = stats_bucket_limit(i);
+      return limit < histogram->max_us ? limit : histogram->max_us;
+    }
+  }
+  return histogram->max_us;
+}
+
+/* Adds every thread's latency histogram for HANDLER into SUM. */
+static void stats_sum_latency(stats_handler_t handler, stats_histogram_t *sum) {
+  memset(sum, 0, sizeof(stats_histogram_t));
+  stats_thread_t *stats = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+  for (; stats != NULL; stats = stats->next) {
+    stats_histogram_t *latency = &stats->latency[handler];
+    for (int i = 0; i < STATS_NUM_BUCKETS; i++)
+      sum->counts[i] += STATS_READ(latency->counts[i]);
+    sum->sum_us += STATS_READ(latency->sum_us);
+    unsigned long max_us = STATS_READ(latency->max_us);
+    if (max_us > sum->max_us) sum->max_us = max_us;
+  }
+  /* Counted from the buckets so percentiles see a consistent total. */
+  for (int i = 0; i < STATS_NUM_BUCKETS; i++) sum->total += sum->counts[i];
+}
+
+static double percentiles[] = { 0.5, 0.99, 0.999 };
+static char *percentile_names[] = { "p50", "p99", "p999" };
+
+static void stats_render_json(FILE *out, pool_t *pool,
+    unsigned long *responses, unsigned long long bytes_sent,
+    unsigned long upstream_errors, unsigned long shed, double uptime) {
+  fprintf(out, "{\n  \"uptime_seconds\": %.3f,\n  \"responses\": {", uptime);
+  char *separator = "";
+  for (int i = 0; i < STATS_MAX_STATUS; i++) {
+    if (responses[i] == 0) continue;
+    fprintf(out, "%s\"%d\": %lu", separator, i, responses[i]);
+    separator = ", ";
+  }
+  fprintf(out, "},\n  \"bytes_sent\": %llu,\n  \"upstream_errors\": %lu,\n"
+      "  \"shed\": %lu,\n  \"latency_us\": {\n", bytes_sent, upstream_errors,
+      shed);
+
+  stats_histogram_t *latency = malloc(sizeof(stats_histogram_t));
+  for (int h = 0; latency != NULL && h < STATS_NUM_HANDLERS; h++) {
+    stats_sum_latency(h, latency);
+    fprintf(out, "    \"%s\": {\"count\": %lu, \"mean\": %.1f",
+        handler_names[h], latency->total,
+        latency->total ? (double) latency->sum_us / latency->total : 0.0);
+    for (int p = 0; p < 3; p++)
+      fprintf(out, ", \"%s\": %lu", percentile_names[p],
+          stats_percentile(latency, percentiles[p]));
+    fprintf(out, ", \"max\": %lu}%s\n", latency->max_us,
+        h + 1 < STATS_NUM_HANDLERS ? "," : "");
+  }
+  free(latency);
+
+  fprintf(out, "  },\n");
+  if (pool != NULL)
+    fprintf(out, "  \"pool\": {\"workers\": %d, \"min\": %d, \"max\": %d, "
+        "\"peak\": %d, \"started\": %lu, \"retired\": %lu, "
+        "\"oldest_wait_us\": %lld},\n",
+        __atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED),
+        pool->min_workers, pool->max_workers,
+        __atomic_load_n(&pool->peak_workers, __ATOMIC_RELAXED),
+        __atomic_load_n(&pool->started, __ATOMIC_RELAXED),
+        __atomic_load_n(&pool->retired, __ATOMIC_RELAXED),
+        __atomic_load_n(&pool->oldest_wait_ns, __ATOMIC_RELAXED) / 1000);
+  fprintf(out, "  \"work_queues\": [");
+  int num_workers = pool != NULL
+      ? __atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED) : 0;
+  for (int i = 0; i < num_workers; i++) {
+    wq_t *queue = pool->workers[i].queue;
+    fprintf(out, "%s{\"worker\": %d, \"size\": %d, \"peak\": %d}",
+        i ? ", " : "", i, __atomic_load_n(&queue->size, __ATOMIC_RELAXED),
+        __atomic_load_n(&queue->peak_size, __ATOMIC_RELAXED));
+  }
+  fprintf(out, "],\n  \"threads\": [");
+  separator = "\n";
+  stats_thread_t *stats = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+  for (; stats != NULL; stats = stats->next) {
+    fprintf(out, "%s    {\"name\": \"%s\", \"busy_seconds\": %.3f, "
+        "\"idle_seconds\": %.3f}", separator, stats->name,
+        STATS_READ(stats->busy_ns) / 1e9, STATS_READ(stats->idle_ns) / 1e9);
+    separator = ",\n";
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+static void stats_render_prometheus(FILE *out, pool_t *pool,
+    unsigned long *responses, unsigned long long bytes_sent,
+    unsigned long upstream_errors, unsigned long shed, double uptime) {
+  fprintf(out, "# HELP httpserver_uptime_seconds Time since the server "
+      "started.\n# TYPE httpserver_uptime_seconds gauge\n"
+      "httpserver_uptime_seconds %.3f\n", uptime);
+
+  fprintf(out, "# HELP httpserver_responses_total Responses by status code.\n"
+      "# TYPE httpserver_responses_total counter\n");
+  for (int i = 0; i < STATS_MAX_STATUS; i++) {
+    if (responses[i] > 0)
+      fprintf(out, "httpserver_responses_total{code=\"%d\"} %lu\n", i,
+          responses[i]);
+  }
+  fprintf(out, "# HELP httpserver_sent_bytes_total Response body bytes "
+      "sent.\n# TYPE httpserver_sent_bytes_total counter\n"
+      "httpserver_sent_bytes_total %llu\n", bytes_sent);
+  fprintf(out, "# HELP httpserver_upstream_errors_total Failed exchanges "
+      "with the proxy target.\n"
+      "# TYPE httpserver_upstream_errors_total counter\n"
+      "httpserver_upstream_errors_total %lu\n", upstream_errors);
+  fprintf(out, "# HELP httpserver_shed_total Connections turned away with "
+      "503 by admission control.\n"
+      "# TYPE httpserver_shed_total counter\n"
+      "httpserver_shed_total %lu\n", shed);
+
+  fprintf(out, "# HELP httpserver_request_duration_seconds Time taken to "
+      "answer requests, by handler.\n"
+      "# TYPE httpserver_request_duration_seconds summary\n");
+  stats_histogram_t *latency = malloc(sizeof(stats_histogram_t));
+  for (int h = 0; latency != NULL && h < STATS_NUM_HANDLERS; h++) {
+    stats_sum_latency(h, latency);
+    for (int p = 0; p < 3; p++)
+      fprintf(out, "httpserver_request_duration_seconds{handler=\"%s\","
+          "quantile=\"%g\"} %.6f\n", handler_names[h], percentiles[p],
+          stats_percentile(latency, percentiles[p]) / 1e6);
+    fprintf(out, "httpserver_request_duration_seconds_sum{handler=\"%s\"} "
+        "%.6f\n", handler_names[h], latency->sum_us / 1e6);
+    fprintf(out, "httpserver_request_duration_seconds_count{handler=\"%s\"} "
+        "%lu\n", handler_names[h], latency->total);
+  }
+  free(latency);
+
+  int num_workers = pool != NULL
+      ? __atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED) : 0;
+  if (pool != NULL) {
+    fprintf(out, "# HELP httpserver_pool_workers Active worker threads.\n"
+        "# TYPE httpserver_pool_workers gauge\n"
+        "httpserver_pool_workers %d\n", num_workers);
+    fprintf(out, "# HELP httpserver_pool_workers_started_total Workers "
+        "started because connections waited too long.\n"
+        "# TYPE httpserver_pool_workers_started_total counter\n"
+        "httpserver_pool_workers_started_total %lu\n",
+        __atomic_load_n(&pool->started, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP httpserver_pool_workers_retired_total Workers "
+        "retired after sitting idle.\n"
+        "# TYPE httpserver_pool_workers_retired_total counter\n"
+        "httpserver_pool_workers_retired_total %lu\n",
+        __atomic_load_n(&pool->retired, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP httpserver_pool_oldest_wait_seconds Longest any "
+        "queued connection had waited at the last sample.\n"
+        "# TYPE httpserver_pool_oldest_wait_seconds gauge\n"
+        "httpserver_pool_oldest_wait_seconds %.6f\n",
+        __atomic_load_n(&pool->oldest_wait_ns, __ATOMIC_RELAXED) / 1e9);
+  }
+  fprintf(out, "# HELP httpserver_work_queue_size Connections waiting for "
+      "a worker.\n# TYPE httpserver_work_queue_size gauge\n");
+  for (int i = 0; i < num_workers; i++)
+    fprintf(out, "httpserver_work_queue_size{worker=\"%d\"} %d\n", i,
+        __atomic_load_n(&pool->workers[i].queue->size, __ATOMIC_RELAXED));
+  fprintf(out, "# HELP httpserver_work_queue_peak Most connections ever "
+      "waiting for a worker.\n# TYPE httpserver_work_queue_peak gauge\n");
+  for (int i = 0; i < num_workers; i++)
+    fprintf(out, "httpserver_work_queue_peak{worker=\"%d\"} %d\n", i,
+        __atomic_load_n(&pool->workers[i].queue->peak_size, __ATOMIC_RELAXED));
+
+  char *kinds[] = { "busy", "idle" };
+  for (int k = 0; k < 2; k++) {
+    fprintf(out, "# HELP httpserver_thread_%s_seconds_total Time each "
+        "thread spent %s.\n# TYPE httpserver_thread_%s_seconds_total "
+        "counter\n", kinds[k], k ? "waiting for work" : "working", kinds[k]);
+    stats_thread_t *stats = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+    for (; stats != NULL; stats = stats->next)
+      fprintf(out, "httpserver_thread_%s_seconds_total{thread=\"%s\"} %.6f\n",
+          kinds[k], stats->name,
+          (k ? STATS_READ(stats->idle_ns) : STATS_READ(stats->busy_ns)) / 1e9);
+  }
+}
+
+/* Writes every figure to OUT, as JSON or, if PROMETHEUS, in the Prometheus
+ * text format. POOL, if set, is the thread pool whose queues are shown. */
+void stats_render(FILE *out, int prometheus, pool_t *pool) {
+  unsigned long responses[STATS_MAX_STATUS] = { 0 };
+  unsigned long long bytes_sent = 0;
+  unsigned long upstream_errors = 0;
+  unsigned long shed = 0;
+  struct timespec now;
+
+  stats_thread_t *stats = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+  for (; stats != NULL; stats = stats->next) {
+    for (int i = 0; i < STATS_MAX_STATUS; i++)
+      responses[i] += STATS_READ(stats->responses[i]);
+    bytes_sent += STATS_READ(stats->bytes_sent);
+    upstream_errors += STATS_READ(stats->upstream_errors);
+    shed += STATS_READ(stats->shed);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double uptime = stats_elapsed_ns(&started, &now) / 1e9;
+
+  if (prometheus) {
+    stats_render_prometheus(out, pool, responses, bytes_sent, upstream_errors,
+        shed, uptime);
+  } else {
+    stats_render_json(out, pool, responses, bytes_sent, upstream_errors,
+        shed, uptime);
+  }
+}
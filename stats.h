@@ -0,0 +1,70 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdio.h>
+#include <time.h>
+
+#include "pool.h"
+#include "wq.h"
+
+/* STATS counts what the server does, for the /__stats endpoint.
+ *
+ * Every thread that records anything gets its own block of counters,
+ * registered once in a lock-free list, and is the only one that writes it:
+ * recording a request is a few plain stores to memory no other thread
+ * writes, with no atomic read-modify-write and no shared cache line.
+ * Readers walk the list and add the blocks up, tolerating counters that
+ * move while they read. A thread that exits leaves its block (and its
+ * counts) behind for the next new thread to continue, so worker threads
+ * coming and going do not grow the list.
+ *
+ * Latencies go into log-linear histograms in the style of HdrHistogram:
+ * every power of two of microseconds is split into STATS_SUB_BUCKETS
+ * buckets, so a percentile read from it is within about 6% of the truth
+ * over the whole range from 1 us to days. */
+
+#define STATS_SUB_BUCKETS 16
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_MAX_EXPONENT 43           // Longest latency is 2^44 us.
+#define STATS_NUM_BUCKETS \
+  ((STATS_MAX_EXPONENT - STATS_SUB_BUCKET_BITS + 2) * STATS_SUB_BUCKETS)
+#define STATS_MAX_STATUS 600            // Status codes counted: 0-599.
+
+typedef enum {
+  STATS_FILES,
+  STATS_PROXY,
+  STATS_NUM_HANDLERS
+} stats_handler_t;
+
+typedef struct stats_histogram {
+  unsigned long counts[STATS_NUM_BUCKETS];
+  unsigned long total;
+  unsigned long long sum_us;
+  unsigned long max_us;
+} stats_histogram_t;
+
+typedef struct stats_thread {
+  char name[16];
+  unsigned long responses[STATS_MAX_STATUS];  // By status code.
+  unsigned long long bytes_sent;
+  unsigned long upstream_errors;
+  unsigned long shed;       // Connections turned away with a 503.
+  unsigned long long busy_ns;
+  unsigned long long idle_ns;
+  stats_histogram_t latency[STATS_NUM_HANDLERS];
+  int retired;              // Its thread exited; a new one may take it over.
+  struct stats_thread *next;
+} __attribute__((aligned(WQ_CACHE_LINE))) stats_thread_t;
+
+void stats_init(void);
+void stats_name_thread(char *role, int index);
+void stats_retire_thread(void);
+void stats_request(stats_handler_t handler, int status_code, long long bytes,
+    struct timespec *start);
+void stats_upstream_error(void);
+void stats_shed(void);
+void stats_busy(struct timespec *since);
+void stats_idle(struct timespec *since);
+void stats_render(FILE *out, int prometheus, pool_t *pool);
+
+#endif
@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upstream.h"
+#include "utlist.h"
+
+static time_t upstream_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+/* The slot the calling thread uses, or -1 before its first checkout. */
+static __thread int local_slot = -1;
+
+/* Returns the slot the calling thread uses, assigning the one with the
+ * fewest threads on first use. */
+static upstream_slot_t *upstream_local_slot(upstream_t *upstream) {
+  if (local_slot < 0) {
+    local_slot = 0;
+    for (int i = 1; i < upstream->num_slots; i++) {
+      if (__atomic_load_n(&upstream->slots[i].users, __ATOMIC_RELAXED)
+          < __atomic_load_n(&upstream->slots[local_slot].users,
+            __ATOMIC_RELAXED))
+        local_slot = i;
+    }
+    __atomic_add_fetch(&upstream->slots[local_slot].users, 1,
+        __ATOMIC_RELAXED);
+  }
+  return &upstream->slots[local_slot];
+}
+
+/* Gives up the calling thread's slot, before the thread exits, so the next
+ * thread to start takes the emptiest one. */
+void upstream_thread_exit(upstream_t *upstream) {
+  if (local_slot < 0) return;
+  __atomic_sub_fetch(&upstream->slots[local_slot].users, 1, __ATOMIC_RELAXED);
+  local_slot = -1;
+}
+
+/* Returns 1 if the idle connection FD can still carry a request: the peer
+ * has not closed it and has not sent anything unasked. */
+static int upstream_healthy(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Opens a new connection to UPSTREAM, trying each of its addresses in turn
+ * (starting from the next one in rotation). Returns -1 on failure. */
+int upstream_connect(upstream_t *upstream) {
+  struct sockaddr_storage address;
+  socklen_t length;
+  int count = resolver_pick(&upstream->resolver, &address, &length);
+
+  for (int i = 0; i < count; i++) {
+    if (i > 0) resolver_pick(&upstream->resolver, &address, &length);
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno,
+          strerror(errno));
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, length) == 0) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+/* Returns a connection to UPSTREAM: an idle one from the caller's slot if a
+ * healthy one is left, else a new one. Sets *REUSED accordingly. Returns -1
+ * if no connection could be opened. */
+int upstream_checkout(upstream_t *upstream, int *reused) {
+  upstream_slot_t *slot = upstream_local_slot(upstream);
+
+  while (1) {
+    pthread_mutex_lock(&slot->lock);
+    upstream_conn_t *conn = slot->idle;
+    if (conn != NULL) {
+      LL_DELETE(slot->idle, conn);
+      slot->num_idle--;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    if (conn == NULL) break;
+
+    int fd = conn->fd;
+    free(conn);
+    if (upstream_healthy(fd)) {
+      *reused = 1;
+      return fd;
+    }
+    close(fd);
+  }
+
+  *reused = 0;
+  return upstream_connect(upstream);
+}
+
+/* Gives FD back to UPSTREAM. It is kept for reuse if REUSABLE and the
+ * caller's slot has room, and closed otherwise. */
+void upstream_checkin(upstream_t *upstream, int fd, int reusable) {
+  upstream_slot_t *slot = upstream_local_slot(upstream);
+  upstream_conn_t *conn = NULL;
+
+  if (reusable && (conn = malloc(sizeof(upstream_conn_t))) != NULL) {
+    conn->fd = fd;
+    conn->idle_since = upstream_now();
+    pthread_mutex_lock(&slot->lock);
+    if (slot->num_idle < upstream->max_idle) {
+      LL_PREPEND(slot->idle, conn);
+      slot->num_idle++;
+      conn = NULL;
+      fd = -1;
+    }
+    pthread_mutex_unlock(&slot->lock);
+  }
+  free(conn);
+  if (fd >= 0) close(fd);
+}
+
+/* Closes SLOT's connections that are stale or were closed by the peer, then
+ * opens new ones until it holds min_idle. */
+static void upstream_maintain(upstream_t *upstream, upstream_slot_t *slot) {
+  time_t deadline = upstream_now() - UPSTREAM_IDLE_TIMEOUT;
+  upstream_conn_t *conn, *tmp, *dead = NULL;
+
+  pthread_mutex_lock(&slot->lock);
+  LL_FOREACH_SAFE(slot->idle, conn, tmp) {
+    if (conn->idle_since <= deadline || !upstream_healthy(conn->fd)) {
+      LL_DELETE(slot->idle, conn);
+      LL_PREPEND(dead, conn);
+      slot->num_idle--;
+    }
+  }
+  int missing = upstream->min_idle - slot->num_idle;
+  pthread_mutex_unlock(&slot->lock);
+
+  LL_FOREACH_SAFE(dead, conn, tmp) {
+    close(conn->fd);
+    free(conn);
+  }
+
+  /* Connect outside the lock so workers are not held up meanwhile. */
+  for (int i = 0; i < missing; i++) {
+    int fd = upstream_connect(upstream);
+    if (fd < 0) break;
+    conn = malloc(sizeof(upstream_conn_t));
+    if (conn == NULL) {
+      close(fd);
+      break;
+    }
+    conn->fd = fd;
+    conn->idle_since = upstream_now();
+    pthread_mutex_lock(&slot->lock);
+    LL_APPEND(slot->idle, conn);
+    slot->num_idle++;
+    pthread_mutex_unlock(&slot->lock);
+  }
+}
+
+/* THREAD FUNCTION */
+static void *upstream_thread_function(void *arg) {
+  upstream_t *upstream = arg;
+  while (1) {
+    for (int i = 0; i < upstream->num_slots; i++) {
+      upstream_maintain(upstream, &upstream->slots[i]);
+    }
+    sleep(UPSTREAM_MAINTAIN_INTERVAL);
+  }
+  return NULL;
+}
+
+void upstream_init(upstream_t *upstream, char *hostname, int port,
+    int dns_ttl, int num_slots, int min_idle, int max_idle) {
+  if (num_slots < 1) num_slots = 1;
+  upstream->hostname = hostname;
+  upstream->port = port;
+  resolver_init(&upstream->resolver, hostname, port, dns_ttl, NULL);
+  if (port == 80) {
+    upstream->host_header = strdup(hostname);
+  } else if (asprintf(&upstream->host_header, "%s:%d", hostname, port) < 0) {
+    upstream->host_header = NULL;
+  }
+  if (upstream->host_header == NULL) {
+    perror("Failed to allocate upstream");
+    exit(EXIT_FAILURE);
+  }
+  upstream->max_idle = max_idle;
+  upstream->min_idle = min_idle < max_idle ? min_idle : max_idle;
+  upstream->num_slots = num_slots;
+  if (posix_memalign((void **) &upstream->slots, WQ_CACHE_LINE,
+        num_slots * sizeof(upstream_slot_t)) != 0) {
+    perror("Failed to allocate upstream");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < num_slots; i++) {
+    pthread_mutex_init(&upstream->slots[i].lock, NULL);
+    upstream->slots[i].idle = NULL;
+    upstream->slots[i].num_idle = 0;
+    upstream->slots[i].users = 0;
+  }
+  pthread_create(&upstream->maintainer, NULL, &upstream_thread_function,
+      upstream);
+}
@@ -0,0 +1,58 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+#include <pthread.h>
+#include <time.h>
+
+#include "resolver.h"
+#include "wq.h"
+
+/* UPSTREAM keeps idle persistent connections to the proxy target so that
+ * proxied requests do not each pay for a TCP handshake.
+ *
+ * Idle connections live in slots, about one per worker thread: a thread
+ * always uses the same slot (the one with the fewest threads when it first
+ * checks out), so checkouts and checkins normally take a lock no other
+ * thread is holding. A thread that exits gives its slot up. A connection is
+ * checked for a close by the peer before it is handed out. A background
+ * thread closes connections that have been idle for UPSTREAM_IDLE_TIMEOUT
+ * seconds and opens new ones until every slot holds at least min_idle.
+ * Addresses come from a background RESOLVER, so opening a connection never
+ * waits on DNS. */
+
+#define UPSTREAM_IDLE_TIMEOUT 30
+#define UPSTREAM_MAINTAIN_INTERVAL 1    // Seconds between maintenance passes.
+
+typedef struct upstream_conn {
+  int fd;
+  time_t idle_since;
+  struct upstream_conn *next;
+} upstream_conn_t;
+
+typedef struct upstream_slot {
+  pthread_mutex_t lock;
+  upstream_conn_t *idle;      // Most recently used first.
+  int num_idle;
+  int users;                  // Threads using this slot.
+} __attribute__((aligned(WQ_CACHE_LINE))) upstream_slot_t;
+
+typedef struct upstream {
+  char *hostname;
+  int port;
+  char *host_header;          // Value of the Host header sent upstream.
+  resolver_t resolver;
+  int min_idle;               // Per slot.
+  int max_idle;               // Per slot.
+  int num_slots;
+  upstream_slot_t *slots;
+  pthread_t maintainer;
+} upstream_t;
+
+void upstream_init(upstream_t *upstream, char *hostname, int port,
+    int dns_ttl, int num_slots, int min_idle, int max_idle);
+int upstream_connect(upstream_t *upstream);
+int upstream_checkout(upstream_t *upstream, int *reused);
+void upstream_checkin(upstream_t *upstream, int fd, int reusable);
+void upstream_thread_exit(upstream_t *upstream);
+
+#endif
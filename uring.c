@@ -0,0 +1,657 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "relay.h"
+#include "stats.h"
+#include "uring.h"
+#include "utlist.h"
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit,
+    unsigned int min_complete, unsigned int flags, void *arg, size_t size) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+      arg, size);
+}
+
+static int uring_register(int ring_fd, unsigned int opcode, void *arg,
+    unsigned int num_args) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, num_args);
+}
+
+static time_t loop_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+/* Returns 1 if the kernel supports everything uring_run uses: the opcodes,
+ * the extended enter arguments and provided buffer rings (which came with
+ * multishot accept in 5.19). Otherwise says why on stderr and returns 0. */
+int uring_supported(void) {
+  static const int opcodes[] = { IORING_OP_ACCEPT, IORING_OP_RECV,
+      IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_SPLICE };
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = uring_setup(8, &params);
+  if (ring_fd < 0) {
+    perror("io_uring unavailable");
+    return 0;
+  }
+
+  char *reason = NULL;
+  size_t probe_size = sizeof(struct io_uring_probe)
+      + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  void *ring = NULL;
+  if (!(params.features & IORING_FEAT_EXT_ARG)) reason = "no EXT_ARG";
+  if (reason == NULL && (probe == NULL
+        || uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0))
+    reason = "cannot probe opcodes";
+  for (size_t i = 0; reason == NULL && i < sizeof(opcodes) / sizeof(int); i++) {
+    if (opcodes[i] > probe->last_op
+        || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED))
+      reason = "missing opcodes";
+  }
+  if (reason == NULL) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_entries = 1;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (posix_memalign(&ring, sysconf(_SC_PAGESIZE),
+          sizeof(struct io_uring_buf)) != 0) {
+      reason = "out of memory";
+    } else {
+      reg.ring_addr = (uintptr_t) ring;
+      if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        reason = "no provided buffer rings";
+    }
+  }
+  close(ring_fd);
+  free(ring);
+  free(probe);
+  if (reason != NULL) fprintf(stderr, "io_uring unavailable: %s\n", reason);
+  return reason == NULL;
+}
+
+/* Gives receive buffer BID back to the kernel. */
+static void loop_recycle(uring_loop_t *loop, unsigned short bid) {
+  unsigned short tail = loop->buffers->tail;
+  struct io_uring_buf *buf = &loop->buffers->bufs[tail & (URING_BUFFERS - 1)];
+  buf->addr = (uintptr_t) (loop->buffer_data + bid * URING_BUFFER_SIZE);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = bid;
+  __atomic_store_n(&loop->buffers->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Sets up LOOP's ring and receive buffers. Returns -1 on failure. */
+static int loop_open(uring_loop_t *loop) {
+  /* Fewer task switches first, then whatever the kernel accepts. */
+  static const unsigned int flag_sets[] = {
+    IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_COOP_TASKRUN,
+    0
+  };
+  struct io_uring_params params;
+  for (size_t i = 0; i < sizeof(flag_sets) / sizeof(int); i++) {
+    memset(&params, 0, sizeof(params));
+    params.flags = flag_sets[i] | IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * URING_ENTRIES;
+    loop->ring_fd = uring_setup(URING_ENTRIES, &params);
+    if (loop->ring_fd >= 0 || errno != EINVAL) break;
+  }
+  if (loop->ring_fd < 0) return -1;
+
+  size_t sq_size = params.sq_off.array
+      + params.sq_entries * sizeof(unsigned int);
+  size_t cq_size = params.cq_off.cqes
+      + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_size > sq_size) sq_size = cq_size;
+  char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) return -1;
+  char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_CQ_RING);
+  if (cq == MAP_FAILED) return -1;
+  loop->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+      IORING_OFF_SQES);
+  if (loop->sqes == MAP_FAILED) return -1;
+
+  loop->sq_head = (unsigned int *) (sq + params.sq_off.head);
+  loop->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+  loop->sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+  loop->sq_array = (unsigned int *) (sq + params.sq_off.array);
+  loop->sq_local_tail = *loop->sq_tail;
+  /* Slot i always holds SQE i, so queueing only moves the tail. */
+  for (unsigned int i = 0; i < params.sq_entries; i++) loop->sq_array[i] = i;
+  loop->cq_head = (unsigned int *) (cq + params.cq_off.head);
+  loop->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+  loop->cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  if (posix_memalign((void **) &loop->buffers, sysconf(_SC_PAGESIZE),
+        URING_BUFFERS * sizeof(struct io_uring_buf)) != 0)
+    return -1;
+  memset(loop->buffers, 0, URING_BUFFERS * sizeof(struct io_uring_buf));
+  loop->buffer_data = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+  if (loop->buffer_data == NULL) return -1;
+  reg.ring_addr = (uintptr_t) loop->buffers;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+  for (int i = 0; i < URING_BUFFERS; i++) loop_recycle(loop, i);
+  return 0;
+}
+
+/* Hands the queued submissions to the kernel and, if WAIT, waits up to a
+ * second for at least one completion. */
+static int loop_enter(uring_loop_t *loop, int wait) {
+  __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned int to_submit = loop->sq_local_tail
+      - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+  struct __kernel_timespec timeout = { .tv_sec = 1 };
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uintptr_t) &timeout;
+  return uring_enter(loop->ring_fd, to_submit, wait ? 1 : 0,
+      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/* Returns 1 if COUNT more SQEs can be queued, submitting what is queued
+ * first if need be. */
+static int loop_room(uring_loop_t *loop, unsigned int count) {
+  for (int tries = 0; tries < 2; tries++) {
+    unsigned int queued = loop->sq_local_tail
+        - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (queued + count <= loop->sq_mask + 1) return 1;
+    loop_enter(loop, 0);
+  }
+  return 0;
+}
+
+/* Returns a cleared SQE for OP on CONN (NULL for the listener), or NULL if
+ * the ring has no room. */
+static struct io_uring_sqe *loop_sqe(uring_loop_t *loop, uring_conn_t *conn,
+    uring_op_t op) {
+  if (!loop_room(loop, 1)) return NULL;
+  struct io_uring_sqe *sqe = &loop->sqes[loop->sq_local_tail & loop->sq_mask];
+  loop->sq_local_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t) conn | op;
+  if (conn != NULL) conn->inflight++;
+  return sqe;
+}
+
+static void loop_accept_more(uring_loop_t *loop) {
+  struct io_uring_sqe *sqe = loop_sqe(loop, NULL, URING_ACCEPT);
+  if (sqe == NULL) return;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/* Records progress on CONN, moving it to the back of the idle list. */
+static void conn_touch(uring_loop_t *loop, uring_conn_t *conn) {
+  conn->last_active = loop_now();
+  DL_DELETE(loop->conns, conn);
+  DL_APPEND(loop->conns, conn);
+}
+
+/* Frees CONN once nothing of it is in flight any more, keeping it on LOOP's
+ * free list for reuse up to a limit. */
+static void conn_destroy(uring_loop_t *loop, uring_conn_t *conn) {
+  close(conn->http.fd);
+  if (conn->pipe[0] >= 0) {
+    close(conn->pipe[0]);
+    close(conn->pipe[1]);
+  }
+  http_response_release(&conn->response);
+  arena_destroy(&conn->arena);
+  if (loop->num_free_conns >= EVLOOP_MAX_FREE_CONNS) {
+    free(conn);
+    return;
+  }
+  conn->next = loop->free_conns;
+  loop->free_conns = conn;
+  loop->num_free_conns++;
+}
+
+/* Closes CONN. Submissions still in flight are cut short by shutting the
+ * socket down, and CONN is freed when the last of them completes. */
+static void conn_close(uring_loop_t *loop, uring_conn_t *conn) {
+  if (conn->closing) return;
+  conn->closing = 1;
+  DL_DELETE(loop->conns, conn);
+  if (conn->inflight > 0) {
+    shutdown(conn->http.fd, SHUT_RDWR);
+  } else {
+    conn_destroy(loop, conn);
+  }
+}
+
+static void conn_recv(uring_loop_t *loop, uring_conn_t *conn) {
+  size_t space = http_conn_reserve(&conn->http);
+  struct io_uring_sqe *sqe = loop_sqe(loop, conn, URING_RECV);
+  if (sqe == NULL) {
+    conn_close(loop, conn);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->http.fd;
+  sqe->len = space < URING_BUFFER_SIZE ? space : URING_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+/* Finds the part of RESPONSE's body that byte POSITION is in: a segment or
+ * the whole body. Sets *MORE if other parts follow it. Returns the offset
+ * into that part, or -1 past the end. */
+static ssize_t conn_body_part(struct http_response *response, size_t position,
+    struct http_segment *part, int *more) {
+  *more = 0;
+  if (response->segments != NULL) {
+    int i = 0;
+    while (i < response->num_segments
+        && position >= response->segments[i].length) {
+      position -= response->segments[i].length;
+      i++;
+    }
+    if (i == response->num_segments) return -1;
+    *part = response->segments[i];
+    *more = i + 1 < response->num_segments;
+  } else if (response->file_fd >= 0) {
+    part->data = NULL;
+    part->offset = response->file_offset;
+    part->length = response->file_length;
+  } else {
+    part->data = response->body;
+    part->length = response->body_length;
+  }
+  return position < part->length ? (ssize_t) position : -1;
+}
+
+/* Queues a SPLICE of LENGTH bytes from the pipe to CONN's socket. */
+static struct io_uring_sqe *conn_splice_out(uring_loop_t *loop,
+    uring_conn_t *conn, size_t length, int more) {
+  struct io_uring_sqe *sqe = loop_sqe(loop, conn, URING_SPLICE_OUT);
+  if (sqe == NULL) return NULL;
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->splice_fd_in = conn->pipe[0];
+  sqe->splice_off_in = (uint64_t) -1;
+  sqe->fd = conn->http.fd;
+  sqe->off = (uint64_t) -1;
+  sqe->len = length;
+  sqe->splice_flags = more ? SPLICE_F_MORE : 0;
+  return sqe;
+}
+
+/* Queues a SEND of LENGTH bytes at DATA on CONN's socket. */
+static struct io_uring_sqe *conn_send_data(uring_loop_t *loop,
+    uring_conn_t *conn, char *data, size_t length, int more) {
+  struct io_uring_sqe *sqe = loop_sqe(loop, conn, URING_SEND);
+  if (sqe == NULL) return NULL;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->http.fd;
+  sqe->addr = (uintptr_t) data;
+  sqe->len = length;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+  return sqe;
+}
+
+static void conn_finish_response(uring_loop_t *loop, uring_conn_t *conn);
+
+/* Queues the next piece of CONN's response: head and in-memory body in one
+ * SENDMSG, a data segment in one SEND, a small file part as a READ linked to
+ * its SEND, or the next chunk of a large file as a SPLICE into the pipe
+ * linked to a SPLICE out of it. */
+static void conn_send(uring_loop_t *loop, uring_conn_t *conn) {
+  struct http_response *response = &conn->response;
+  size_t body_length = http_response_content_length(response);
+  int simple = response->file_fd < 0 && response->segments == NULL;
+  struct io_uring_sqe *sqe;
+
+  if (conn->chunked > 0) {
+    /* Read short, so its SEND was cancelled: send what did arrive. */
+    if (conn_send_data(loop, conn, conn->chunk, conn->chunked, 1) == NULL)
+      conn_close(loop, conn);
+    conn->chunked = 0;
+    return;
+  }
+  if (conn->piped > 0) {
+    /* Left over from a chunk that did not go out whole. */
+    if (conn_splice_out(loop, conn, conn->piped, 0) == NULL)
+      conn_close(loop, conn);
+    return;
+  }
+  if (conn->sent >= conn->head.length + body_length) {
+    conn_finish_response(loop, conn);
+    return;
+  }
+
+  if (conn->sent < conn->head.length || simple) {
+    int iovcnt = 0;
+    if (conn->sent < conn->head.length) {
+      conn->iov[iovcnt].iov_base = conn->head.data + conn->sent;
+      conn->iov[iovcnt].iov_len = conn->head.length - conn->sent;
+      iovcnt++;
+    }
+    if (simple && response->body_length > 0) {
+      size_t body_sent = conn->sent > conn->head.length
+          ? conn->sent - conn->head.length : 0;
+      conn->iov[iovcnt].iov_base = response->body + body_sent;
+      conn->iov[iovcnt].iov_len = response->body_length - body_sent;
+      iovcnt++;
+    }
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = iovcnt;
+    if ((sqe = loop_sqe(loop, conn, URING_SEND)) == NULL) {
+      conn_close(loop, conn);
+      return;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->http.fd;
+    sqe->addr = (uintptr_t) &conn->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL
+        | (!simple && body_length > 0 ? MSG_MORE : 0);
+    return;
+  }
+
+  struct http_segment part = { 0 };
+  int more;
+  ssize_t offset = conn_body_part(response, conn->sent - conn->head.length,
+      &part, &more);
+  if (offset < 0) {
+    conn_close(loop, conn);
+    return;
+  }
+  size_t length = part.length - offset;
+
+  if (part.data != NULL) {
+    if (conn_send_data(loop, conn, part.data + offset, length, more) == NULL)
+      conn_close(loop, conn);
+    return;
+  }
+
+  if (part.length <= URING_READ_MAX) {
+    /* Both halves of the link must go to the kernel in the same submission. */
+    if ((conn->chunk = arena_alloc(&conn->arena, length)) == NULL
+        || !loop_room(loop, 2)) {
+      conn_close(loop, conn);
+      return;
+    }
+    sqe = loop_sqe(loop, conn, URING_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = response->file_fd;
+    sqe->off = part.offset + offset;
+    sqe->addr = (uintptr_t) conn->chunk;
+    sqe->len = length;
+    conn->chunked = length;
+    conn_send_data(loop, conn, conn->chunk, length, more);
+    return;
+  }
+
+  if (conn->pipe[0] < 0 && pipe2(conn->pipe, O_CLOEXEC) < 0) {
+    conn_close(loop, conn);
+    return;
+  }
+  if (length > RELAY_PIPE_SIZE) {
+    length = RELAY_PIPE_SIZE;
+    more = 1;
+  }
+  /* Both halves of the link must go to the kernel in the same submission. */
+  if (!loop_room(loop, 2)) {
+    conn_close(loop, conn);
+    return;
+  }
+  sqe = loop_sqe(loop, conn, URING_SPLICE_IN);
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->splice_fd_in = response->file_fd;
+  sqe->splice_off_in = part.offset + offset;
+  sqe->fd = conn->pipe[1];
+  sqe->off = (uint64_t) -1;
+  sqe->len = length;
+  conn_splice_out(loop, conn, length, more);
+}
+
+/* Builds the response to REQUEST and starts sending it. */
+static void conn_start_response(uring_loop_t *loop, uring_conn_t *conn,
+    struct http_request *request) {
+  if (loop->options->complete != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &conn->started);
+  conn->request = request;
+  loop->options->prepare(request, &conn->response, &conn->arena);
+  conn->response.keep_alive = http_conn_keep_alive(&conn->http, request,
+      loop->options->max_requests);
+
+  if (http_format_response_head(&conn->response, &conn->head) < 0) {
+    http_response_release(&conn->response);
+    conn->response.status_code = 500;
+    http_format_response_head(&conn->response, &conn->head);
+  }
+  conn->sent = 0;
+  conn->piped = 0;
+  conn->chunked = 0;
+  conn->writing = 1;
+  conn_send(loop, conn);
+}
+
+/* Answers the next request buffered on CONN, or waits for more bytes. */
+static void conn_next_request(uring_loop_t *loop, uring_conn_t *conn) {
+  struct http_request *request;
+  if (http_conn_take_request(&conn->http, &request)) {
+    conn_start_response(loop, conn, request);
+  } else {
+    conn_recv(loop, conn);
+  }
+}
+
+static void conn_complete(uring_loop_t *loop, uring_conn_t *conn) {
+  if (loop->options->complete == NULL) return;
+  size_t body_sent = conn->sent > conn->head.length
+      ? conn->sent - conn->head.length : 0;
+  loop->options->complete((struct sockaddr *) &conn->peer, conn->request,
+      &conn->response, body_sent, &conn->started);
+}
+
+static void conn_finish_response(uring_loop_t *loop, uring_conn_t *conn) {
+  conn_complete(loop, conn);
+  conn->writing = 0;
+  int keep_alive = conn->response.keep_alive;
+  http_response_release(&conn->response);
+  arena_destroy(&conn->arena);
+  if (keep_alive) {
+    conn_next_request(loop, conn);
+  } else {
+    conn_close(loop, conn);
+  }
+}
+
+static void loop_add_conn(uring_loop_t *loop, int fd) {
+  uring_conn_t *conn = loop->free_conns;
+  if (conn != NULL) {
+    loop->free_conns = conn->next;
+    loop->num_free_conns--;
+  } else if ((conn = malloc(sizeof(uring_conn_t))) == NULL) {
+    close(fd);
+    return;
+  }
+  memset(conn, 0, sizeof(uring_conn_t));
+  arena_init(&conn->arena);
+  http_conn_init(&conn->http, fd);
+  http_response_init(&conn->response);
+  conn->pipe[0] = conn->pipe[1] = -1;
+  if (loop->options->complete != NULL) {
+    socklen_t length = sizeof(conn->peer);
+    if (getpeername(fd, (struct sockaddr *) &conn->peer, &length) < 0)
+      conn->peer.ss_family = AF_UNSPEC;
+  }
+  conn->last_active = loop_now();
+  DL_APPEND(loop->conns, conn);
+  conn_recv(loop, conn);
+}
+
+/* Handles the completion of OP on CONN with result RES. */
+static void conn_handle(uring_loop_t *loop, uring_conn_t *conn, uring_op_t op,
+    int res, unsigned int flags) {
+  conn->inflight--;
+  if (op == URING_RECV && (flags & IORING_CQE_F_BUFFER)) {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0 && !conn->closing) {
+      memcpy(conn->http.buffer + conn->http.length,
+          loop->buffer_data + bid * URING_BUFFER_SIZE, res);
+      conn->http.length += res;
+    }
+    loop_recycle(loop, bid);
+  }
+  if (conn->closing) {
+    if (conn->inflight == 0) conn_destroy(loop, conn);
+    return;
+  }
+
+  switch (op) {
+    case URING_RECV:
+      if (res == -ENOBUFS) {
+        conn_recv(loop, conn);    // All buffers are taken; try again.
+      } else if (res <= 0) {
+        conn_close(loop, conn);
+      } else {
+        conn_touch(loop, conn);
+        conn_next_request(loop, conn);
+      }
+      return;
+    case URING_READ:
+      /* A short read cancels the linked SEND; send the rest on its own. */
+      if (res <= 0) {
+        conn_close(loop, conn);
+        return;
+      }
+      conn->chunked = (size_t) res < conn->chunked ? (size_t) res : 0;
+      break;
+    case URING_SEND:
+      if (res == -ECANCELED) break;
+      if (res <= 0) {
+        conn_close(loop, conn);
+        return;
+      }
+      conn->sent += res;
+      break;
+    case URING_SPLICE_IN:
+      /* A short or failed read cancels the linked SPLICE out. */
+      if (res <= 0) {
+        conn_close(loop, conn);
+        return;
+      }
+      conn->piped += res;
+      break;
+    case URING_SPLICE_OUT:
+      if (res == -ECANCELED) break;
+      if (res <= 0) {
+        conn_close(loop, conn);
+        return;
+      }
+      conn->piped -= res;
+      conn->sent += res;
+      break;
+    default:
+      break;
+  }
+  conn_touch(loop, conn);
+  if (conn->inflight == 0) conn_send(loop, conn);
+}
+
+static void loop_handle(uring_loop_t *loop, struct io_uring_cqe *cqe) {
+  uring_op_t op = cqe->user_data & URING_OP_MASK;
+  if (op == URING_ACCEPT) {
+    if (cqe->res >= 0) {
+      loop_add_conn(loop, cqe->res);
+    } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+      fprintf(stderr, "Error accepting socket: %s\n", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) loop_accept_more(loop);
+    return;
+  }
+  uring_conn_t *conn = (uring_conn_t *) (uintptr_t)
+      (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+  conn_handle(loop, conn, op, cqe->res, cqe->flags);
+}
+
+/* Closes connections that have made no progress for idle_timeout seconds.
+ * The list is ordered by last activity, so only its head needs checking. */
+static void loop_expire(uring_loop_t *loop) {
+  time_t deadline = loop_now() - loop->options->idle_timeout;
+  while (loop->conns != NULL && loop->conns->last_active <= deadline) {
+    conn_close(loop, loop->conns);
+  }
+}
+
+static void *loop_thread_function(void *arg) {
+  uring_loop_t *loop = arg;
+  struct timespec mark;
+
+  if (loop->options->pin_cpus) evloop_pin_cpu(loop->index);
+  /* The ring is created here: with SINGLE_ISSUER only its creator may
+   * submit to it. */
+  if (loop_open(loop) < 0) {
+    perror("Failed to set up io_uring");
+    exit(EXIT_FAILURE);
+  }
+  loop_accept_more(loop);
+
+  stats_name_thread("uring", loop->index);
+  clock_gettime(CLOCK_MONOTONIC, &mark);
+  while (1) {
+    if (loop_enter(loop, 1) < 0 && errno != EINTR && errno != ETIME
+        && errno != EBUSY) {
+      perror("io_uring_enter failed");
+      return NULL;
+    }
+    stats_idle(&mark);
+    unsigned int head = *loop->cq_head;
+    unsigned int tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      loop_handle(loop, &loop->cqes[head & loop->cq_mask]);
+      /* Free the slot now: handling may enter the ring again. */
+      __atomic_store_n(loop->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    loop_expire(loop);
+    stats_busy(&mark);
+  }
+}
+
+void uring_run(int listen_fd, ev_options_t *options) {
+  int num_loops = options->num_loops < 1 ? 1 : options->num_loops;
+  printf("Starting %d io_uring loop threads...\n", num_loops);
+
+  uring_loop_t *loops = calloc(num_loops, sizeof(uring_loop_t));
+  for (int i = 0; i < num_loops; i++) {
+    loops[i].index = i;
+    loops[i].listen_fd = options->listen_fds ? options->listen_fds[i] : listen_fd;
+    loops[i].options = options;
+    pthread_create(&loops[i].thread, NULL, &loop_thread_function, &loops[i]);
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    pthread_join(loops[i].thread, NULL);
+  }
+  free(loops);
+}
@@ -0,0 +1,106 @@
+#ifndef __URING__
+#define __URING__
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "arena.h"
+#include "evloop.h"
+#include "libhttp.h"
+
+/* URING serves connections like EVLOOP, with the same options and the same
+ * PREPARE callback, but drives all socket I/O through one io_uring per loop
+ * thread instead of epoll readiness plus a syscall per operation. The ring is
+ * set up with raw syscalls and the uapi header, so no liburing is needed.
+ *
+ * A multishot accept keeps delivering new connections from a single
+ * submission. Requests are received into buffers the loop provides to the
+ * kernel up front (a registered buffer ring), so a recv needs no buffer of
+ * its own until data arrives. In-memory bodies go out with the head in one
+ * SENDMSG. A file body of up to URING_READ_MAX bytes is read into the
+ * request's arena by a READ linked to the SEND of it; both normally complete
+ * inline from the page cache. Larger files are moved with linked SPLICE
+ * submissions (file to a pipe, pipe to the socket), RELAY_PIPE_SIZE bytes
+ * per link, without a copy through userspace; SPLICE always runs on an
+ * io-wq thread, which only pays off for large bodies. Everything a loop
+ * iteration queues is submitted with the same io_uring_enter call that waits
+ * for the next completions.
+ *
+ * Finding and opening the file stays in PREPARE: behind the file caches and
+ * the inotify watch most hits need neither stat() nor open(), so moving
+ * those to IORING_OP_STATX/OPENAT would not save a transition on the hot
+ * path. uring_supported checks for every feature used (kernel 5.19 or
+ * later); callers fall back to EVLOOP when it fails. */
+
+#define URING_ENTRIES 1024          // Submission queue; the CQ is 4x larger.
+#define URING_BUFFERS 256           // Provided receive buffers per loop.
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_READ_MAX (256 * 1024)  // Larger file bodies are spliced.
+
+/* What a submission was for, kept in the low bits of its user_data; the
+ * rest is the connection, which is ARENA_ALIGNMENT aligned. */
+typedef enum {
+  URING_ACCEPT = 1,
+  URING_RECV,
+  URING_SEND,
+  URING_SPLICE_IN,
+  URING_SPLICE_OUT,
+  URING_READ
+} uring_op_t;
+
+#define URING_OP_MASK 7
+
+typedef struct uring_conn {
+  struct http_conn http;    // Socket and buffered (pipelined) requests.
+  struct sockaddr_storage peer;
+  int writing;              // Response in progress, else reading.
+  int closing;              // Close once nothing is in flight.
+  int inflight;             // Submissions not completed yet.
+  time_t last_active;
+
+  struct http_request *request;   // Being answered; in http's buffer.
+  struct http_response response;
+  struct http_builder head;
+  size_t sent;              // Bytes of head + body written so far.
+  struct iovec iov[2];      // Head and in-memory body for SENDMSG.
+  struct msghdr msg;
+  int pipe[2];              // For file bodies; opened on first use.
+  size_t piped;             // Bytes sitting in the pipe.
+  char *chunk;              // File bytes READ for sending; in the arena.
+  size_t chunked;           // Asked of the READ in flight; after a short
+                            // read, what its cancelled SEND left behind.
+  struct timespec started;
+
+  arena_t arena;            // The current request's memory; holds no slab
+                            // while the connection is idle.
+
+  struct uring_conn *next;  // Loop's connections, least recently active
+  struct uring_conn *prev;  // first.
+} uring_conn_t;
+
+typedef struct uring_loop {
+  int index;
+  int ring_fd;
+  int listen_fd;
+  unsigned int sq_mask, cq_mask;
+  unsigned int *sq_head, *sq_tail, *sq_array;
+  unsigned int *cq_head, *cq_tail;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned int sq_local_tail;     // Queued but not yet submitted up to here.
+  struct io_uring_buf_ring *buffers;
+  char *buffer_data;
+  ev_options_t *options;
+  uring_conn_t *conns;
+  uring_conn_t *free_conns;   // Singly linked through next; at most
+  int num_free_conns;         // EVLOOP_MAX_FREE_CONNS.
+  pthread_t thread;
+} uring_loop_t;
+
+int uring_supported(void);
+void uring_run(int listen_fd, ev_options_t *options);
+
+#endif
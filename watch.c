@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "watch.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE \
+    | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF \
+    | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* Records that something changed; see the generation check in watch.h. Must
+ * come before the matching invalidations. */
+static void watch_bump(watch_t *watch) {
+  __atomic_add_fetch(&watch->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+static void watch_invalidate(watch_t *watch, char *path, int tree) {
+  for (int i = 0; i < watch->num_caches; i++) {
+    if (tree) {
+      fcache_invalidate_prefix(watch->caches[i], path);
+    } else {
+      fcache_invalidate(watch->caches[i], path);
+    }
+  }
+}
+
+/* Suffixes of precompressed sidecars. Entries for a file record which of
+ * its sidecars exist, so a change to PATH.gz also invalidates PATH. */
+static const char *watch_sidecar_suffixes[] = { ".br", ".gz" };
+
+static void watch_invalidate_sidecar_owner(watch_t *watch, char *path) {
+  size_t length = strlen(path);
+  for (size_t i = 0; i < sizeof(watch_sidecar_suffixes)
+      / sizeof(watch_sidecar_suffixes[0]); i++) {
+    size_t suffix_length = strlen(watch_sidecar_suffixes[i]);
+    if (length <= suffix_length
+        || strcmp(path + length - suffix_length, watch_sidecar_suffixes[i]))
+      continue;
+    path[length - suffix_length] = '\0';
+    watch_invalidate(watch, path, 0);
+    path[length - suffix_length] = watch_sidecar_suffixes[i][0];
+  }
+}
+
+/* Remembers that watch descriptor WD is the directory PATH. */
+static int watch_set_path(watch_t *watch, int wd, char *path) {
+  if (wd >= watch->num_paths) {
+    int num_paths = watch->num_paths ? watch->num_paths : 64;
+    while (num_paths <= wd) num_paths *= 2;
+    char **paths = realloc(watch->paths, num_paths * sizeof(char *));
+    if (paths == NULL) return -1;
+    memset(paths + watch->num_paths, 0,
+        (num_paths - watch->num_paths) * sizeof(char *));
+    watch->paths = paths;
+    watch->num_paths = num_paths;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL) return -1;
+  free(watch->paths[wd]);
+  watch->paths[wd] = copy;
+  return 0;
+}
+
+/* Watches the directory PATH and every directory below it. Returns how many
+ * of them could not be watched. */
+static int watch_add_tree(watch_t *watch, char *path) {
+  int wd = inotify_add_watch(watch->inotify_fd, path, WATCH_MASK);
+  if (wd < 0) {
+    /* It may just have been removed, which will be reported. */
+    if (errno == ENOENT || errno == ENOTDIR) return 0;
+    fprintf(stderr, "Cannot watch %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (watch_set_path(watch, wd, path) < 0) return 1;
+
+  DIR *dir = opendir(path);
+  if (dir == NULL) return 0;
+  int missing = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char *child;
+    if (asprintf(&child, "%s/%s", path, entry->d_name) < 0) {
+      missing++;
+      break;
+    }
+    struct stat info;
+    if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN
+          && lstat(child, &info) == 0 && S_ISDIR(info.st_mode)))
+      missing += watch_add_tree(watch, child);
+    free(child);
+  }
+  closedir(dir);
+  return missing;
+}
+
+/* Stops watching PATH and the directories below it, which have left the
+ * tree (their descriptors would otherwise report changes under old paths). */
+static void watch_remove_tree(watch_t *watch, char *path) {
+  size_t length = strlen(path);
+  for (int wd = 0; wd < watch->num_paths; wd++) {
+    char *watched = watch->paths[wd];
+    if (watched != NULL && strncmp(watched, path, length) == 0
+        && (watched[length] == '\0' || watched[length] == '/')) {
+      inotify_rm_watch(watch->inotify_fd, wd);
+      free(watched);
+      watch->paths[wd] = NULL;
+    }
+  }
+}
+
+/* Drops all trust and watches the whole tree again. */
+static void watch_rescan(watch_t *watch) {
+  __atomic_store_n(&watch->complete, 0, __ATOMIC_SEQ_CST);
+  watch_bump(watch);
+  for (int i = 0; i < watch->num_caches; i++)
+    fcache_distrust_all(watch->caches[i]);
+
+  int complete = watch_add_tree(watch, watch->root) == 0;
+  __atomic_store_n(&watch->complete, complete, __ATOMIC_SEQ_CST);
+  if (!complete)
+    fprintf(stderr, "Watching %s incompletely; retrying in %d seconds\n",
+        watch->root, WATCH_RESCAN_INTERVAL);
+}
+
+static void watch_handle_event(watch_t *watch, struct inotify_event *event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    fprintf(stderr, "Lost file change events under %s; rescanning\n",
+        watch->root);
+    watch_rescan(watch);
+    return;
+  }
+  if (event->wd < 0 || event->wd >= watch->num_paths
+      || watch->paths[event->wd] == NULL)
+    return;
+  char *dir = watch->paths[event->wd];
+
+  if (event->mask & IN_IGNORED) {
+    free(dir);
+    watch->paths[event->wd] = NULL;
+    return;
+  }
+  if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    watch_bump(watch);
+    watch_invalidate(watch, dir, 1);
+    if (strcmp(dir, watch->root) == 0) {
+      fprintf(stderr, "%s was removed or moved\n", watch->root);
+      __atomic_store_n(&watch->complete, 0, __ATOMIC_SEQ_CST);
+    }
+    return;
+  }
+
+  char *path;
+  if (event->len == 0 || asprintf(&path, "%s/%s", dir, event->name) < 0) {
+    watch_bump(watch);
+    watch_invalidate(watch, dir, 0);
+    return;
+  }
+  if (event->mask & IN_ISDIR) {
+    if (event->mask & IN_MOVED_FROM) watch_remove_tree(watch, path);
+    /* Watch a new directory before invalidating, so that anything cached
+     * from it before the watch existed is dropped. */
+    if ((event->mask & (IN_CREATE | IN_MOVED_TO))
+        && watch_add_tree(watch, path) > 0)
+      __atomic_store_n(&watch->complete, 0, __ATOMIC_SEQ_CST);
+  }
+  watch_bump(watch);
+  watch_invalidate(watch, path, event->mask & IN_ISDIR);
+  if (!(event->mask & IN_ISDIR)) watch_invalidate_sidecar_owner(watch, path);
+  watch_invalidate(watch, dir, 0);   // Its listing.
+  free(path);
+}
+
+/* THREAD FUNCTION */
+static void *watch_thread_function(void *arg) {
+  watch_t *watch = arg;
+  char buffer[WATCH_EVENT_BUFFER_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pollfd = { .fd = watch->inotify_fd, .events = POLLIN };
+
+  while (1) {
+    int timeout = watch_healthy(watch) ? -1 : WATCH_RESCAN_INTERVAL * 1000;
+    int ready = poll(&pollfd, 1, timeout);
+    if (ready < 0 && errno != EINTR) break;
+    if (ready == 0) {
+      watch_rescan(watch);
+      continue;
+    }
+    ssize_t n = read(watch->inotify_fd, buffer, sizeof(buffer));
+    if (n <= 0) continue;
+    for (char *p = buffer; p < buffer + n; ) {
+      struct inotify_event *event = (struct inotify_event *) p;
+      watch_handle_event(watch, event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  perror("Stopped watching for file changes");
+  __atomic_store_n(&watch->complete, 0, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+/*
+ * Starts watching the directory tree at ROOT (an absolute path without
+ * symlinks, as returned by realpath) on behalf of CACHES, whose entries are
+ * keyed by absolute path. Returns -1 if inotify is not available.
+ */
+int watch_init(watch_t *watch, char *root, fcache_t **caches,
+    int num_caches) {
+  memset(watch, 0, sizeof(*watch));
+  watch->root = root;
+  watch->caches = caches;
+  watch->num_caches = num_caches;
+  watch->inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (watch->inotify_fd < 0) {
+    perror("Cannot watch for file changes");
+    return -1;
+  }
+  watch_rescan(watch);
+  pthread_create(&watch->thread, NULL, &watch_thread_function, watch);
+  return 0;
+}
+
+/* Returns 1 while every change in the tree is being reported. */
+int watch_healthy(watch_t *watch) {
+  return __atomic_load_n(&watch->complete, __ATOMIC_SEQ_CST);
+}
+
+unsigned long watch_generation(watch_t *watch) {
+  return __atomic_load_n(&watch->generation, __ATOMIC_SEQ_CST);
+}
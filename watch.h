@@ -0,0 +1,47 @@
+#ifndef __WATCH__
+#define __WATCH__
+
+#include <pthread.h>
+
+#include "fcache.h"
+
+/* WATCH follows changes below a directory tree with inotify and invalidates
+ * the affected paths in a set of caches, so cached entries can be trusted
+ * without a stat() on every hit (see fcache_peek).
+ *
+ * A thread registers a watch on every directory of the tree, adding watches
+ * as directories appear, and for each change removes the changed path, its
+ * parent directory and, for directories, everything below it from every
+ * cache (and, for a precompressed PATH.gz or PATH.br, PATH, whose entries
+ * record which such sidecars exist). Each change also bumps a generation
+ * counter: a request that reads the generation before its stat() and finds
+ * it unchanged after caching the result knows no change slipped in between,
+ * and may trust the entry.
+ *
+ * If the kernel's event queue overflows, or a watch cannot be added (e.g.
+ * the fs.inotify.max_user_watches limit), the watch is degraded: every entry
+ * loses its trust and the thread rescans the tree, retrying every
+ * WATCH_RESCAN_INTERVAL seconds until all directories are covered again.
+ * Changes made through symlinks or hard links from outside the tree are not
+ * seen, so callers should only trust paths that resolve to themselves. */
+
+#define WATCH_RESCAN_INTERVAL 10
+#define WATCH_EVENT_BUFFER_SIZE (64 * 1024)
+
+typedef struct watch {
+  char *root;               // Without a trailing slash.
+  int inotify_fd;
+  char **paths;             // Directory path by watch descriptor.
+  int num_paths;
+  fcache_t **caches;
+  int num_caches;
+  unsigned long generation;
+  int complete;             // Every directory is watched.
+  pthread_t thread;
+} watch_t;
+
+int watch_init(watch_t *watch, char *root, fcache_t **caches, int num_caches);
+int watch_healthy(watch_t *watch);
+unsigned long watch_generation(watch_t *watch);
+
+#endif
@@ -1,52 +1,197 @@
-#include <stdlib.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "wq.h"
-#include "utlist.h"
 
-/* Initializes a work queue WQ. */
-void wq_init(wq_t *wq) {
+static void futex_wait(int *address, int value, struct timespec *timeout) {
+  syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake(int *address, int count) {
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
-  /* TODO: Make me thread-safe! */
+/* Wakes the threads sleeping on EVENT, if there are any. The caller has
+ * already published the change the sleepers are waiting for; the fence orders
+ * that against the check of the waiters bit, so when nobody sleeps this costs
+ * no shared write and no syscall. Clearing the bit also means only the first
+ * signal after a thread goes to sleep pays for the wake-up. */
+static void wq_event_signal(wq_event_t *event) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int sequence = __atomic_load_n(&event->sequence, __ATOMIC_RELAXED);
+  if ((sequence & WQ_EVENT_WAITERS)
+      && __atomic_compare_exchange_n(&event->sequence, &sequence,
+        (sequence + 2) & ~WQ_EVENT_WAITERS, 0, __ATOMIC_SEQ_CST,
+        __ATOMIC_RELAXED))
+    futex_wake(&event->sequence, INT_MAX);
+}
 
-  wq->size = 0;
-  wq->head = NULL;
-  pthread_cond_init(&wq->work_cond, NULL);
-  pthread_mutex_init(&wq->work_mut, NULL);
+/* Sets the waiters bit on EVENT and returns the value to sleep on. The caller
+ * must re-check its condition before sleeping, so a signal that lands in
+ * between either sees the bit or changes the value. */
+static int wq_event_prepare_wait(wq_event_t *event) {
+  int sequence = __atomic_or_fetch(&event->sequence, WQ_EVENT_WAITERS,
+      __ATOMIC_SEQ_CST);
+  return sequence;
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
-  /* TODO: Make me blocking and thread-safe! */
+/* Sleeps until EVENT is signalled or TIMEOUT_MS (if not negative) passes. */
+static void wq_event_wait(wq_event_t *event, int sequence, int timeout_ms) {
+  struct timespec timeout, *timeout_ptr = NULL;
+  if (timeout_ms >= 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    timeout_ptr = &timeout;
+  }
+  futex_wait(&event->sequence, sequence, timeout_ptr);
+}
 
-  pthread_mutex_lock(&wq->work_mut); // lock
+/* Attempts to put CLIENT_SOCKET_FD into the ring. Returns 0 if it is full. */
+static int wq_ring_push(wq_t *wq, int client_socket_fd) {
+  unsigned long pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+  wq_item_t *item;
 
-  wq_item_t *wq_item = wq->head;
-  if (wq->head == NULL) {
-    pthread_cond_wait(&wq->work_cond, &wq->work_mut); // suspend until the queue is non-empty
+  while (1) {
+    item = &wq->items[pos & (WQ_CAPACITY - 1)];
+    unsigned long sequence = __atomic_load_n(&item->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) sequence - (long) pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->tail, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+    }
   }
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  item->client_socket_fd = client_socket_fd;
+  __atomic_store_n(&item->enqueued, now.tv_sec * 1000000000LL + now.tv_nsec,
+      __ATOMIC_RELAXED);
+  __atomic_store_n(&item->sequence, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
 
-  free(wq_item);
+/* Attempts to take a socket out of the ring. Returns -1 if it is empty. */
+static int wq_ring_pop(wq_t *wq) {
+  unsigned long pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+  wq_item_t *item;
 
-  pthread_mutex_unlock(&wq->work_mut); // unlock
+  while (1) {
+    item = &wq->items[pos & (WQ_CAPACITY - 1)];
+    unsigned long sequence = __atomic_load_n(&item->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) sequence - (long) (pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->head, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+    }
+  }
+  int client_socket_fd = item->client_socket_fd;
+  __atomic_store_n(&item->sequence, pos + WQ_CAPACITY, __ATOMIC_RELEASE);
+  return client_socket_fd;
+}
 
+/* Initializes a work queue WQ. */
+void wq_init(wq_t *wq) {
+  wq->head = 0;
+  wq->tail = 0;
+  wq->size = 0;
+  wq->peak_size = 0;
+  wq->not_empty.sequence = 0;
+  wq->not_full.sequence = 0;
+  for (unsigned long i = 0; i < WQ_CAPACITY; i++) {
+    wq->items[i].sequence = i;
+  }
+}
+
+/* Removes an item from WQ without blocking. Returns -1 if WQ is empty. */
+int wq_try_pop(wq_t *wq) {
+  int client_socket_fd = wq_ring_pop(wq);
+  if (client_socket_fd >= 0) {
+    __atomic_sub_fetch(&wq->size, 1, __ATOMIC_RELAXED);
+    wq_event_signal(&wq->not_full);
+  }
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
+/* Removes an item from WQ, waiting up to TIMEOUT_MS for one to arrive (or
+ * forever if TIMEOUT_MS is negative). Returns -1 if none did. */
+int wq_pop_timeout(wq_t *wq, int timeout_ms) {
+  int client_socket_fd;
 
-  /* TODO: Make me thread-safe! */
+  while ((client_socket_fd = wq_try_pop(wq)) < 0) {
+    int sequence = wq_event_prepare_wait(&wq->not_empty);
+    if ((client_socket_fd = wq_try_pop(wq)) >= 0) break;
+    wq_event_wait(&wq->not_empty, sequence, timeout_ms);
+    if (timeout_ms >= 0) return wq_try_pop(wq);
+  }
+  return client_socket_fd;
+}
 
-  pthread_mutex_lock(&wq->work_mut); // lock
+/* Remove an item from the WQ. This function blocks until there is at least
+ * one item on the queue. */
+int wq_pop(wq_t *wq) {
+  return wq_pop_timeout(wq, -1);
+}
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
+/* Wakes a thread sleeping in wq_pop_timeout on WQ without adding anything,
+ * e.g. so that it can look for work elsewhere. */
+void wq_wake(wq_t *wq) {
+  wq_event_signal(&wq->not_empty);
+}
 
-  pthread_cond_signal(&wq->work_cond); // wake a thread up
-  pthread_mutex_unlock(&wq->work_mut); // unlock
+/* Returns when the item at the head of WQ, the one that has waited longest,
+ * was pushed (in CLOCK_MONOTONIC nanoseconds), or 0 if WQ is empty. Meant
+ * for monitoring from any thread: if the item is popped while it is being
+ * read the answer may be a moment out of date, but never torn. */
+long long wq_oldest(wq_t *wq) {
+  unsigned long pos = __atomic_load_n(&wq->head, __ATOMIC_ACQUIRE);
+  wq_item_t *item = &wq->items[pos & (WQ_CAPACITY - 1)];
+  if (__atomic_load_n(&item->sequence, __ATOMIC_ACQUIRE) != pos + 1) return 0;
+  long long enqueued = __atomic_load_n(&item->enqueued, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&item->sequence, __ATOMIC_RELAXED) != pos + 1) return 0;
+  return enqueued;
+}
+
+/* Counts one more item in WQ, keeping track of the peak. */
+static void wq_count_push(wq_t *wq) {
+  int size = __atomic_add_fetch(&wq->size, 1, __ATOMIC_RELAXED);
+  int peak = __atomic_load_n(&wq->peak_size, __ATOMIC_RELAXED);
+  while (size > peak && !__atomic_compare_exchange_n(&wq->peak_size, &peak,
+        size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Add ITEM to WQ. Blocks while the queue is full. */
+void wq_push(wq_t *wq, int client_socket_fd) {
+  wq_count_push(wq);
+  while (!wq_ring_push(wq, client_socket_fd)) {
+    int sequence = wq_event_prepare_wait(&wq->not_full);
+    if (wq_ring_push(wq, client_socket_fd)) break;
+    wq_event_wait(&wq->not_full, sequence, -1);
+  }
+
+  wq_event_signal(&wq->not_empty);
+}
+
+/* Adds ITEM to WQ without blocking. Returns -1 if the queue is full. */
+int wq_try_push(wq_t *wq, int client_socket_fd) {
+  wq_count_push(wq);
+  if (!wq_ring_push(wq, client_socket_fd)) {
+    __atomic_sub_fetch(&wq->size, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  wq_event_signal(&wq->not_empty);
+  return 0;
 }
@@ -4,24 +4,51 @@
 #include <pthread.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a fixed-capacity, lock-free multi-producer/multi-consumer ring
+ * (Vyukov's bounded queue): every slot carries a sequence number that tells
+ * producers and consumers whose turn it is, so a push or pop is one CAS on a
+ * shared index plus a store to the slot. Threads only sleep (on a futex) when
+ * the ring is empty (consumers) or full (producers). */
+
+#define WQ_CAPACITY 4096      // Must be a power of two.
+#define WQ_CACHE_LINE 64
 
 typedef struct wq_item {
+  unsigned long sequence;
   int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
+  long long enqueued;   // When it was pushed, in CLOCK_MONOTONIC ns.
 } wq_item_t;
 
+/* A futex-based event count: waiters set the low bit of SEQUENCE, re-check
+ * their condition, and sleep only if nobody signalled in between. Signallers
+ * bump the count (clearing the bit) only when the bit is set. */
+#define WQ_EVENT_WAITERS 1
+
+typedef struct wq_event {
+  int sequence;
+} wq_event_t;
+
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
-  pthread_cond_t work_cond;
-  pthread_mutex_t work_mut;
+  /* Producer and consumer indexes live on separate cache lines so pushes and
+   * pops do not invalidate each other's line. */
+  unsigned long tail __attribute__((aligned(WQ_CACHE_LINE)));
+  unsigned long head __attribute__((aligned(WQ_CACHE_LINE)));
+  int size __attribute__((aligned(WQ_CACHE_LINE)));
+  int peak_size;        // Largest size seen; only written when exceeded.
+  wq_event_t not_empty __attribute__((aligned(WQ_CACHE_LINE)));
+  wq_event_t not_full __attribute__((aligned(WQ_CACHE_LINE)));
+  wq_item_t items[WQ_CAPACITY] __attribute__((aligned(WQ_CACHE_LINE)));
 } wq_t;
 
 void wq_init(wq_t *wq);
 void wq_push(wq_t *wq, int client_socket_fd);
+int wq_try_push(wq_t *wq, int client_socket_fd);
 int wq_pop(wq_t *wq);
+int wq_try_pop(wq_t *wq);
+int wq_pop_timeout(wq_t *wq, int timeout_ms);
+void wq_wake(wq_t *wq);
+long long wq_oldest(wq_t *wq);
 
 #endif